@@ -3,6 +3,7 @@
 #include "types.hpp"
 #include <filesystem>
 #include <iostream>
+#include <sstream>
 #include <vector>
 
 namespace fs = std::filesystem;
@@ -36,6 +37,7 @@ public:
 class RasterInfoExtractor
 {
 public:
+  virtual ~RasterInfoExtractor() = default;
   virtual RasterInfo extractFromPath(std::string filepath) = 0;
 };
 
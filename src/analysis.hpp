@@ -0,0 +1,892 @@
+#pragma once
+
+#include "HydroDataReader.hpp"
+#include "bitmasks.hpp"
+#include "calibration.hpp"
+#include "checkpoint.hpp"
+#include "clustering.hpp"
+#include "floodsar.hpp"
+#include "gdal/gdal_priv.h"
+#include "labels.hpp"
+#include "manifest.hpp"
+#include "maps.hpp"
+#include "memory.hpp"
+#include "polarization.hpp"
+#include "rasters.hpp"
+#include "stages.hpp"
+#include "types.hpp"
+#include "tiles.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+*
+* Analysis stage of floodsar: matching cropped images from the cache with
+* gauge data, calibration of the 1D or 2D algorithm and writing results.
+* Works on .floodsar-cache of config.workDirectory, the current directory
+* by default.
+*
+*/
+
+/*
+* Parameters of the analysis stage (see command line options of floodsar).
+*/
+class AnalysisConfig
+{
+public:
+  std::string hydroDataCsvFile;
+  // start,end[,step] of thresholds (1D) or classes (2D)
+  std::vector<std::string> thresholdSequence;
+  bool isSinglePolVersion = true;
+  std::string strategy = "vv";
+  int maxiter = 100;
+  double fraction = 1.0;
+  std::vector<std::string> maxValue = { "none" };
+  bool convToDB = false;
+  bool skipClustering = false;
+  bool emitMaps = false;
+  MapOptions mapOptions;
+  // 2D: stop after this many k without a better correlation, 0 = try all
+  int kPatience = 0;
+  // 2D: stop when a k is this much below the best correlation, 0 = never
+  double kMargin = 0.0;
+  // calibrate on images decimated by this factor first, 1 = off
+  int coarseFactor = 1;
+  // thresholds or numbers of classes re-scored at full resolution
+  size_t coarseCandidates = 3;
+  // 1D threshold search: grid (every threshold) or refine
+  std::string thresholdSearch = "grid";
+  // memory budget in bytes for tiled processing, 0 = whole area at once
+  size_t tileMemory = 0;
+  // tiled processing is chosen when the predicted in-core footprint exceeds
+  // this many bytes, 0 = no budget
+  size_t memoryBudget = 0;
+  // seed of k-means sampling and initialization, 0 = random
+  unsigned int seed = 0;
+  // continue from checkpoints of an interrupted run, see checkpoint.hpp
+  bool resume = false;
+  // directory with the .floodsar-cache to analyse, where mapped/ is
+  // written; empty for the current directory
+  std::string workDirectory;
+};
+
+// dates the in-core analysis holds at once: per polarization for 1D
+inline size_t
+countInCoreDates(const SceneManifest& sceneManifest,
+                 const std::map<Date, double>& gauge,
+                 bool isSinglePolVersion)
+{
+  if (!isSinglePolVersion) {
+    return matchScenesWithGauge(
+             sceneManifest, gauge, { Polarization::VH, Polarization::VV })
+      .size();
+  }
+  return std::max(
+    matchScenesWithGauge(sceneManifest, gauge, { Polarization::VH }).size(),
+    matchScenesWithGauge(sceneManifest, gauge, { Polarization::VV }).size());
+}
+
+/*
+* Memory budget of tiled processing: the one given (--tile-memory), or the
+* memory budget when the in-core footprint predicted from the grid and the
+* number of dates would exceed it. 0 keeps the analysis in core.
+*/
+inline size_t
+chooseTileMemory(const AnalysisConfig& config,
+                 const SceneManifest& sceneManifest,
+                 const AoiMask& aoiMask,
+                 const std::map<Date, double>& gauge)
+{
+  if (config.tileMemory > 0) {
+    return config.tileMemory;
+  }
+  const GridInfo grid = sceneManifest.grid();
+  const size_t predicted = predictInCoreFootprint(
+    aoiMask.validWords(),
+    static_cast<size_t>(grid.xSize) * grid.ySize,
+    countInCoreDates(sceneManifest, gauge, config.isSinglePolVersion),
+    !config.isSinglePolVersion,
+    config.emitMaps);
+  std::cout << "Predicted in-core footprint: " << predicted / bytesPerMiB
+            << " MiB\n";
+
+  if (config.memoryBudget > 0) {
+    if (predicted <= config.memoryBudget) {
+      return 0;
+    }
+    // the GDAL block cache takes its share of the budget as well
+    const size_t cache = static_cast<size_t>(GDALGetCacheMax64());
+    const size_t tileMemory = config.memoryBudget > 2 * cache
+                                ? config.memoryBudget - cache
+                                : config.memoryBudget / 2;
+    std::cout << "Exceeds the memory budget of "
+              << config.memoryBudget / bytesPerMiB
+              << " MiB, processing in strips of " << tileMemory / bytesPerMiB
+              << " MiB\n";
+    return tileMemory;
+  }
+
+  const size_t physical = getPhysicalMemory();
+  if (physical > 0 && predicted > physical) {
+    std::cout << "WARNING: the in-core analysis needs more than the "
+              << physical / bytesPerMiB
+              << " MiB of memory of this machine, use --memory-budget or "
+                 "--tile-memory\n";
+  }
+  return 0;
+}
+
+inline int
+runAnalysis(const AnalysisConfig& config)
+{
+  const auto& hydroDataCsvFile = config.hydroDataCsvFile;
+  const auto& thresholdSequence = config.thresholdSequence;
+  const bool isSinglePolVersion = config.isSinglePolVersion;
+  const auto& strategy = config.strategy;
+  const int maxiter = config.maxiter;
+  const double fraction = config.fraction;
+  const auto& maxValue = config.maxValue;
+  const bool convToDB = config.convToDB;
+  const bool emitMaps = config.emitMaps;
+  MapOptions mapOptions = config.mapOptions;
+  // cache and map paths below resolve against the work directory
+  const WorkDirectoryScope workDirectoryScope(config.workDirectory);
+  // timings of stages are reported whenever the analysis returns
+  const StageReportScope stageReportScope;
+
+  // index of cropped scenes, the analysis never probes the file system
+  const SceneManifest sceneManifest = loadOrBuildSceneManifest();
+  std::cout << "Scene manifest: " << sceneManifest.entries.size()
+            << " cropped images\n";
+  const GridInfo grid = sceneManifest.grid();
+  // pixels outside the area of interest take no part in the analysis
+  const AoiMask aoiMask =
+    loadAoiMask(static_cast<size_t>(grid.xSize) * grid.ySize);
+
+  HydroDataReader hydroReader;
+  std::map<Date, double> obsElevationsMap;
+  std::cout << hydroDataCsvFile + "\n";
+  hydroReader.readFile(obsElevationsMap, hydroDataCsvFile);
+  printMap(obsElevationsMap);
+  std::cout << "map ok\n";
+
+  // areas too large for memory are processed in strips, see tiles.hpp
+  const size_t tileMemory =
+    chooseTileMemory(config, sceneManifest, aoiMask, obsElevationsMap);
+  const bool tiled = tileMemory > 0;
+  // map workers share the strip budget as well
+  mapOptions.memoryBudget = tileMemory;
+
+  if (isSinglePolVersion) {
+    std::cout << "Floodsar algorithm: single-pol (old)\n";
+    std::vector<double> thresholdSequenceDbl(thresholdSequence.size());
+    std::transform(thresholdSequence.begin(),
+                   thresholdSequence.end(),
+                   thresholdSequenceDbl.begin(),
+                   [](const std::string& val) { return std::stod(val); });
+    std::cout << "threshold from, to, step:\n";
+    std::cout << std::to_string(thresholdSequenceDbl[0]) + ", ";
+    std::cout << std::to_string(thresholdSequenceDbl[1]) + ", ";
+    std::cout << std::to_string(thresholdSequenceDbl[2]);
+    std::cout << "\n";
+
+    // one strip of one date is in memory at a time
+    const StripLayout strips(
+      grid.xSize, grid.ySize, sizeof(double), tileMemory);
+
+    std::vector<std::string> polarizations{ "VH", "VV" };
+    for (auto& polarization : polarizations) {
+      std::vector<double> elevations; // i.e. water levels or discharges
+      std::vector<std::string> croppedRasterPaths;
+      std::vector<Date> matchedDates;
+
+      // interesting for us are only dates when we have appropriate picture...
+      // so let's use only these...
+      const auto matched = matchScenesWithGauge(
+        sceneManifest, obsElevationsMap, { stringToPol(polarization) });
+      for (const auto& match : matched) {
+        elevations.push_back(match.elevation);
+        croppedRasterPaths.push_back(match.scenes[0]->cacheKey);
+        matchedDates.push_back(match.date);
+      }
+      writeMatchedScenes(
+        matchedScenesPath(polarization), sceneManifest, matched, 0);
+      if (croppedRasterPaths.empty()) {
+        std::cout << "No " << polarization << " images matched with gauge data\n";
+        continue;
+      }
+
+      std::vector<std::vector<double>> pixelStack;
+      if (!tiled) {
+        // every raster is read once, thresholds are then evaluated in memory
+        ScopedStage stage("load");
+        pixelStack.resize(croppedRasterPaths.size());
+        for (int i = 0; i < croppedRasterPaths.size(); i++) {
+          auto dataset = static_cast<GDALDataset*>(
+            GDALOpen(croppedRasterPaths[i].c_str(), GA_ReadOnly));
+          getPixelValuesFromRaster(dataset, pixelStack[i]);
+          GDALClose(dataset);
+          stage.addPixels(pixelStack[i].size());
+          stage.addBytesRead(getFileSize(croppedRasterPaths[i]));
+          applyAoiMask(pixelStack[i], aoiMask);
+        }
+        memoryTracker().set("pixel stack", getVectorBytes(pixelStack));
+      }
+
+      // correlations of a batch of thresholds, a tiled batch is one pass
+      // over the images
+      ThresholdScorer evaluateThresholds = [&](const std::vector<double>& batch) {
+        ScopedStage stage("correlate");
+        stage.addPixels(aoiMask.validWords() * croppedRasterPaths.size() *
+                        batch.size());
+        // flooded areas [threshold][date]
+        std::vector<std::vector<unsigned int>> floodedAreas;
+        if (tiled) {
+          floodedAreas =
+            countFloodedAreasTiled(croppedRasterPaths, batch, aoiMask, strips);
+          for (const auto& path : croppedRasterPaths) {
+            stage.addBytesRead(getFileSize(path));
+          }
+        } else {
+          return scoreThresholdsOnStack(pixelStack, batch, elevations);
+        }
+
+        std::vector<double> batchCorrelations;
+        for (auto& floodedAreaValues : floodedAreas) {
+          batchCorrelations.push_back(
+            calcCorrelationCoeff(floodedAreaValues, elevations));
+        }
+        return batchCorrelations;
+      };
+
+      // correlations are recorded as they come, --resume skips recorded ones
+      // correlations depend on the gauge values as well as on the dates
+      const std::string checkpointKey =
+        "pixels " + std::to_string(aoiMask.validWords()) + " speckle " +
+        speckleFilter().describe() + " scenes " +
+        describeMatchedScenes(matchedDates, &elevations);
+      ThresholdCheckpoint checkpoint(
+        thresholdCheckpointPath(polarization), checkpointKey, config.resume);
+      ThresholdScorer scoreThresholds = [&](const std::vector<double>& batch) {
+        return checkpoint.score(batch, evaluateThresholds);
+      };
+
+      auto searchThresholds = [&](const ThresholdScorer& scorer) {
+        return config.thresholdSearch == "refine"
+                 ? refineThresholdSearch(thresholdSequenceDbl[0],
+                                         thresholdSequenceDbl[1],
+                                         thresholdSequenceDbl[2],
+                                         scorer)
+                 : exhaustiveThresholdSearch(thresholdSequenceDbl[0],
+                                             thresholdSequenceDbl[1],
+                                             thresholdSequenceDbl[2],
+                                             scorer);
+      };
+
+      ThresholdSearchResult search;
+      if (config.coarseFactor > 1) {
+        // search on the decimated stack, only the best thresholds are
+        // scored at full resolution
+        ThresholdSearchResult coarse;
+        {
+          ScopedStage stage("coarse");
+          const auto coarseStack = readCoarseStack(croppedRasterPaths,
+                                                   aoiMask,
+                                                   grid.xSize,
+                                                   grid.ySize,
+                                                   config.coarseFactor);
+          for (const auto& path : croppedRasterPaths) {
+            stage.addBytesRead(getFileSize(path));
+          }
+          memoryTracker().set("coarse stack", getVectorBytes(coarseStack));
+          coarse = searchThresholds([&](const std::vector<double>& batch) {
+            stage.addPixels(coarseStack[0].size() * coarseStack.size() *
+                            batch.size());
+            return scoreThresholdsOnStack(coarseStack, batch, elevations);
+          });
+          memoryTracker().release("coarse stack");
+        }
+        search.thresholds = pickBestCandidates(
+          coarse.thresholds, coarse.correlations, config.coarseCandidates);
+        if (search.thresholds.empty()) {
+          // no threshold floods anything on the coarse grid
+          std::cout << "Coarse calibration 1/" << config.coarseFactor
+                    << ": no correlation, searching at full resolution\n";
+          search = searchThresholds(scoreThresholds);
+        } else {
+          std::cout << "Coarse calibration 1/" << config.coarseFactor
+                    << ": scoring " << search.thresholds.size()
+                    << " thresholds at full resolution\n";
+          search.correlations = scoreThresholds(search.thresholds);
+        }
+      } else {
+        search = searchThresholds(scoreThresholds);
+      }
+      const std::vector<double>& thresholds = search.thresholds;
+      const std::vector<double>& correlations = search.correlations;
+
+      double bestCorrelation = 0.0;
+      unsigned int bestThrIndex = 0;
+
+      for (int i = 0; i < correlations.size(); i++) {
+        // std::cout << "THR: " << thresholds.at(i)
+                  // << " / COEFF: " << correlations.at(i) << '\n';
+
+        if (bestCorrelation < correlations.at(i)) {
+          bestCorrelation = correlations.at(i);
+          bestThrIndex = i;
+        }
+      }
+
+      std::cout << "---------------- RESULTS FOR ---------------- "
+                << polarization << " POLARIZATION ---------------" << '\n';
+      std::cout << "best threshold: " << thresholds.at(bestThrIndex)
+                << " with correlation coefficient of "
+                << correlations.at(bestThrIndex) << '\n';
+
+      std::cout << "also prepare file for mapping procedure...\n";
+
+      {
+        std::ofstream ofsThreshold(bestThresholdPath(polarization));
+        ofsThreshold << std::setprecision(17) << thresholds.at(bestThrIndex)
+                     << "\n";
+      }
+      writeSpeckleFilter(thresholdSpecklePath(polarization), speckleFilter());
+
+      const std::string labelsPath = thresholdLabelsPath(polarization);
+      const std::string mapDirectory =
+        workPath("mapped/base_algo_pol_" + polarization + "/");
+      if (tiled) {
+        // labels are streamed to disk, maps are written from the store
+        {
+          ScopedStage stage("label");
+          LabelStoreWriter outputForMapper(labelsPath, aoiMask.validWords());
+          writeThresholdingLabelsTiled(croppedRasterPaths,
+                                       thresholds.at(bestThrIndex),
+                                       aoiMask,
+                                       strips,
+                                       outputForMapper);
+          outputForMapper.close();
+          stage.addPixels(aoiMask.validWords() * croppedRasterPaths.size());
+          stage.addBytesWritten(getFileSize(labelsPath));
+        }
+        writeFloodMaskCube(thresholdMaskCubePath(polarization),
+                           labelsPath,
+                           createFloodLookup({ 1 }),
+                           matchedDates,
+                           grid.xSize,
+                           grid.ySize,
+                           aoiMask);
+
+        LabelStore labelStore(labelsPath);
+        if (emitMaps && labelStore.isValid()) {
+          const FloodMaskCube cube(thresholdMaskCubePath(polarization));
+          writeFloodMaps(mapDirectory,
+                         grid,
+                         matchedDates,
+                         labelStore.date(0),
+                         createFloodLookup({ 1 }),
+                         mapOptions,
+                         aoiMask,
+                         0,
+                         &cube);
+        }
+        continue;
+      }
+
+      std::vector<unsigned char> labels;
+      {
+        ScopedStage stage("label");
+        for (const auto& pixelValues : pixelStack) {
+          getThresholdingLabels(pixelValues, thresholds.at(bestThrIndex), labels);
+        }
+
+        const size_t pixelsPerDate = pixelStack[0].size();
+        LabelStoreWriter outputForMapper(labelsPath, pixelsPerDate);
+        for (size_t offset = 0; offset < labels.size(); offset += pixelsPerDate) {
+          outputForMapper.append(labels.data() + offset);
+        }
+        outputForMapper.close();
+        memoryTracker().set("labels", getVectorBytes(labels));
+        stage.addPixels(labels.size());
+        stage.addBytesWritten(getFileSize(labelsPath));
+      }
+      writeFloodMaskCube(thresholdMaskCubePath(polarization),
+                         labelsPath,
+                         createFloodLookup({ 1 }),
+                         matchedDates,
+                         grid.xSize,
+                         grid.ySize,
+                         aoiMask);
+
+      if (emitMaps) {
+        const FloodMaskCube cube(thresholdMaskCubePath(polarization));
+        writeFloodMaps(mapDirectory,
+                       grid,
+                       matchedDates,
+                       labels.data(),
+                       createFloodLookup({ 1 }),
+                       mapOptions,
+                       aoiMask,
+                       0,
+                       &cube);
+      }
+      memoryTracker().release("labels");
+      memoryTracker().release("pixel stack");
+    }
+
+  } else {
+    std::cout << "Floodsar algorithm: dual-pol (new/improved)\n";
+    std::vector<int> thresholdSequenceInt(thresholdSequence.size());
+    std::transform(thresholdSequence.begin(),
+                   thresholdSequence.end(),
+                   thresholdSequenceInt.begin(),
+                   [](const std::string& val) { return std::stoi(val); });
+    std::cout << "classes from, to:\n";
+    std::cout << std::to_string(thresholdSequenceInt[0]) + ", ";
+    std::cout << std::to_string(thresholdSequenceInt[1]);
+    std::cout << "\n";
+
+    std::vector<int> numClassesToTry;
+    for (int j = thresholdSequenceInt[0]; j <= thresholdSequenceInt[1]; j++) {
+		if(j==1) continue;
+		numClassesToTry.push_back(j);
+		}
+	if(thresholdSequenceInt[1] > kmeansMaximumClasses)
+	{
+		std::cout << "too many classes for k-means, at most " << kmeansMaximumClasses << " are supported\nProgram will quit\n";
+		return 0;
+	}
+	if(numClassesToTry.size() == 0)
+	{
+		std::cout << "to few classes for k-means, increase the -n parameter range\nProgram will quit\n";
+		return 0;
+	}
+    int rowsPerDate = 0; // for starters
+
+    std::vector<double> elevations; // these are water levels or discharges
+    std::vector<std::string> croppedRasterPaths;
+    std::vector<Date> matchedDates;
+
+    // interesting for us are only dates when we have appropriate pictures...
+    // so let's use only these...
+    const auto matched = matchScenesWithGauge(
+      sceneManifest, obsElevationsMap, { Polarization::VH, Polarization::VV });
+    writeMatchedScenes(matchedScenesPath(), sceneManifest, matched, 1);
+
+    // new kmeans impl
+    std::vector<double> vhAllPixelValues;
+    std::vector<double> vvAllPixelValues;
+    std::vector<std::string> vhRasterPaths;
+
+    // --resume: the pixel cube of an interrupted run replaces reading images
+    bool cubeLoaded = false;
+    if (config.resume && !tiled && !matched.empty()) {
+      std::vector<Date> dates;
+      for (const auto& match : matched) {
+        dates.push_back(match.date);
+      }
+      cubeLoaded = readPixelCube(pixelCubePath("VH"),
+                                 dates,
+                                 aoiMask.validWords(),
+                                 vhAllPixelValues) &&
+                   readPixelCube(pixelCubePath("VV"),
+                                 dates,
+                                 aoiMask.validWords(),
+                                 vvAllPixelValues);
+      if (cubeLoaded) {
+        rowsPerDate = aoiMask.validWords();
+        std::cout << "Resuming: pixel cube loaded, images are not read\n";
+      } else {
+        vhAllPixelValues.clear();
+        vvAllPixelValues.clear();
+      }
+    }
+
+    {
+      // tiled: images are only read in strips later, paths are collected
+      ScopedStage loadStage("load");
+      for (const auto& match : matched) {
+        const std::string& vhPath = match.scenes[0]->cacheKey;
+        const std::string& vvPath = match.scenes[1]->cacheKey;
+
+        elevations.push_back(match.elevation);
+        std::cout << "Elevation for " << match.date << " = " << match.elevation
+                  << '\n';
+        croppedRasterPaths.push_back(vvPath);
+        vhRasterPaths.push_back(vhPath);
+        matchedDates.push_back(match.date);
+        if (tiled || cubeLoaded) {
+          // read strip by strip later
+          continue;
+        }
+
+        auto vhDataset =
+          static_cast<GDALDataset*>(GDALOpen(vhPath.c_str(), GA_ReadOnly));
+        auto vvDataset =
+          static_cast<GDALDataset*>(GDALOpen(vvPath.c_str(), GA_ReadOnly));
+
+        std::vector<double> vhPixelValues;
+        std::vector<double> vvPixelValues;
+
+        getPixelValuesFromRaster(vhDataset, vhPixelValues);
+        getPixelValuesFromRaster(vvDataset, vvPixelValues);
+        GDALClose(vhDataset);
+        GDALClose(vvDataset);
+        loadStage.addPixels(vhPixelValues.size() + vvPixelValues.size());
+        loadStage.addBytesRead(getFileSize(vhPath) + getFileSize(vvPath));
+        applyAoiMask(vhPixelValues, aoiMask);
+        applyAoiMask(vvPixelValues, aoiMask);
+
+        if (rowsPerDate != vhPixelValues.size()) {
+          std::cout << "WARNING: Suspicious pixelValues size: " << rowsPerDate
+                    << "/" << vhPixelValues.size() << '\n';
+          rowsPerDate = vhPixelValues.size();
+        }
+
+        vhAllPixelValues.insert(
+          vhAllPixelValues.end(), vhPixelValues.begin(), vhPixelValues.end());
+        vvAllPixelValues.insert(
+          vvAllPixelValues.end(), vvPixelValues.begin(), vvPixelValues.end());
+      }
+
+      memoryTracker().set("k-means input",
+                          getVectorBytes(vhAllPixelValues) +
+                            getVectorBytes(vvAllPixelValues));
+      if (!tiled && !cubeLoaded && rowsPerDate > 0) {
+        // the k-means input, in binary; a restart with --resume reads it
+        // instead of the images
+        std::cout << "Will create input file for K-Means\n";
+        writePixelCube(
+          pixelCubePath("VH"), matchedDates, vhAllPixelValues.data(), rowsPerDate);
+        writePixelCube(
+          pixelCubePath("VV"), matchedDates, vvAllPixelValues.data(), rowsPerDate);
+        loadStage.addBytesWritten(getFileSize(pixelCubePath("VH")) +
+                                  getFileSize(pixelCubePath("VV")));
+      }
+    }
+	
+    std::vector<double> maxValueDbl;
+	if(maxValue[0] != "none") {
+		maxValueDbl.resize(maxValue.size());
+		std::transform(maxValue.begin(),
+					   maxValue.end(),
+					   maxValueDbl.begin(),
+					   [](const std::string& val) { return std::stod(val); });
+		std::cout << "clipping max values to VV, VH:\n";
+		std::cout << std::to_string(maxValueDbl[0]) + ", ";
+		std::cout << std::to_string(maxValueDbl[1]) + ", ";
+		std::cout << "\n";
+	} else {
+		std::cout << "No clipping VV and VH values.\n";
+	}
+    if (convToDB) {
+        std::cout << "Converting linear power to dB.\n";
+    }
+    prepareKMeansInput(vhAllPixelValues, vvAllPixelValues, maxValueDbl, convToDB);
+    writeKMeansInputOptions(maxValueDbl, convToDB);
+    writeSpeckleFilter(kmeansSpecklePath(), speckleFilter());
+
+    // the in-core stack is clustered by libfloodsar, like floodsar --serve
+    floodsar::KMeansInput kmeansInput;
+    kmeansInput.vh = std::move(vhAllPixelValues);
+    kmeansInput.vv = std::move(vvAllPixelValues);
+    kmeansInput.pixelsPerDate = rowsPerDate;
+    kmeansInput.numDates = elevations.size();
+    floodsar::KMeansOptions kmeansOptions;
+    kmeansOptions.maxiter = maxiter;
+    kmeansOptions.fraction = fraction;
+    kmeansOptions.seed = config.seed;
+
+    std::cout << "Input ready. Have " << elevations.size()
+              << " pairs of images matched with gauge data\n";
+
+    const bool skipClustering = config.skipClustering;
+    // outputs of a k are complete once its marker holds this key
+    const std::string checkpointKey = kmeansCheckpointKey(matchedDates,
+                                                          aoiMask.validWords(),
+                                                          maxValueDbl,
+                                                          convToDB,
+                                                          fraction,
+                                                          maxiter,
+                                                          config.seed,
+                                                          tiled);
+
+    if (config.coarseFactor > 1 && !skipClustering && !matched.empty()) {
+      // every k is scored on the decimated stack, only the best ones are
+      // clustered at full resolution
+      ScopedStage stage("coarse");
+      std::vector<double> coarseVH;
+      std::vector<double> coarseVV;
+      const auto coarseStackVH = readCoarseStack(
+        vhRasterPaths, aoiMask, grid.xSize, grid.ySize, config.coarseFactor);
+      const auto coarseStackVV = readCoarseStack(
+        croppedRasterPaths, aoiMask, grid.xSize, grid.ySize, config.coarseFactor);
+      for (size_t i = 0; i < coarseStackVH.size(); i++) {
+        coarseVH.insert(
+          coarseVH.end(), coarseStackVH[i].begin(), coarseStackVH[i].end());
+        coarseVV.insert(
+          coarseVV.end(), coarseStackVV[i].begin(), coarseStackVV[i].end());
+      }
+      prepareKMeansInput(coarseVH, coarseVV, maxValueDbl, convToDB);
+      memoryTracker().set("coarse stack",
+                          getVectorBytes(coarseVH) + getVectorBytes(coarseVV));
+      stage.addPixels(coarseVH.size() * numClassesToTry.size());
+      for (size_t i = 0; i < matched.size(); i++) {
+        stage.addBytesRead(getFileSize(vhRasterPaths[i]) +
+                           getFileSize(croppedRasterPaths[i]));
+      }
+
+      const auto scores = scoreClassCountsOnStack(coarseVH,
+                                                  coarseVV,
+                                                  coarseStackVH[0].size(),
+                                                  elevations,
+                                                  numClassesToTry,
+                                                  maxiter,
+                                                  strategy,
+                                                  config.seed);
+      memoryTracker().release("coarse stack");
+      const auto candidates =
+        pickBestCandidates(numClassesToTry, scores, config.coarseCandidates);
+      if (candidates.empty()) {
+        std::cout << "Coarse calibration 1/" << config.coarseFactor
+                  << ": no correlation, clustering all numbers of classes\n";
+      } else {
+        numClassesToTry = candidates;
+        std::cout << "Coarse calibration 1/" << config.coarseFactor
+                  << ": clustering " << numClassesToTry.size()
+                  << " numbers of classes at full resolution\n";
+      }
+    }
+
+    // tiled: centroids are fitted to a sample that takes half of the memory
+    // budget, the other half is for strips of both polarizations
+    const StripLayout strips(grid.xSize,
+                             grid.ySize,
+                             2 * sizeof(double) + 1,
+                             tileMemory / 2);
+    std::vector<double> sampleVH;
+    std::vector<double> sampleVV;
+    if (tiled && !skipClustering) {
+      ScopedStage stage("sample");
+      stage.addPixels(2 * aoiMask.validWords() * matched.size());
+      for (size_t i = 0; i < matched.size(); i++) {
+        stage.addBytesRead(getFileSize(vhRasterPaths[i]) +
+                           getFileSize(croppedRasterPaths[i]));
+      }
+      sampleKMeansInputTiled(vhRasterPaths,
+                             croppedRasterPaths,
+                             aoiMask,
+                             strips,
+                             fraction,
+                             tileMemory / 2 / (2 * sizeof(double)),
+                             maxValueDbl,
+                             convToDB,
+                             sampleVH,
+                             sampleVV,
+                             config.seed);
+      memoryTracker().set("k-means sample",
+                          getVectorBytes(sampleVH) + getVectorBytes(sampleVV));
+    }
+    std::vector<size_t> sampleIndices(sampleVH.size());
+    for (size_t i = 0; i < sampleIndices.size(); i++) sampleIndices[i] = i;
+
+    int indexForLogs = 0;
+
+    double bestCoeff = 0;
+    unsigned int bestMaxClasses = 0;
+    unsigned int bestFloodClasses = 0;
+    // labels of the best configuration, only kept for --emit-maps
+    std::vector<unsigned char> bestLabels;
+
+    int kWithoutImprovement = 0;
+
+    // every k is scored right after clustering, so only the labels of the
+    // best one have to stay in memory
+    for (int cl : numClassesToTry) {
+      std::vector<unsigned char> labels;
+      std::vector<std::array<unsigned int, 256>> histograms;
+
+      // --resume: complete outputs of a k are read like --skip-clustering
+      const bool resumed = config.resume && !skipClustering &&
+                           isKMeansOutputComplete(cl, checkpointKey);
+      const bool cluster = !skipClustering && !resumed;
+      if (resumed) {
+        std::cout << "Resuming: outputs of k = " << cl << " are complete\n";
+      }
+
+      // clustering of every k is a stage of its own; in core, libfloodsar
+      // opens it, tiled it is opened here
+      std::unique_ptr<ScopedStage> clusterStage;
+      if (cluster) {
+        clearKMeansOutputComplete(cl);
+      }
+      if (tiled && cluster) {
+        clusterStage =
+          std::make_unique<ScopedStage>("cluster k=" + std::to_string(cl));
+        clusterStage->addPixels(aoiMask.validWords() * matched.size());
+        for (size_t i = 0; i < matched.size(); i++) {
+          clusterStage->addBytesRead(getFileSize(vhRasterPaths[i]) +
+                                     getFileSize(croppedRasterPaths[i]));
+        }
+        std::vector<double> centroidsVH;
+        std::vector<double> centroidsVV;
+        fitKMeansCentroids(sampleVH,
+                           sampleVV,
+                           sampleIndices,
+                           cl,
+                           maxiter,
+                           centroidsVH,
+                           centroidsVV,
+                           config.seed);
+        writeKMeansClusters(cl, centroidsVH, centroidsVV);
+        std::cout << "Labelling all pixels...\n";
+        LabelStoreWriter labelsWriter(kmeansLabelsPath(cl), aoiMask.validWords());
+        histograms = labelKMeansTiled(vhRasterPaths,
+                                      croppedRasterPaths,
+                                      aoiMask,
+                                      strips,
+                                      maxValueDbl,
+                                      convToDB,
+                                      centroidsVH,
+                                      centroidsVV,
+                                      labelsWriter);
+        labelsWriter.close();
+        markKMeansOutputComplete(cl, checkpointKey);
+      } else if (cluster) {
+        floodsar::Clustering clustering =
+          floodsar::clusterKMeans(kmeansInput, cl, kmeansOptions, &labels);
+        std::cout << "Finished clustering. Dump result...\n";
+        writeKMeansClusters(cl, clustering.centroidsVH, clustering.centroidsVV);
+        writeKMeansLabels(cl, labels, rowsPerDate);
+        markKMeansOutputComplete(cl, checkpointKey);
+        histograms = std::move(clustering.histograms);
+      } else {
+        LabelStore labelStore(kmeansLabelsPath(cl));
+        histograms = computeLabelHistograms(labelStore);
+        if (emitMaps && !tiled && labelStore.isValid()) {
+          labels.assign(labelStore.date(0),
+                        labelStore.date(labelStore.numDates()));
+        }
+      }
+
+      memoryTracker().set("labels", getVectorBytes(labels));
+      if (clusterStage) {
+        clusterStage->addBytesWritten(getFileSize(kmeansLabelsPath(cl)));
+        clusterStage.reset();
+      }
+
+      ScopedStage correlateStage("correlate");
+      correlateStage.addPixels(aoiMask.validWords() * matched.size());
+      bool improved = false;
+      double bestCoeffOfK = -1.0;
+      unsigned int floodClassesNum = cl-1;
+      while (floodClassesNum) {
+        std::vector<unsigned int> floodedAreaValues;
+        auto floodClasses =
+          createFloodClassesList(kmeansClustersPath(cl), floodClassesNum, strategy);
+        calculateFloodedAreasFromKMeansOutput(
+          floodedAreaValues, histograms, floodClasses);
+        const double corrCoeff =
+          calcCorrelationCoeff(floodedAreaValues, elevations);
+
+        std::cout << "Calculated correlation [" << indexForLogs
+                  << "] allClasses: " << cl
+                  << " floodClasses: " << floodClassesNum
+                  << " - correlationCoeff is " << corrCoeff << "\n";
+
+        bestCoeffOfK = std::max(bestCoeffOfK, corrCoeff);
+        if (corrCoeff > bestCoeff) {
+          bestCoeff = corrCoeff;
+          bestMaxClasses = cl;
+          bestFloodClasses = floodClassesNum;
+          improved = true;
+        }
+
+        floodClassesNum--;
+        indexForLogs++;
+      }
+
+      if (improved && emitMaps) {
+        bestLabels = std::move(labels);
+        memoryTracker().set("best labels", getVectorBytes(bestLabels));
+      }
+
+      // k grows, so does the cost of clustering: stop when more classes
+      // stopped paying off
+      kWithoutImprovement = improved ? 0 : kWithoutImprovement + 1;
+      if (config.kPatience > 0 && kWithoutImprovement >= config.kPatience) {
+        std::cout << "No improvement for " << kWithoutImprovement
+                  << " values of k, stopping the search at k = " << cl << "\n";
+        break;
+      }
+      if (config.kMargin > 0 && bestCoeffOfK < bestCoeff - config.kMargin) {
+        std::cout << "Correlation of k = " << cl << " is more than "
+                  << config.kMargin << " below the best, stopping the search\n";
+        break;
+      }
+    }
+
+    memoryTracker().release("labels");
+    std::ofstream ofsBestClass;
+    ofsBestClass.open(bestClassPath(), std::ofstream::out);
+    ofsBestClass <<  bestMaxClasses << " " << bestFloodClasses << "\n";
+    ofsBestClass.close();
+
+    std::cout << "RESULTS: Best config is: coeff/all classes/flood classes "
+              << bestCoeff << " / " << bestMaxClasses << " / "
+              << bestFloodClasses << "\n";
+
+    if (bestMaxClasses) {
+      writeFloodMaskCube(kmeansMaskCubePath(),
+                         kmeansLabelsPath(bestMaxClasses),
+                         createFloodLookup(createFloodClassesList(
+                           kmeansClustersPath(bestMaxClasses),
+                           bestFloodClasses,
+                           strategy)),
+                         matchedDates,
+                         grid.xSize,
+                         grid.ySize,
+                         aoiMask);
+    }
+
+    // tiled labels are not kept in memory, the store of the best k is mapped
+    std::unique_ptr<LabelStore> bestLabelStore;
+    const unsigned char* bestLabelsData =
+      bestLabels.empty() ? nullptr : bestLabels.data();
+    if (tiled && emitMaps && bestMaxClasses) {
+      bestLabelStore =
+        std::make_unique<LabelStore>(kmeansLabelsPath(bestMaxClasses));
+      if (bestLabelStore->isValid()) {
+        bestLabelsData = bestLabelStore->date(0);
+      }
+    }
+
+    if (emitMaps && bestLabelsData != nullptr) {
+      auto floodClasses = createFloodClassesList(
+        kmeansClustersPath(bestMaxClasses), bestFloodClasses, strategy);
+      const FloodMaskCube cube(kmeansMaskCubePath());
+      writeFloodMaps(workPath("mapped/" + std::to_string(bestMaxClasses) + "__" +
+                              std::to_string(bestFloodClasses) + "/"),
+                     grid,
+                     matchedDates,
+                     bestLabelsData,
+                     createFloodLookup(floodClasses),
+                     mapOptions,
+                     aoiMask,
+                     0,
+                     &cube);
+    }
+  }
+
+  return 0;
+}
@@ -1,94 +1,105 @@
-#include "../vendor/cxxopts.hpp"
-#include "BoundingBox.hpp"
-#include "XYPair.hpp"
-#include "gdal/cpl_conv.h" // for CPLMalloc()
 #include "gdal/gdal_priv.h"
-#include "gdal/ogrsf_frmts.h"
+#include "RasterInfo.hpp"
+#include "catalog.hpp"
+#include "polarization.hpp"
 #include "utils.hpp"
 #include <algorithm>
-#include <cmath>
-#include <fcntl.h>
+#include <cxxopts.hpp>
 #include <filesystem>
-#include <fstream>
 #include <iostream>
-#include <sstream>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <sys/wait.h>
-#include <thread>
+#include <map>
+#include <memory>
+#include <set>
 
 /*
-* Utility function that contains main() . This script can is used additionaly to analyze and prepare input data for the floodsar 
-* algorithm.
+* Utility that builds the catalog of a SAR archive. It is used additionaly to
+* analyze and prepare input data for the floodsar algorithm: floodsar reads
+* the catalog (--catalog) instead of scanning the archive on every run.
 */
 
 namespace fs = std::filesystem;
 
-void
-println(std::string message)
-{
-  std::cout << message << "\n";
-}
-
-void
-die(std::string message)
-{
-  std::cout << "message"
-            << "\n";
-  exit(1);
-}
-
-void
-getProjectionInfo(std::string rasterPath, std::string proj4filePath)
-{
-  std::string command = "gdalsrsinfo";
-
-  command.append(" --single-line -o epsg ");
-  command.append(rasterPath);
-
-  std::system(command.c_str());
-}
-
 int
 main(int argc, char** argv)
 {
   GDALAllRegister();
 
-  cxxopts::Options options("Floodsar::AnalyzeDir", " yes");
-  options.add_options()(
-    "d,dir", "directory to check", cxxopts::value<std::string>());
+  cxxopts::Options options("Floodsar::AnalyzeDir", " - command line options");
+  options.add_options()("h,help", "Print this help")(
+    "d,dir", "Directory to catalog.", cxxopts::value<std::string>())(
+    "o,output",
+    "Catalog file path. Default: floodsar-catalog.tsv in the directory.",
+    cxxopts::value<std::string>())(
+    "e,extension",
+    "Files with this extension will be cataloged.",
+    cxxopts::value<std::string>()->default_value(".tif"))(
+    "t,stdParser",
+    "Use standard, i.e. YYYYMMDD_POL.extm, names parser instead of ASF HyP3 names .")(
+    "f,full",
+    "Ignore the existing catalog and inventory every file again.");
   options.parse_positional({ "dir" });
 
   auto userInput = options.parse(argc, argv);
-  auto dir = userInput["dir"].as<std::string>();
 
+  if (userInput.count("help") || !userInput.count("dir")) {
+    std::cout << options.help() << "\n";
+    return 0;
+  }
+
+  auto dir = userInput["dir"].as<std::string>();
   if (!fs::exists(dir)) {
-    die("No such directory: " + dir);
+    std::cout << "No such directory: " << dir << "\n";
+    return 1;
   }
 
-  println("checking " + dir);
+  std::string catalogPath = (fs::path(dir) / "floodsar-catalog.tsv").string();
+  if (userInput.count("output")) {
+    catalogPath = userInput["output"].as<std::string>();
+  }
 
-  for (auto& p : fs::recursive_directory_iterator(dir)) {
-    auto filepath = p.path();
-    std::string proj4Path =
-      ".floodsar-cache/proj4/" + filepath.filename().string() + "_proj4";
-    std::cout << "proj4Path " << proj4Path << "\n";
-    // if (!fs::exists(proj4Path)) {
-    std::cout << "Getting projection info for " + filepath.string();
-    getProjectionInfo(filepath.string(), proj4Path);
-    //}
+  std::unique_ptr<RasterInfoExtractor> extractor;
+  if (userInput.count("stdParser")) {
+    extractor = std::make_unique<StdExtractor>();
+  } else {
+    extractor = std::make_unique<AsfExtractor>();
+  }
 
-    std::ifstream proj4file(proj4Path);
+  std::vector<CatalogEntry> previous;
+  if (!userInput.count("full") && readCatalog(catalogPath, previous)) {
+    std::cout << "Updating catalog " << catalogPath << " ("
+              << previous.size() << " entries)\n";
+  }
 
-	//get polarization and date info from imagery filenames
-    RasterInfo extractedInfo = extractor->extractFromPath(filepath.string());
+  auto entries = scanArchive(dir,
+                             userInput["extension"].as<std::string>(),
+                             extractor.get(),
+                             previous);
 
-    std::getline(proj4file, extractedInfo.proj4);
-    std::cout << polToString(extractedInfo.pol) + "\n";
-    std::cout << extractedInfo.date + "\n";
-    std::cout << extractedInfo.proj4 + "\n";
-    std::cout << "\n";
-    infos.push_back(extractedInfo);
+  if (!writeCatalog(catalogPath, entries)) {
+    return 1;
+  }
+
+  // short summary of what is in the archive
+  std::map<std::string, int> perPolarization;
+  std::map<std::string, int> perCrs;
+  std::set<Date> dates;
+  for (const auto& entry : entries) {
+    perPolarization[polToString(entry.pol)]++;
+    perCrs[entry.crs.empty() ? "unknown" : entry.crs]++;
+    dates.insert(entry.date);
+  }
+
+  std::cout << "Cataloged " << entries.size() << " rasters to " << catalogPath
+            << "\n";
+  for (const auto& [pol, count] : perPolarization) {
+    std::cout << "  " << pol << ": " << count << "\n";
+  }
+  for (const auto& [crs, count] : perCrs) {
+    std::cout << "  " << crs << ": " << count << "\n";
+  }
+  if (!dates.empty()) {
+    std::cout << "  " << dates.size() << " dates from " << *dates.begin()
+              << " to " << *dates.rbegin() << "\n";
   }
   return 0;
 }
@@ -0,0 +1,444 @@
+#pragma once
+
+#include "BoundingBox.hpp"
+#include "gdal/gdal_priv.h"
+#include "gdal/gdal_utils.h"
+#include "gdal/ogr_spatialref.h"
+#include "gdal/ogrsf_frmts.h"
+#include "gdal/cpl_string.h"
+#include "rasters.hpp"
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+/*
+*
+* Masking of the area of interest. A polygon AOI (any OGR vector file) or a
+* mask raster (nonzero = inside) is rasterized once onto the grid of the
+* cropped scenes and stored in the cache. Pixels outside are dropped from the
+* pixel cube, so thresholding, clustering, area counting and maps only ever
+* see pixels of the area.
+*
+*/
+
+inline std::string
+aoiMaskPath()
+{
+  return workPath(".floodsar-cache/aoi_mask.tif");
+}
+
+// pixels of the crop grid that lie inside the area of interest
+class AoiMask
+{
+public:
+  // grid pixels, xSize * ySize
+  size_t gridWords = 0;
+  // false if the whole grid is inside
+  bool masked = false;
+  // indices of pixels inside, ascending. Only used when masked.
+  std::vector<size_t> validPixels;
+
+  bool isFull() const { return !masked; }
+
+  size_t validWords() const
+  {
+    return isFull() ? gridWords : validPixels.size();
+  }
+};
+
+// vector AOIs (shapefile, GeoPackage, GeoJSON...) are masked by their polygons
+inline bool
+isVectorAoi(const std::string& aoiPath)
+{
+  auto dataset = static_cast<GDALDataset*>(GDALOpenEx(
+    aoiPath.c_str(), GDAL_OF_VECTOR, nullptr, nullptr, nullptr));
+  if (dataset == nullptr) {
+    return false;
+  }
+  const bool hasLayers = dataset->GetLayerCount() > 0;
+  GDALClose(dataset);
+  return hasLayers;
+}
+
+/*
+* Bounding box of all features of a vector AOI in the target projection,
+* snapped to the pixel size of the scenes.
+* @param epsgCode is the target projection, e.g. EPSG:32630
+* @param pixelSize is the resolution the scenes are cropped to
+*/
+inline bool
+getVectorBoundingBox(const std::string& aoiPath,
+                     const std::string& epsgCode,
+                     double pixelSize,
+                     BoundingBox& boundingBox)
+{
+  auto dataset = static_cast<GDALDataset*>(GDALOpenEx(
+    aoiPath.c_str(), GDAL_OF_VECTOR, nullptr, nullptr, nullptr));
+  if (dataset == nullptr || pixelSize <= 0.0) {
+    std::cout << "[getVectorBoundingBox] Could not open " << aoiPath << "\n";
+    return false;
+  }
+
+  OGRSpatialReference target;
+  target.SetFromUserInput(epsgCode.c_str());
+  target.SetAxisMappingStrategy(OAMS_TRADITIONAL_GIS_ORDER);
+
+  double minX = std::numeric_limits<double>::max();
+  double minY = std::numeric_limits<double>::max();
+  double maxX = std::numeric_limits<double>::lowest();
+  double maxY = std::numeric_limits<double>::lowest();
+
+  for (int layerIndex = 0; layerIndex < dataset->GetLayerCount(); layerIndex++) {
+    auto layer = dataset->GetLayer(layerIndex);
+    OGREnvelope envelope;
+    if (layer->GetExtent(&envelope, TRUE) != OGRERR_NONE) {
+      continue;
+    }
+
+    // edges are densified, a straight edge is curved in another projection
+    const int steps = 20;
+    std::vector<double> xs, ys;
+    for (int i = 0; i <= steps; i++) {
+      const double fx = envelope.MinX + (envelope.MaxX - envelope.MinX) * i / steps;
+      const double fy = envelope.MinY + (envelope.MaxY - envelope.MinY) * i / steps;
+      xs.insert(xs.end(), { fx, fx, envelope.MinX, envelope.MaxX });
+      ys.insert(ys.end(), { envelope.MinY, envelope.MaxY, fy, fy });
+    }
+
+    const OGRSpatialReference* source = layer->GetSpatialRef();
+    if (source != nullptr && !source->IsSame(&target)) {
+      OGRSpatialReference traditional(*source);
+      traditional.SetAxisMappingStrategy(OAMS_TRADITIONAL_GIS_ORDER);
+      std::unique_ptr<OGRCoordinateTransformation> transformation(
+        OGRCreateCoordinateTransformation(&traditional, &target));
+      if (!transformation ||
+          !transformation->Transform(xs.size(), xs.data(), ys.data())) {
+        std::cout << "[getVectorBoundingBox] Could not transform " << aoiPath
+                  << " to " << epsgCode << "\n";
+        GDALClose(dataset);
+        return false;
+      }
+    }
+
+    minX = std::min(minX, *std::min_element(xs.begin(), xs.end()));
+    maxX = std::max(maxX, *std::max_element(xs.begin(), xs.end()));
+    minY = std::min(minY, *std::min_element(ys.begin(), ys.end()));
+    maxY = std::max(maxY, *std::max_element(ys.begin(), ys.end()));
+  }
+  GDALClose(dataset);
+
+  if (minX > maxX || minY > maxY) {
+    std::cout << "[getVectorBoundingBox] No features in " << aoiPath << "\n";
+    return false;
+  }
+
+  boundingBox.widthInPixels =
+    std::max(1, static_cast<int>(std::ceil((maxX - minX) / pixelSize)));
+  boundingBox.heightInPixels =
+    std::max(1, static_cast<int>(std::ceil((maxY - minY) / pixelSize)));
+  boundingBox.upperLeftX = minX;
+  boundingBox.upperLeftY = maxY;
+  boundingBox.lowerRightX = minX + boundingBox.widthInPixels * pixelSize;
+  boundingBox.lowerRightY = maxY - boundingBox.heightInPixels * pixelSize;
+  return true;
+}
+
+// resolution of a raster, in units of its projection
+inline double
+getRasterPixelSize(const std::string& rasterPath)
+{
+  auto raster =
+    static_cast<GDALDataset*>(GDALOpen(rasterPath.c_str(), GA_ReadOnly));
+  if (raster == nullptr) {
+    return 0.0;
+  }
+  double affineTransform[6];
+  raster->GetGeoTransform(affineTransform);
+  GDALClose(raster);
+  return std::abs(affineTransform[1]);
+}
+
+/*
+* Bounding box the scenes are cropped to. A raster AOI gives its own extent
+* and size, a vector AOI its features' extent at the resolution of the scenes.
+* @param referenceRaster is one of the (reprojected) scenes
+*/
+inline bool
+getAoiBoundingBox(const std::string& aoiPath,
+                  const std::string& epsgCode,
+                  const std::string& referenceRaster,
+                  BoundingBox& boundingBox)
+{
+  if (isVectorAoi(aoiPath)) {
+    return getVectorBoundingBox(
+      aoiPath, epsgCode, getRasterPixelSize(referenceRaster), boundingBox);
+  }
+  auto aoi =
+    static_cast<GDALDataset*>(GDALOpen(aoiPath.c_str(), GA_ReadOnly));
+  if (aoi == nullptr) {
+    std::cout << "Could not open area of interest " << aoiPath << "\n";
+    return false;
+  }
+  boundingBox = getRasterBoundingBox(aoi);
+  GDALClose(aoi);
+  return true;
+}
+
+/*
+* Rasterizes the AOI onto the grid of a cropped scene and writes the mask
+* (Byte, 1 = inside, 0 = outside).
+* @param aoiPath is a vector file, or a raster whose nonzero pixels are inside
+* @param scene is any cropped scene, it defines the grid
+* @param outputPath is where the mask is written
+*/
+inline bool
+createAoiMask(const std::string& aoiPath,
+              GDALDataset* scene,
+              const std::string& outputPath)
+{
+  const int xSize = scene->GetRasterXSize();
+  const int ySize = scene->GetRasterYSize();
+  double affineTransform[6];
+  scene->GetGeoTransform(affineTransform);
+
+  auto memDriver = GetGDALDriverManager()->GetDriverByName("MEM");
+  auto grid = memDriver->Create("", xSize, ySize, 1, GDT_Byte, nullptr);
+  grid->SetGeoTransform(affineTransform);
+  grid->SetProjection(scene->GetProjectionRef());
+  grid->GetRasterBand(1)->Fill(0);
+
+  const bool vector = isVectorAoi(aoiPath);
+  auto source = static_cast<GDALDataset*>(GDALOpenEx(
+    aoiPath.c_str(),
+    vector ? GDAL_OF_VECTOR : GDAL_OF_RASTER,
+    nullptr,
+    nullptr,
+    nullptr));
+  if (source == nullptr) {
+    std::cout << "[createAoiMask] Could not open " << aoiPath << "\n";
+    GDALClose(grid);
+    return false;
+  }
+
+  GDALDatasetH result = nullptr;
+  int usageError = FALSE;
+  if (vector) {
+    // features are reprojected to the grid by GDAL
+    char** argv = nullptr;
+    argv = CSLAddString(argv, "-burn");
+    argv = CSLAddString(argv, "1");
+    for (int i = 0; i < source->GetLayerCount(); i++) {
+      argv = CSLAddString(argv, "-l");
+      argv = CSLAddString(argv, source->GetLayer(i)->GetName());
+    }
+    auto rasterizeOptions = GDALRasterizeOptionsNew(argv, nullptr);
+    CSLDestroy(argv);
+    result = GDALRasterize(nullptr, grid, source, rasterizeOptions, &usageError);
+    GDALRasterizeOptionsFree(rasterizeOptions);
+  } else {
+    char** argv = nullptr;
+    argv = CSLAddString(argv, "-r");
+    argv = CSLAddString(argv, "near");
+    auto warpOptions = GDALWarpAppOptionsNew(argv, nullptr);
+    CSLDestroy(argv);
+    GDALDatasetH sources[] = { source };
+    result = GDALWarp(nullptr, grid, 1, sources, warpOptions, &usageError);
+    GDALWarpAppOptionsFree(warpOptions);
+  }
+  GDALClose(source);
+
+  if (result == nullptr) {
+    std::cout << "[createAoiMask] Could not rasterize " << aoiPath << "\n";
+    GDALClose(grid);
+    return false;
+  }
+
+  // any nonzero value of a mask raster is inside
+  const size_t words = static_cast<size_t>(xSize) * ySize;
+  std::vector<unsigned char> mask(words);
+  auto band = grid->GetRasterBand(1);
+  bool ok = band->RasterIO(GF_Read,
+                           0,
+                           0,
+                           xSize,
+                           ySize,
+                           mask.data(),
+                           xSize,
+                           ySize,
+                           GDT_Byte,
+                           0,
+                           0) != CE_Failure;
+  size_t inside = 0;
+  for (auto& value : mask) {
+    value = value != 0;
+    inside += value;
+  }
+  ok = ok && band->RasterIO(GF_Write,
+                            0,
+                            0,
+                            xSize,
+                            ySize,
+                            mask.data(),
+                            xSize,
+                            ySize,
+                            GDT_Byte,
+                            0,
+                            0) != CE_Failure;
+
+  auto gtiffDriver = GetGDALDriverManager()->GetDriverByName("GTiff");
+  char** creationOptions = nullptr;
+  creationOptions = CSLSetNameValue(creationOptions, "COMPRESS", "DEFLATE");
+  auto output = ok ? gtiffDriver->CreateCopy(
+                       outputPath.c_str(), grid, FALSE, creationOptions, nullptr, nullptr)
+                   : nullptr;
+  CSLDestroy(creationOptions);
+  GDALClose(grid);
+
+  if (output == nullptr) {
+    std::cout << "[createAoiMask] Could not write " << outputPath << "\n";
+    return false;
+  }
+  GDALClose(output);
+
+  std::cout << "AOI mask: " << inside << " of " << words
+            << " pixels inside the area of interest\n";
+  return true;
+}
+
+inline bool
+createAoiMask(const std::string& aoiPath,
+              const std::string& scenePath,
+              const std::string& outputPath = aoiMaskPath())
+{
+  auto scene =
+    static_cast<GDALDataset*>(GDALOpen(scenePath.c_str(), GA_ReadOnly));
+  if (scene == nullptr) {
+    std::cout << "[createAoiMask] Could not open " << scenePath << "\n";
+    return false;
+  }
+  const bool created = createAoiMask(aoiPath, scene, outputPath);
+  GDALClose(scene);
+  return created;
+}
+
+/*
+* Reads the mask of the cache. Without a mask file the whole grid is valid.
+* @param gridWords is the size of the crop grid, the mask must match it
+*/
+inline AoiMask
+loadAoiMask(size_t gridWords, const std::string& path = aoiMaskPath())
+{
+  AoiMask mask;
+  mask.gridWords = gridWords;
+  if (!fs::exists(path)) {
+    return mask;
+  }
+
+  auto raster = static_cast<GDALDataset*>(GDALOpen(path.c_str(), GA_ReadOnly));
+  if (raster == nullptr) {
+    std::cout << "[loadAoiMask] Could not open " << path << "\n";
+    return mask;
+  }
+  const int xSize = raster->GetRasterXSize();
+  const int ySize = raster->GetRasterYSize();
+  if (static_cast<size_t>(xSize) * ySize != gridWords) {
+    std::cout << "[loadAoiMask] " << path
+              << " does not match the scenes, not masking\n";
+    GDALClose(raster);
+    return mask;
+  }
+
+  std::vector<unsigned char> values(gridWords);
+  auto error = raster->GetRasterBand(1)->RasterIO(
+    GF_Read, 0, 0, xSize, ySize, values.data(), xSize, ySize, GDT_Byte, 0, 0);
+  GDALClose(raster);
+  if (error == CE_Failure) {
+    std::cout << "[loadAoiMask] Could not read " << path << "\n";
+    return mask;
+  }
+
+  for (size_t i = 0; i < gridWords; i++) {
+    if (values[i]) {
+      mask.validPixels.push_back(i);
+    }
+  }
+  mask.masked = mask.validPixels.size() != gridWords;
+  if (!mask.masked) {
+    mask.validPixels.clear();
+  }
+  std::cout << "AOI mask: " << mask.validWords() << " of " << gridWords
+            << " pixels inside the area of interest\n";
+  return mask;
+}
+
+// keeps only pixels inside the area, in place
+template<typename T>
+inline void
+applyAoiMask(std::vector<T>& values, const AoiMask& mask)
+{
+  if (mask.isFull() || values.size() != mask.gridWords) {
+    return;
+  }
+  // validPixels[i] >= i, so nothing is overwritten before it is read
+  for (size_t i = 0; i < mask.validPixels.size(); i++) {
+    values[i] = values[mask.validPixels[i]];
+  }
+  values.resize(mask.validPixels.size());
+}
+
+/*
+* Puts values of pixels inside the area back onto the grid.
+* @param compact holds mask.validWords() values
+* @param grid receives mask.gridWords values, fill outside the area
+*/
+inline void
+expandToGrid(const unsigned char* compact,
+             const AoiMask& mask,
+             unsigned char* grid,
+             unsigned char fill)
+{
+  if (mask.isFull()) {
+    std::copy(compact, compact + mask.gridWords, grid);
+    return;
+  }
+  std::fill(grid, grid + mask.gridWords, fill);
+  for (size_t i = 0; i < mask.validPixels.size(); i++) {
+    grid[mask.validPixels[i]] = compact[i];
+  }
+}
+
+/*
+* Mask of a grid decimated by factor (see getDecimatedPixelValues): a coarse
+* pixel is inside if the center of its block is.
+*/
+inline AoiMask
+decimateAoiMask(const AoiMask& mask, int xSize, int ySize, int factor)
+{
+  const int coarseX = std::max(1, xSize / std::max(1, factor));
+  const int coarseY = std::max(1, ySize / std::max(1, factor));
+  AoiMask coarse;
+  coarse.gridWords = static_cast<size_t>(coarseX) * coarseY;
+  if (mask.isFull()) {
+    return coarse;
+  }
+  coarse.masked = true;
+  for (int y = 0; y < coarseY; y++) {
+    const size_t row =
+      static_cast<size_t>((y + 0.5) * ySize / coarseY) * xSize;
+    for (int x = 0; x < coarseX; x++) {
+      const size_t pixel = row + static_cast<size_t>((x + 0.5) * xSize / coarseX);
+      if (std::binary_search(
+            mask.validPixels.begin(), mask.validPixels.end(), pixel)) {
+        coarse.validPixels.push_back(static_cast<size_t>(y) * coarseX + x);
+      }
+    }
+  }
+  return coarse;
+}
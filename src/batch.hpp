@@ -0,0 +1,168 @@
+#pragma once
+
+#include "RasterInfo.hpp"
+#include "analysis.hpp"
+#include "aoi.hpp"
+#include "csv.hpp"
+#include "manifest.hpp"
+#include "gdal/gdal_priv.h"
+#include "rasters.hpp"
+#include "utils.hpp"
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+/*
+*
+* Batch mode: many areas of interest (river reaches) processed over the same
+* SAR archive. The archive is scanned once, every scene is reprojected and
+* mosaicked once per target EPSG and cropped to all areas while it is open.
+* Each job then runs the analysis on its own directory: batch/<name>/ with
+* its own .floodsar-cache and mapped folders.
+*
+*/
+
+class BatchJob
+{
+public:
+  std::string name;
+  std::string aoiPath;
+  std::string gaugePath;
+  std::string epsgCode;
+};
+
+inline std::string
+batchJobDirectory(const BatchJob& job)
+{
+  return "batch/" + job.name;
+}
+
+/*
+* Reads jobs from a csv file, one job per line: name,aoi,gauge,epsg
+* e.g. upper_reach,aoi/upper.tif,gauges/upper.csv,EPSG:32610
+* Empty lines and lines starting with # are skipped.
+*/
+inline std::vector<BatchJob>
+readBatchFile(const std::string& batchFilePath)
+{
+  std::vector<BatchJob> jobs;
+  std::ifstream file(batchFilePath);
+  if (!file) {
+    std::cout << "Could not open batch file " << batchFilePath << "\n";
+    return jobs;
+  }
+
+  CSVRow row;
+  while (file >> row) {
+    if (row.size() == 0 || row[0].empty() || row[0][0] == '#') {
+      continue;
+    }
+    if (row.size() != 4) {
+      std::cout << "Skipping batch line, expected name,aoi,gauge,epsg: "
+                << row[0] << "\n";
+      continue;
+    }
+    BatchJob job;
+    job.name = static_cast<std::string>(row[0]);
+    // jobs run in their own directories, so paths are made absolute
+    job.aoiPath = fs::absolute(static_cast<std::string>(row[1])).string();
+    job.gaugePath = fs::absolute(static_cast<std::string>(row[2])).string();
+    job.epsgCode = static_cast<std::string>(row[3]);
+    jobs.push_back(job);
+  }
+  return jobs;
+}
+
+/*
+* Reprojects, mosaics and crops the scanned rasters for all jobs. Work is
+* shared by jobs with the same EPSG code.
+* @param maskRasterAois masks also raster AOIs, vector AOIs are always masked
+*/
+inline void
+preprocessBatch(const std::vector<BatchJob>& jobs,
+                const std::vector<RasterInfo>& rasters,
+                bool maskRasterAois = false)
+{
+  std::map<std::string, std::vector<const BatchJob*>> jobsByEpsg;
+  for (const auto& job : jobs) {
+    jobsByEpsg[job.epsgCode].push_back(&job);
+  }
+
+  for (const auto& [epsgCode, epsgJobs] : jobsByEpsg) {
+    std::cout << "Batch: " << epsgJobs.size() << " areas in " << epsgCode
+              << "\n";
+    std::vector<RasterInfo> reprojected = rasters;
+    reprojectIfNeeded(reprojected, epsgCode);
+    std::vector<RasterInfo> mosaicked;
+    performMosaicking(reprojected, mosaicked, epsgCode);
+
+    if (mosaicked.empty()) {
+      continue;
+    }
+
+    std::vector<CropTarget> targets;
+    std::vector<const BatchJob*> croppedJobs;
+    for (const auto* job : epsgJobs) {
+      const std::string jobDirectory = batchJobDirectory(*job);
+      if (fs::exists(jobDirectory + "/.floodsar-cache")) {
+        fs::remove_all(jobDirectory + "/.floodsar-cache");
+      }
+      createCacheDirectoryIfNotExists(jobDirectory);
+
+      BoundingBox zone;
+      if (!getAoiBoundingBox(
+            job->aoiPath, epsgCode, mosaicked[0].absolutePath, zone)) {
+        std::cout << "Job " << job->name << " will have no images\n";
+        continue;
+      }
+      targets.push_back({ zone, jobDirectory + "/.floodsar-cache/cropped" });
+      croppedJobs.push_back(job);
+    }
+
+    cropRastersToAreasOfInterest(mosaicked, targets, epsgCode);
+
+    for (size_t i = 0; i < croppedJobs.size(); i++) {
+      const std::string cacheDirectory =
+        batchJobDirectory(*croppedJobs[i]) + "/.floodsar-cache/";
+      auto sceneManifest = buildSceneManifest(targets[i].croppedDirectory);
+      if ((maskRasterAois || isVectorAoi(croppedJobs[i]->aoiPath)) &&
+          !sceneManifest.entries.empty()) {
+        createAoiMask(croppedJobs[i]->aoiPath,
+                      sceneManifest.entries[0].cacheKey,
+                      cacheDirectory + "aoi_mask.tif");
+      }
+      writeSceneManifest(cacheDirectory + "scenes.manifest", sceneManifest);
+    }
+  }
+}
+
+/*
+* Runs the analysis of every job on its directory, the current directory of
+* the process is left alone.
+* @param config is shared by all jobs, except for the gauge data
+*/
+inline int
+runBatchAnalyses(const std::vector<BatchJob>& jobs, AnalysisConfig config)
+{
+  int result = 0;
+
+  for (const auto& job : jobs) {
+    const std::string jobDirectory = batchJobDirectory(job);
+    if (!fs::exists(jobDirectory + "/.floodsar-cache/cropped")) {
+      std::cout << "Batch: no cropped images for job " << job.name
+                << ", skipping\n";
+      continue;
+    }
+    std::cout << "---------------- BATCH JOB " << job.name
+              << " ----------------\n";
+    config.hydroDataCsvFile = job.gaugePath;
+    config.workDirectory = jobDirectory;
+    result |= runAnalysis(config);
+  }
+  return result;
+}
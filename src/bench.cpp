@@ -0,0 +1,227 @@
+#include "clustering.hpp"
+#include "labels.hpp"
+#include "maps.hpp"
+#include "rasters.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cxxopts.hpp>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/*
+*
+* Microbenchmarks of the hot kernels of floodsar on synthetic in-memory data.
+* No images or network are needed. Every kernel runs a few times, the best
+* and median times are reported as ns/pixel and GB/s, and as JSON.
+*
+*/
+
+class BenchResult
+{
+public:
+  std::string name;
+  size_t pixels = 0;
+  // bytes read and written by one run
+  size_t bytes = 0;
+  std::vector<double> seconds;
+
+  double best() const { return *std::min_element(seconds.begin(), seconds.end()); }
+
+  double median() const
+  {
+    auto sorted = seconds;
+    std::sort(sorted.begin(), sorted.end());
+    return sorted[sorted.size() / 2];
+  }
+};
+
+// result of a kernel is folded here, so the compiler cannot drop the work
+volatile double benchSink = 0.0;
+
+BenchResult
+runBenchmark(const std::string& name,
+             size_t pixels,
+             size_t bytes,
+             int repeat,
+             const std::function<double()>& kernel)
+{
+  BenchResult result;
+  result.name = name;
+  result.pixels = pixels;
+  result.bytes = bytes;
+  // warm-up, pages are touched before the first measurement
+  benchSink = benchSink + kernel();
+  for (int i = 0; i < repeat; i++) {
+    const auto start = std::chrono::steady_clock::now();
+    benchSink = benchSink + kernel();
+    const auto stop = std::chrono::steady_clock::now();
+    result.seconds.push_back(std::chrono::duration<double>(stop - start).count());
+  }
+  std::cout << name << ": " << result.best() * 1e9 / pixels << " ns/pixel, "
+            << bytes / result.best() / 1e9 << " GB/s (best of " << repeat
+            << ")\n";
+  return result;
+}
+
+std::string
+benchResultsToJson(const std::vector<BenchResult>& results,
+                   size_t pixels,
+                   size_t dates,
+                   int classes)
+{
+  std::stringstream json;
+  json << "{\n  \"pixels\": " << pixels << ",\n  \"dates\": " << dates
+       << ",\n  \"classes\": " << classes << ",\n  \"benchmarks\": [\n";
+  for (size_t i = 0; i < results.size(); i++) {
+    const auto& r = results[i];
+    json << "    {\"name\": \"" << r.name << "\", \"pixels\": " << r.pixels
+         << ", \"bytes\": " << r.bytes << ", \"best_s\": " << r.best()
+         << ", \"median_s\": " << r.median()
+         << ", \"ns_per_pixel\": " << r.best() * 1e9 / r.pixels
+         << ", \"gb_per_s\": " << r.bytes / r.best() / 1e9 << "}"
+         << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  json << "  ]\n}\n";
+  return json.str();
+}
+
+int
+main(int argc, char** argv)
+{
+  cxxopts::Options options("Floodsar::Bench",
+                           " - microbenchmarks of floodsar kernels");
+  options.add_options()("h,help", "Print this help")(
+    "p,pixels",
+    "Pixels of one synthetic image.",
+    cxxopts::value<size_t>()->default_value("4000000"))(
+    "d,dates",
+    "Number of dates of the stack (correlation, classification of maps).",
+    cxxopts::value<size_t>()->default_value("16"))(
+    "k,classes",
+    "Number of k-means classes.",
+    cxxopts::value<int>()->default_value("6"))(
+    "r,repeat",
+    "Measured runs of every kernel.",
+    cxxopts::value<int>()->default_value("5"))(
+    "o,output",
+    "Write results as JSON to this file, - for standard output.",
+    cxxopts::value<std::string>()->default_value("-"));
+
+  auto userInput = options.parse(argc, argv);
+  if (userInput.count("help")) {
+    std::cout << options.help() << "\n";
+    return 0;
+  }
+
+  const size_t pixels = std::max<size_t>(1, userInput["pixels"].as<size_t>());
+  const size_t dates = std::max<size_t>(2, userInput["dates"].as<size_t>());
+  const int classes =
+    std::clamp(userInput["classes"].as<int>(), 2, kmeansMaximumClasses);
+  const int repeat = std::max(1, userInput["repeat"].as<int>());
+
+  // linear backscatter, roughly exponential like speckled SAR intensity
+  std::mt19937 rng(42);
+  std::exponential_distribution<double> backscatter(20.0);
+  std::vector<double> vh(pixels), vv(pixels);
+  for (size_t i = 0; i < pixels; i++) {
+    vh[i] = backscatter(rng) * 0.5;
+    vv[i] = backscatter(rng);
+  }
+  std::vector<double> centroidsVH, centroidsVV;
+  for (int j = 0; j < classes; j++) {
+    centroidsVH.push_back(0.025 * (j + 1) / classes);
+    centroidsVV.push_back(0.05 * (j + 1) / classes);
+  }
+  std::vector<unsigned char> labels(pixels);
+  labelPixels(
+    vh.data(), vv.data(), pixels, centroidsVH, centroidsVV, labels.data());
+  std::vector<unsigned char> mask(pixels);
+
+  std::vector<BenchResult> results;
+
+  results.push_back(runBenchmark(
+    "calcFloodedArea", pixels, pixels * sizeof(double), repeat, [&]() {
+      return static_cast<double>(calcFloodedArea(vv, 0.03));
+    }));
+
+  results.push_back(runBenchmark("kmeans_assignment",
+                                 pixels,
+                                 pixels * (2 * sizeof(double) + 1),
+                                 repeat,
+                                 [&]() {
+                                   labelPixels(vh.data(),
+                                               vv.data(),
+                                               pixels,
+                                               centroidsVH,
+                                               centroidsVV,
+                                               labels.data());
+                                   return static_cast<double>(labels[pixels / 2]);
+                                 }));
+
+  // one correlation per threshold of a typical search, over the dates
+  const size_t correlations = 1000;
+  std::vector<unsigned int> areas(dates);
+  std::vector<double> elevations(dates);
+  for (size_t i = 0; i < dates; i++) {
+    areas[i] = rng() % pixels;
+    elevations[i] = backscatter(rng);
+  }
+  results.push_back(runBenchmark("calcCorrelationCoeff",
+                                 correlations * dates,
+                                 correlations * dates *
+                                   (sizeof(unsigned int) + sizeof(double)),
+                                 repeat,
+                                 [&]() {
+                                   double sum = 0.0;
+                                   for (size_t i = 0; i < correlations; i++) {
+                                     sum += calcCorrelationCoeff(areas, elevations);
+                                   }
+                                   return sum;
+                                 }));
+
+  const auto lookup = createFloodLookup({ 1, 2 });
+  results.push_back(
+    runBenchmark("classifyLabels", pixels, 2 * pixels, repeat, [&]() {
+      classifyLabels(labels.data(), pixels, lookup, mask.data());
+      return static_cast<double>(mask[pixels / 2]);
+    }));
+
+  FloodAggregator aggregator(pixels);
+  results.push_back(runBenchmark("FloodAggregator::add",
+                                 pixels,
+                                 pixels * (1 + 4 * 2 * sizeof(uint16_t)),
+                                 repeat,
+                                 [&]() {
+                                   aggregator.add(mask.data(), 1);
+                                   return static_cast<double>(
+                                     aggregator.frequency[pixels / 2]);
+                                 }));
+
+  // label histograms of a whole stack, as in the 2D calibration
+  std::vector<unsigned char> stack(pixels * dates);
+  for (size_t d = 0; d < dates; d++) {
+    std::copy(labels.begin(), labels.end(), stack.begin() + d * pixels);
+  }
+  results.push_back(runBenchmark(
+    "computeLabelHistograms", pixels * dates, pixels * dates, repeat, [&]() {
+      auto histograms = computeLabelHistograms(stack.data(), pixels, dates);
+      return static_cast<double>(histograms[0][1]);
+    }));
+
+  const auto json = benchResultsToJson(results, pixels, dates, classes);
+  const auto output = userInput["output"].as<std::string>();
+  if (output == "-") {
+    std::cout << json;
+  } else {
+    std::ofstream ofs(output);
+    ofs << json;
+    std::cout << "Results written to " << output << "\n";
+  }
+  return 0;
+}
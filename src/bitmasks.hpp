@@ -0,0 +1,423 @@
+#pragma once
+
+#include "aoi.hpp"
+#include "labels.hpp"
+#include "stages.hpp"
+#include "types.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+/*
+*
+* Flood mask cube: flood masks of all dates of the chosen configuration, one
+* bit per pixel of the crop grid. Every row of the grid starts a new 64-bit
+* word, so a row, a date or a window of rows is a contiguous run of words.
+* Pixels outside the area of interest are never flooded. Areas, aggregates
+* and unions or intersections of date ranges are computed with popcount on
+* the words, the labels are not classified again.
+*
+* The cube is written date by date (FloodMaskCubeWriter) and read through a
+* memory mapping (FloodMaskCube), so neither keeps more than a date of masks
+* in memory.
+*
+* File layout: a fixed header, the dates (fixed fields), then the words,
+* date after date, row after row.
+*
+*/
+
+const char floodMaskCubeMagic[8] = { 'F', 'S', 'B', 'I', 'T', 'S', '1', '\0' };
+const size_t floodMaskCubeDateBytes = 16;
+
+struct FloodMaskCubeHeader
+{
+  char magic[8];
+  uint64_t xSize;
+  uint64_t ySize;
+  uint64_t wordsPerRow;
+  uint64_t numDates;
+};
+
+inline unsigned int
+countBits(uint64_t word)
+{
+  return __builtin_popcountll(word);
+}
+
+inline size_t
+countBits(const uint64_t* words, size_t count)
+{
+  size_t bits = 0;
+  for (size_t i = 0; i < count; i++) {
+    bits += countBits(words[i]);
+  }
+  return bits;
+}
+
+inline size_t
+getWordsPerRow(int xSize)
+{
+  return (static_cast<size_t>(xSize) + 63) / 64;
+}
+
+/*
+* Read-only, memory-mapped view of a flood mask cube.
+*/
+class FloodMaskCube
+{
+public:
+  explicit FloodMaskCube(const std::string& path)
+  {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      std::cout << "[FloodMaskCube] Could not open " << path << "\n";
+      return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 &&
+        static_cast<size_t>(st.st_size) >= sizeof(FloodMaskCubeHeader)) {
+      m_size = st.st_size;
+      void* mapped = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mapped != MAP_FAILED) {
+        m_data = static_cast<const unsigned char*>(mapped);
+      }
+    }
+    ::close(fd);
+    if (m_data == nullptr) {
+      std::cout << "[FloodMaskCube] Could not map " << path << "\n";
+      m_size = 0;
+      return;
+    }
+
+    FloodMaskCubeHeader header;
+    std::memcpy(&header, m_data, sizeof(header));
+    const size_t wordsOffset =
+      sizeof(header) + header.numDates * floodMaskCubeDateBytes;
+    if (std::memcmp(header.magic, floodMaskCubeMagic, sizeof(header.magic)) != 0 ||
+        header.wordsPerRow != getWordsPerRow(header.xSize) ||
+        wordsOffset + header.wordsPerRow * header.ySize * header.numDates *
+                        sizeof(uint64_t) >
+          m_size) {
+      std::cout << "[FloodMaskCube] Not a valid flood mask cube: " << path << "\n";
+      return;
+    }
+    m_xSize = header.xSize;
+    m_ySize = header.ySize;
+    m_wordsPerRow = header.wordsPerRow;
+    for (size_t d = 0; d < header.numDates; d++) {
+      const char* field = reinterpret_cast<const char*>(
+        m_data + sizeof(header) + d * floodMaskCubeDateBytes);
+      m_dates.emplace_back(field, strnlen(field, floodMaskCubeDateBytes));
+    }
+    // the header and date fields are multiples of 8 bytes
+    m_words = reinterpret_cast<const uint64_t*>(m_data + wordsOffset);
+  }
+
+  ~FloodMaskCube()
+  {
+    if (m_data != nullptr) {
+      munmap(const_cast<unsigned char*>(m_data), m_size);
+    }
+  }
+
+  FloodMaskCube(const FloodMaskCube&) = delete;
+  FloodMaskCube& operator=(const FloodMaskCube&) = delete;
+
+  bool isValid() const { return !m_dates.empty(); }
+  int xSize() const { return m_xSize; }
+  int ySize() const { return m_ySize; }
+  size_t wordsPerRow() const { return m_wordsPerRow; }
+  size_t wordsPerDate() const { return m_wordsPerRow * m_ySize; }
+  size_t numDates() const { return m_dates.size(); }
+  const std::vector<Date>& dates() const { return m_dates; }
+
+  // whether the cube holds masks of these dates (at least) on this grid
+  bool covers(const std::vector<Date>& dates, int xSize, int ySize) const
+  {
+    return isValid() && m_xSize == xSize && m_ySize == ySize &&
+           dates.size() <= m_dates.size() &&
+           std::equal(dates.begin(), dates.end(), m_dates.begin());
+  }
+
+  const uint64_t* date(size_t index) const
+  {
+    return m_words + index * wordsPerDate();
+  }
+
+  // flooded pixels of a date
+  size_t floodedArea(size_t index) const
+  {
+    return countBits(date(index), wordsPerDate());
+  }
+
+  std::vector<unsigned int> floodedAreas() const
+  {
+    std::vector<unsigned int> areas(numDates());
+    parallelFor(numDates(), [&](size_t d) { areas[d] = floodedArea(d); });
+    return areas;
+  }
+
+  /*
+  * Calls visit(pixel) for every flooded grid pixel (y * xSize + x) of a
+  * date in rows [firstRow, endRow), in grid order. Only set bits are
+  * visited.
+  */
+  template<typename Visit>
+  void forEachFlooded(size_t index, size_t firstRow, size_t endRow, Visit visit) const
+  {
+    const uint64_t* words = date(index);
+    for (size_t y = firstRow; y < endRow; y++) {
+      for (size_t w = 0; w < m_wordsPerRow; w++) {
+        uint64_t bits = words[y * m_wordsPerRow + w];
+        while (bits) {
+          visit(y * m_xSize + w * 64 + __builtin_ctzll(bits));
+          bits &= bits - 1;
+        }
+      }
+    }
+  }
+
+  // pixels flooded on any date of [first, last]
+  std::vector<uint64_t> unionOf(size_t first, size_t last) const
+  {
+    std::vector<uint64_t> result(wordsPerDate(), 0);
+    for (size_t d = first; d <= last && d < numDates(); d++) {
+      const uint64_t* words = date(d);
+      for (size_t i = 0; i < result.size(); i++) {
+        result[i] |= words[i];
+      }
+    }
+    return result;
+  }
+
+  // pixels flooded on every date of [first, last]
+  std::vector<uint64_t> intersectionOf(size_t first, size_t last) const
+  {
+    std::vector<uint64_t> result(wordsPerDate(), first < numDates() ? ~uint64_t(0) : 0);
+    for (size_t d = first; d <= last && d < numDates(); d++) {
+      const uint64_t* words = date(d);
+      for (size_t i = 0; i < result.size(); i++) {
+        result[i] &= words[i];
+      }
+    }
+    // padding bits past the last column are never flooded
+    const size_t tail = m_xSize % 64;
+    if (tail != 0) {
+      for (size_t y = 0; y < static_cast<size_t>(m_ySize); y++) {
+        result[y * m_wordsPerRow + m_wordsPerRow - 1] &= (uint64_t(1) << tail) - 1;
+      }
+    }
+    return result;
+  }
+
+  // index of the first date not before the given one, numDates() if none
+  size_t findDate(const Date& date) const
+  {
+    return std::lower_bound(m_dates.begin(), m_dates.end(), date) - m_dates.begin();
+  }
+
+private:
+  const unsigned char* m_data = nullptr;
+  size_t m_size = 0;
+  int m_xSize = 0;
+  int m_ySize = 0;
+  size_t m_wordsPerRow = 0;
+  std::vector<Date> m_dates;
+  const uint64_t* m_words = nullptr;
+};
+
+/*
+* Writes a cube date by date. The file is written under a temporary name and
+* renamed by close() once every date was appended, an abandoned writer
+* leaves no cube.
+*/
+class FloodMaskCubeWriter
+{
+public:
+  FloodMaskCubeWriter(const std::string& path,
+                      int xSize,
+                      int ySize,
+                      const std::vector<Date>& dates)
+    : m_path(path)
+    , m_partialPath(path + ".partial")
+    , m_wordsPerDate(getWordsPerRow(xSize) * ySize)
+    , m_numDates(dates.size())
+  {
+    m_file = std::fopen(m_partialPath.c_str(), "wb");
+    if (m_file == nullptr) {
+      std::cout << "[FloodMaskCubeWriter] Could not open " << m_partialPath << "\n";
+      return;
+    }
+    FloodMaskCubeHeader header;
+    std::memcpy(header.magic, floodMaskCubeMagic, sizeof(header.magic));
+    header.xSize = xSize;
+    header.ySize = ySize;
+    header.wordsPerRow = getWordsPerRow(xSize);
+    header.numDates = dates.size();
+    m_good = std::fwrite(&header, sizeof(header), 1, m_file) == 1;
+    for (const auto& date : dates) {
+      char field[floodMaskCubeDateBytes] = {};
+      std::strncpy(field, date.c_str(), sizeof(field) - 1);
+      m_good = m_good && std::fwrite(field, sizeof(field), 1, m_file) == 1;
+    }
+  }
+
+  ~FloodMaskCubeWriter()
+  {
+    if (m_file != nullptr) {
+      std::fclose(m_file);
+      std::remove(m_partialPath.c_str());
+    }
+  }
+
+  FloodMaskCubeWriter(const FloodMaskCubeWriter&) = delete;
+  FloodMaskCubeWriter& operator=(const FloodMaskCubeWriter&) = delete;
+
+  // masks of the next date, getWordsPerRow(xSize) * ySize words
+  void append(const uint64_t* words)
+  {
+    m_good = m_good && m_file != nullptr &&
+             std::fwrite(words, sizeof(uint64_t), m_wordsPerDate, m_file) ==
+               m_wordsPerDate;
+    m_appended++;
+  }
+
+  // @return whether the complete cube is in place
+  bool close()
+  {
+    if (m_file == nullptr) {
+      return false;
+    }
+    const bool written =
+      std::fclose(m_file) == 0 && m_good && m_appended == m_numDates;
+    m_file = nullptr;
+    if (!written) {
+      std::cout << "[FloodMaskCubeWriter] Could not write " << m_partialPath << "\n";
+      std::remove(m_partialPath.c_str());
+      return false;
+    }
+    return std::rename(m_partialPath.c_str(), m_path.c_str()) == 0;
+  }
+
+private:
+  std::string m_path;
+  std::string m_partialPath;
+  size_t m_wordsPerDate;
+  size_t m_numDates;
+  std::FILE* m_file = nullptr;
+  bool m_good = false;
+  size_t m_appended = 0;
+};
+
+// flood masks of the best threshold of a polarization
+inline std::string
+thresholdMaskCubePath(const std::string& polarization)
+{
+  return thresholdLabelsPath(polarization) + "_masks.bin";
+}
+
+// flood masks of the best k and number of flood classes
+inline std::string
+kmeansMaskCubePath()
+{
+  return workPath(".floodsar-cache/kmeans_outputs/best_masks.bin");
+}
+
+// rows of the grid packed by a thread at once
+const size_t floodMaskRowsPerTask = 64;
+
+/*
+* Packs labels of one date into the words of a date of the cube. Ranges of
+* rows are packed in parallel, every row has words of its own.
+* @param labels holds one label per pixel inside the area of interest
+* @param lookup tells which labels are flooded
+* @param words receives getWordsPerRow(xSize) * ySize words
+*/
+inline void
+packFloodMask(const unsigned char* labels,
+              const FloodLookup& lookup,
+              const AoiMask& aoiMask,
+              int xSize,
+              int ySize,
+              uint64_t* words)
+{
+  const size_t wordsPerRow = getWordsPerRow(xSize);
+  const size_t tasks = (ySize + floodMaskRowsPerTask - 1) / floodMaskRowsPerTask;
+  parallelFor(tasks, [&](size_t task) {
+    const size_t firstRow = task * floodMaskRowsPerTask;
+    const size_t endRow = std::min<size_t>(ySize, firstRow + floodMaskRowsPerTask);
+    std::fill(words + firstRow * wordsPerRow, words + endRow * wordsPerRow, 0);
+    auto setFlooded = [&](size_t pixel) {
+      const size_t y = pixel / xSize;
+      const size_t x = pixel % xSize;
+      words[y * wordsPerRow + x / 64] |= uint64_t(1) << (x % 64);
+    };
+    const size_t firstPixel = firstRow * xSize;
+    const size_t endPixel = endRow * xSize;
+    if (aoiMask.isFull()) {
+      for (size_t i = firstPixel; i < endPixel; i++) {
+        if (lookup[labels[i]]) {
+          setFlooded(i);
+        }
+      }
+      return;
+    }
+    const auto& valid = aoiMask.validPixels;
+    const size_t first =
+      std::lower_bound(valid.begin(), valid.end(), firstPixel) - valid.begin();
+    for (size_t i = first; i < valid.size() && valid[i] < endPixel; i++) {
+      if (lookup[labels[i]]) {
+        setFlooded(valid[i]);
+      }
+    }
+  });
+}
+
+/*
+* Packs a label store (one date per matched date) into a cube at path, date
+* by date.
+* @param lookup tells which labels are flooded
+*/
+inline bool
+writeFloodMaskCube(const std::string& path,
+                   const std::string& labelsPath,
+                   const FloodLookup& lookup,
+                   const std::vector<Date>& dates,
+                   int xSize,
+                   int ySize,
+                   const AoiMask& aoiMask)
+{
+  // a cube of a previous run must not outlive a failed write
+  std::remove(path.c_str());
+  const LabelStore store(labelsPath);
+  if (!store.isValid() || store.numDates() != dates.size() ||
+      store.pixelsPerDate() != aoiMask.validWords()) {
+    std::cout << "Label store does not match the dates, no flood mask cube\n";
+    return false;
+  }
+  ScopedStage stage("mask cube");
+  FloodMaskCubeWriter writer(path, xSize, ySize, dates);
+  std::vector<uint64_t> words(getWordsPerRow(xSize) * ySize);
+  for (size_t d = 0; d < dates.size(); d++) {
+    packFloodMask(store.date(d), lookup, aoiMask, xSize, ySize, words.data());
+    writer.append(words.data());
+  }
+  stage.addPixels(store.pixelsPerDate() * dates.size());
+  stage.addBytesRead(getFileSize(labelsPath));
+  if (!writer.close()) {
+    return false;
+  }
+  stage.addBytesWritten(getFileSize(path));
+  std::cout << "saved: " << path << " (" << dates.size() << " dates, "
+            << getFileSize(path) << " bytes)\n";
+  return true;
+}
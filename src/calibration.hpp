@@ -0,0 +1,300 @@
+#pragma once
+
+#include "aoi.hpp"
+#include "clustering.hpp"
+#include "gdal/gdal_priv.h"
+#include "labels.hpp"
+#include "rasters.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+*
+* Search of the 1D threshold. Thresholds live on the grid
+* start + i * step, i = 0..n-1, given by the -n option. The search either
+* evaluates all of them, or refines a coarse grid around the correlation
+* maximum until the requested step is reached.
+*
+* Multiresolution calibration: thresholds or numbers of classes are first
+* scored on a decimated copy of the image stack, only the best candidates
+* are scored again at full resolution.
+*
+*/
+
+// correlation coefficients of a batch of thresholds
+typedef std::function<std::vector<double>(const std::vector<double>&)>
+  ThresholdScorer;
+
+// evaluated thresholds, ascending, and their correlation coefficients
+class ThresholdSearchResult
+{
+public:
+  std::vector<double> thresholds;
+  std::vector<double> correlations;
+};
+
+inline ThresholdSearchResult
+exhaustiveThresholdSearch(double start,
+                          double end,
+                          double step,
+                          const ThresholdScorer& scorer)
+{
+  ThresholdSearchResult result;
+  result.thresholds = createSequence(start, end, step);
+  result.correlations = scorer(result.thresholds);
+  return result;
+}
+
+/*
+* Successive grid refinement: evaluates coarsePoints thresholds spread over
+* the range, narrows the range to the neighbours of the best one and repeats
+* until the range holds at most coarsePoints thresholds of the requested grid,
+* which are then all evaluated. The result is always a point of the requested
+* grid, found in about coarsePoints * log(n / coarsePoints) evaluations.
+* Thresholds of one refinement level are scored in one batch.
+*/
+inline ThresholdSearchResult
+refineThresholdSearch(double start,
+                      double end,
+                      double step,
+                      const ThresholdScorer& scorer,
+                      size_t coarsePoints = 9)
+{
+  const std::vector<double> grid = createSequence(start, end, step);
+  // the range of n > coarsePoints thresholds shrinks to at most 2 * stride + 1
+  // < n only from 5 points on (with 3 or 4 it may stay the same)
+  coarsePoints = std::max<size_t>(coarsePoints, 5);
+  std::map<size_t, double> evaluated;
+
+  auto evaluate = [&](const std::vector<size_t>& indices) {
+    std::vector<size_t> missing;
+    std::vector<double> batch;
+    for (auto index : indices) {
+      if (!evaluated.count(index)) {
+        missing.push_back(index);
+        batch.push_back(grid[index]);
+      }
+    }
+    if (batch.empty()) {
+      return;
+    }
+    const auto correlations = scorer(batch);
+    for (size_t i = 0; i < missing.size(); i++) {
+      evaluated[missing[i]] = correlations[i];
+    }
+  };
+
+  // first of the best, like the exhaustive search; NaN never wins
+  auto bestIn = [&](size_t low, size_t high) {
+    size_t best = low;
+    double bestCorrelation = -2.0;
+    for (auto it = evaluated.lower_bound(low);
+         it != evaluated.end() && it->first <= high;
+         it++) {
+      if (it->second > bestCorrelation) {
+        bestCorrelation = it->second;
+        best = it->first;
+      }
+    }
+    return best;
+  };
+
+  size_t low = 0;
+  size_t high = grid.empty() ? 0 : grid.size() - 1;
+  while (!grid.empty() && high - low + 1 > coarsePoints) {
+    const size_t stride = (high - low + coarsePoints - 2) / (coarsePoints - 1);
+    std::vector<size_t> indices;
+    for (size_t index = low; index < high; index += stride) {
+      indices.push_back(index);
+    }
+    indices.push_back(high);
+    evaluate(indices);
+
+    const size_t best = bestIn(low, high);
+    low = best > low + stride ? best - stride : low;
+    high = std::min(high, best + stride);
+  }
+
+  std::vector<size_t> finalIndices;
+  for (size_t index = low; !grid.empty() && index <= high; index++) {
+    finalIndices.push_back(index);
+  }
+  evaluate(finalIndices);
+
+  ThresholdSearchResult result;
+  for (const auto& [index, correlation] : evaluated) {
+    result.thresholds.push_back(grid[index]);
+    result.correlations.push_back(correlation);
+  }
+  std::cout << "Threshold search: evaluated " << evaluated.size() << " of "
+            << grid.size() << " thresholds\n";
+  return result;
+}
+
+// correlations of thresholds with flooded areas of an in-memory stack
+inline std::vector<double>
+scoreThresholdsOnStack(const std::vector<std::vector<double>>& pixelStack,
+                       const std::vector<double>& thresholds,
+                       std::vector<double>& elevations)
+{
+  std::vector<double> correlations;
+  for (double threshold : thresholds) {
+    std::vector<unsigned int> floodedAreaValues;
+    for (const auto& pixelValues : pixelStack) {
+      floodedAreaValues.push_back(calcFloodedArea(pixelValues, threshold));
+    }
+    correlations.push_back(calcCorrelationCoeff(floodedAreaValues, elevations));
+  }
+  return correlations;
+}
+
+/*
+* Copy of a stack with the values of every date sorted and NaN dropped. The
+* flooded area of a threshold is then a binary search per date, so a
+* resident stack answers any threshold range without touching the pixels.
+*/
+inline std::vector<std::vector<double>>
+sortPixelStack(const std::vector<std::vector<double>>& pixelStack)
+{
+  std::vector<std::vector<double>> sorted(pixelStack.size());
+  parallelFor(pixelStack.size(), [&](size_t d) {
+    // NaN is never below a threshold, see calcFloodedArea
+    for (double value : pixelStack[d]) {
+      if (!std::isnan(value)) {
+        sorted[d].push_back(value);
+      }
+    }
+    std::sort(sorted[d].begin(), sorted[d].end());
+  });
+  return sorted;
+}
+
+// same as scoreThresholdsOnStack, on a stack made by sortPixelStack
+inline std::vector<double>
+scoreThresholdsOnSortedStack(const std::vector<std::vector<double>>& sortedStack,
+                             const std::vector<double>& thresholds,
+                             std::vector<double>& elevations)
+{
+  std::vector<double> correlations;
+  for (double threshold : thresholds) {
+    std::vector<unsigned int> floodedAreaValues;
+    for (const auto& values : sortedStack) {
+      floodedAreaValues.push_back(
+        std::lower_bound(values.begin(), values.end(), threshold) -
+        values.begin());
+    }
+    correlations.push_back(calcCorrelationCoeff(floodedAreaValues, elevations));
+  }
+  return correlations;
+}
+
+/*
+* Stack of images decimated by factor (averaged blocks), pixels outside the
+* area of interest dropped.
+* @param aoiMask is the mask of the full resolution grid
+*/
+inline std::vector<std::vector<double>>
+readCoarseStack(const std::vector<std::string>& rasterPaths,
+                const AoiMask& aoiMask,
+                int xSize,
+                int ySize,
+                int factor)
+{
+  const AoiMask coarseMask = decimateAoiMask(aoiMask, xSize, ySize, factor);
+  std::vector<std::vector<double>> stack(rasterPaths.size());
+  for (size_t i = 0; i < rasterPaths.size(); i++) {
+    auto dataset = static_cast<GDALDataset*>(
+      GDALOpen(rasterPaths[i].c_str(), GA_ReadOnly));
+    if (dataset == nullptr) {
+      std::cout << "Could not open " << rasterPaths[i] << "\n";
+      continue;
+    }
+    getDecimatedPixelValues(dataset, factor, stack[i]);
+    GDALClose(dataset);
+    applyAoiMask(stack[i], coarseMask);
+  }
+  return stack;
+}
+
+// the n values with the highest scores (NaN scores skipped), ascending
+template<typename T>
+inline std::vector<T>
+pickBestCandidates(const std::vector<T>& values,
+                   const std::vector<double>& scores,
+                   size_t n)
+{
+  std::vector<size_t> order;
+  for (size_t i = 0; i < values.size() && i < scores.size(); i++) {
+    if (!std::isnan(scores[i])) {
+      order.push_back(i);
+    }
+  }
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return scores[a] > scores[b];
+  });
+  order.resize(std::min(order.size(), n));
+
+  std::vector<T> best;
+  for (auto i : order) {
+    best.push_back(values[i]);
+  }
+  std::sort(best.begin(), best.end());
+  return best;
+}
+
+/*
+* Best correlation of every number of classes on a (coarse) stack: centroids
+* are fitted to all points, every split into flood classes is scored.
+* Nothing is written to the cache.
+* @param vectorVH, vectorVV hold k-means input of all dates, date after date
+*/
+inline std::vector<double>
+scoreClassCountsOnStack(const std::vector<double>& vectorVH,
+                        const std::vector<double>& vectorVV,
+                        size_t pixelsPerDate,
+                        std::vector<double>& elevations,
+                        const std::vector<int>& numClassesToTry,
+                        int maxiter,
+                        const std::string& strategy,
+                        unsigned int seed = 0)
+{
+  std::vector<size_t> sample(vectorVH.size());
+  for (size_t i = 0; i < sample.size(); i++) sample[i] = i;
+
+  std::vector<double> scores;
+  std::vector<unsigned char> labels(vectorVH.size());
+  for (int cl : numClassesToTry) {
+    std::vector<double> centroidsVH;
+    std::vector<double> centroidsVV;
+    fitKMeansCentroids(
+      vectorVH, vectorVV, sample, cl, maxiter, centroidsVH, centroidsVV, seed);
+    labelPixels(vectorVH.data(),
+                vectorVV.data(),
+                vectorVH.size(),
+                centroidsVH,
+                centroidsVV,
+                labels.data());
+    const auto histograms =
+      computeLabelHistograms(labels.data(), pixelsPerDate, elevations.size());
+
+    double best = -1.0;
+    for (unsigned int floodClassesNum = cl - 1; floodClassesNum > 0;
+         floodClassesNum--) {
+      std::vector<unsigned int> floodedAreaValues;
+      calculateFloodedAreasFromKMeansOutput(
+        floodedAreaValues,
+        histograms,
+        orderFloodClasses(centroidsVH, centroidsVV, floodClassesNum, strategy));
+      best = std::max(best, calcCorrelationCoeff(floodedAreaValues, elevations));
+    }
+    std::cout << "Coarse correlation of " << cl << " classes: " << best << "\n";
+    scores.push_back(best);
+  }
+  return scores;
+}
@@ -0,0 +1,223 @@
+#pragma once
+
+#include "RasterInfo.hpp"
+#include "gdal/gdal_priv.h"
+#include "polarization.hpp"
+#include "rasters.hpp"
+#include "types.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+/*
+*
+* Catalog of a SAR archive: one line per raster with everything floodsar needs
+* to know before processing it. Built once by analyze_dir, then refreshed
+* incrementally - only new or modified files are opened again.
+*
+*/
+
+const std::string catalogHeader =
+  "path\tdate\tpol\tcrs\tminX\tminY\tmaxX\tmaxY\txSize\tySize\tfileSize\tmodified";
+
+class CatalogEntry
+{
+public:
+  std::string path;
+  Date date;
+  Polarization pol = Polarization::e;
+  std::string crs;
+  // footprint in the raster's own CRS
+  double minX = 0.0;
+  double minY = 0.0;
+  double maxX = 0.0;
+  double maxY = 0.0;
+  int xSize = 0;
+  int ySize = 0;
+  // used to detect files changed since the catalog was written
+  uintmax_t fileSize = 0;
+  int64_t modified = 0;
+};
+
+inline int64_t
+getModificationTime(const fs::path& path)
+{
+  std::error_code error;
+  auto time = fs::last_write_time(path, error);
+  if (error) {
+    return 0;
+  }
+  return time.time_since_epoch().count();
+}
+
+/*
+* Extracts date and polarization from the file name and CRS, footprint and
+* size from the raster header.
+*/
+inline bool
+inventoryRaster(const std::string& path,
+                RasterInfoExtractor* extractor,
+                CatalogEntry& entry)
+{
+  RasterInfo info = extractor->extractFromPath(path);
+  entry.path = path;
+  entry.date = info.date;
+  entry.pol = info.pol;
+  entry.fileSize = fs::file_size(path);
+  entry.modified = getModificationTime(path);
+
+  auto raster = static_cast<GDALDataset*>(GDALOpen(path.c_str(), GA_ReadOnly));
+  if (raster == nullptr) {
+    std::cout << "Could not open " << path << "\n";
+    return false;
+  }
+  auto bbox = getRasterBoundingBox(raster);
+  entry.crs = getRasterCrs(raster);
+  entry.xSize = bbox.widthInPixels;
+  entry.ySize = bbox.heightInPixels;
+  entry.minX = std::min(bbox.upperLeftX, bbox.lowerRightX);
+  entry.maxX = std::max(bbox.upperLeftX, bbox.lowerRightX);
+  entry.minY = std::min(bbox.upperLeftY, bbox.lowerRightY);
+  entry.maxY = std::max(bbox.upperLeftY, bbox.lowerRightY);
+  GDALClose(raster);
+  return entry.pol != Polarization::e;
+}
+
+inline bool
+writeCatalog(const std::string& catalogPath,
+             const std::vector<CatalogEntry>& entries)
+{
+  std::ofstream ofs(catalogPath);
+  if (!ofs) {
+    std::cout << "Could not write catalog " << catalogPath << "\n";
+    return false;
+  }
+  ofs.precision(17);
+  ofs << catalogHeader << "\n";
+  for (const auto& e : entries) {
+    ofs << e.path << "\t" << e.date << "\t" << polToString(e.pol) << "\t"
+        << e.crs << "\t" << e.minX << "\t" << e.minY << "\t" << e.maxX << "\t"
+        << e.maxY << "\t" << e.xSize << "\t" << e.ySize << "\t" << e.fileSize
+        << "\t" << e.modified << "\n";
+  }
+  return static_cast<bool>(ofs);
+}
+
+inline bool
+readCatalog(const std::string& catalogPath, std::vector<CatalogEntry>& entries)
+{
+  std::ifstream ifs(catalogPath);
+  std::string line;
+  if (!std::getline(ifs, line) || line != catalogHeader) {
+    return false;
+  }
+  while (std::getline(ifs, line)) {
+    std::vector<std::string> fields;
+    std::stringstream data(line);
+    std::string field;
+    while (std::getline(data, field, '\t')) {
+      fields.push_back(field);
+    }
+    if (fields.size() != 12) {
+      std::cout << "Skipping malformed catalog line: " << line << "\n";
+      continue;
+    }
+    CatalogEntry e;
+    e.path = fields[0];
+    e.date = fields[1];
+    e.pol = stringToPol(fields[2]);
+    e.crs = fields[3];
+    e.minX = std::stod(fields[4]);
+    e.minY = std::stod(fields[5]);
+    e.maxX = std::stod(fields[6]);
+    e.maxY = std::stod(fields[7]);
+    e.xSize = std::stoi(fields[8]);
+    e.ySize = std::stoi(fields[9]);
+    e.fileSize = std::stoull(fields[10]);
+    e.modified = std::stoll(fields[11]);
+    entries.push_back(e);
+  }
+  return true;
+}
+
+/*
+* Scans the archive and inventories its rasters in parallel. Entries of a
+* previous catalog are reused for files whose size and modification time did
+* not change.
+*/
+inline std::vector<CatalogEntry>
+scanArchive(const std::string& dirname,
+            const std::string& fileExtension,
+            RasterInfoExtractor* extractor,
+            const std::vector<CatalogEntry>& previous = {})
+{
+  std::map<std::string, const CatalogEntry*> known;
+  for (const auto& entry : previous) {
+    known[entry.path] = &entry;
+  }
+
+  std::vector<CatalogEntry> entries;
+  std::vector<size_t> toInventory;
+  for (auto& p : fs::recursive_directory_iterator(dirname)) {
+    if (!p.is_regular_file() || !isCandidateRaster(p.path(), fileExtension)) {
+      continue;
+    }
+    const std::string path = fs::absolute(p.path()).string();
+    auto it = known.find(path);
+    if (it != known.end() && it->second->fileSize == p.file_size() &&
+        it->second->modified == getModificationTime(p.path())) {
+      entries.push_back(*it->second);
+    } else {
+      entries.push_back(CatalogEntry());
+      entries.back().path = path;
+      toInventory.push_back(entries.size() - 1);
+    }
+  }
+
+  std::cout << "Catalog: " << entries.size() - toInventory.size()
+            << " rasters unchanged, " << toInventory.size()
+            << " to inventory\n";
+
+  std::vector<char> valid(entries.size(), 1);
+  parallelFor(toInventory.size(), [&](size_t i) {
+    auto& entry = entries[toInventory[i]];
+    valid[toInventory[i]] = inventoryRaster(entry.path, extractor, entry);
+  });
+
+  std::vector<CatalogEntry> out;
+  for (size_t i = 0; i < entries.size(); i++) {
+    if (valid[i]) {
+      out.push_back(entries[i]);
+    } else {
+      std::cout << "Not cataloged: " << entries[i].path << "\n";
+    }
+  }
+  std::sort(out.begin(),
+            out.end(),
+            [](const CatalogEntry& a, const CatalogEntry& b) {
+              return a.path < b.path;
+            });
+  return out;
+}
+
+// the form the rest of the pipeline works with
+inline std::vector<RasterInfo>
+catalogToRasterInfos(const std::vector<CatalogEntry>& entries)
+{
+  std::vector<RasterInfo> infos;
+  for (const auto& entry : entries) {
+    RasterInfo info(entry.path, entry.pol, entry.date);
+    info.proj4 = entry.crs;
+    infos.push_back(info);
+  }
+  return infos;
+}
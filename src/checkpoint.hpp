@@ -0,0 +1,322 @@
+#pragma once
+
+#include "clustering.hpp"
+#include "speckle.hpp"
+#include "types.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+/*
+*
+* Checkpoints of long calibration sweeps, for --resume:
+* - the loaded 2D pixel cube (VH and VV of all matched dates inside the
+*   area of interest), so a restart does not read the images again,
+* - a completion marker of every k, written after its centroids and labels
+*   were renamed into place, holding the parameters they were made with,
+* - correlations of 1D thresholds, appended after every batch.
+* Files are written under a temporary name and renamed, so an interrupted
+* run leaves either a complete file or none.
+*
+*/
+
+const char pixelCubeMagic[8] = { 'F', 'S', 'C', 'U', 'B', 'E', '1', '\0' };
+// dates are stored in fixed fields
+const size_t pixelCubeDateBytes = 16;
+
+struct PixelCubeHeader
+{
+  char magic[8];
+  uint64_t pixelsPerDate;
+  uint64_t numDates;
+};
+
+// images read with a speckle filter make a cube of their own
+inline std::string
+pixelCubePath(const std::string& polarization)
+{
+  const SpeckleFilter& filter = speckleFilter();
+  const std::string suffix = filter.isEnabled()
+                               ? "_" + filter.type + std::to_string(filter.window)
+                               : "";
+  return workPath(".floodsar-cache/kmeans_inputs/cube_" + polarization + suffix + ".bin");
+}
+
+/*
+* Writes values of all dates, date after date, with the dates they belong to.
+* @param values holds pixelsPerDate * dates.size() values
+*/
+inline bool
+writePixelCube(const std::string& path,
+               const std::vector<Date>& dates,
+               const double* values,
+               size_t pixelsPerDate)
+{
+  const std::string partialPath = path + ".partial";
+  std::FILE* file = std::fopen(partialPath.c_str(), "wb");
+  if (file == nullptr) {
+    std::cout << "[writePixelCube] Could not open " << partialPath << "\n";
+    return false;
+  }
+  PixelCubeHeader header;
+  std::memcpy(header.magic, pixelCubeMagic, sizeof(header.magic));
+  header.pixelsPerDate = pixelsPerDate;
+  header.numDates = dates.size();
+  bool written = std::fwrite(&header, sizeof(header), 1, file) == 1;
+  for (const auto& date : dates) {
+    char field[pixelCubeDateBytes] = {};
+    std::strncpy(field, date.c_str(), sizeof(field) - 1);
+    written = written && std::fwrite(field, sizeof(field), 1, file) == 1;
+  }
+  const size_t count = pixelsPerDate * dates.size();
+  written = written && std::fwrite(values, sizeof(double), count, file) == count;
+  written = std::fclose(file) == 0 && written;
+  if (!written) {
+    std::cout << "[writePixelCube] Could not write " << partialPath << "\n";
+    std::remove(partialPath.c_str());
+    return false;
+  }
+  return std::rename(partialPath.c_str(), path.c_str()) == 0;
+}
+
+/*
+* Reads a cube written for exactly these dates and pixels per date.
+* @return false (values untouched) if there is no such cube
+*/
+inline bool
+readPixelCube(const std::string& path,
+              const std::vector<Date>& dates,
+              size_t pixelsPerDate,
+              std::vector<double>& values)
+{
+  std::FILE* file = std::fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    return false;
+  }
+  PixelCubeHeader header;
+  bool valid = std::fread(&header, sizeof(header), 1, file) == 1 &&
+               std::memcmp(header.magic, pixelCubeMagic, sizeof(header.magic)) == 0 &&
+               header.pixelsPerDate == pixelsPerDate &&
+               header.numDates == dates.size();
+  for (size_t d = 0; valid && d < dates.size(); d++) {
+    char field[pixelCubeDateBytes];
+    valid = std::fread(field, sizeof(field), 1, file) == 1 &&
+            dates[d].compare(0, sizeof(field) - 1,
+                             std::string(field, strnlen(field, sizeof(field)))) == 0;
+  }
+  if (valid) {
+    const size_t count = pixelsPerDate * dates.size();
+    std::vector<double> cube(count);
+    valid = std::fread(cube.data(), sizeof(double), count, file) == count;
+    if (valid) {
+      values = std::move(cube);
+    }
+  }
+  std::fclose(file);
+  if (!valid) {
+    std::cout << "Pixel cube " << path << " does not match the matched dates\n";
+  }
+  return valid;
+}
+
+// writes a small text file under a temporary name and renames it
+inline void
+writeFileAtomically(const std::string& path, const std::string& content)
+{
+  const std::string partialPath = path + ".partial";
+  {
+    std::ofstream ofs(partialPath);
+    ofs << content;
+  }
+  std::error_code error;
+  fs::rename(partialPath, path, error);
+}
+
+/*
+* Number and FNV-1a hash of the matched scenes: their dates and, when
+* given, the gauge values they were matched with. A scene added to or
+* removed from the cache, or a corrected gauge value, changes the hash.
+*/
+inline std::string
+describeMatchedScenes(const std::vector<Date>& dates,
+                      const std::vector<double>* elevations = nullptr)
+{
+  uint64_t hash = 14695981039346656037ull;
+  auto addText = [&](const std::string& text) {
+    for (unsigned char c : text) {
+      hash = (hash ^ c) * 1099511628211ull;
+    }
+  };
+  for (size_t d = 0; d < dates.size(); d++) {
+    addText(dates[d] + ";");
+    if (elevations != nullptr && d < elevations->size()) {
+      std::stringstream value;
+      value << std::setprecision(17) << (*elevations)[d] << ";";
+      addText(value.str());
+    }
+  }
+  std::stringstream description;
+  description << dates.size() << " " << std::hex << std::setw(16)
+              << std::setfill('0') << hash;
+  return description.str();
+}
+
+inline std::string
+kmeansCompletePath(int numClasses)
+{
+  return kmeansOutputDir(numClasses) + "/complete";
+}
+
+/*
+* Everything the outputs of one k depend on. Outputs of a k are reused by
+* --resume only if its marker holds the same key. Gauge values take no part
+* in clustering, only the dates of the stack do.
+*/
+inline std::string
+kmeansCheckpointKey(const std::vector<Date>& dates,
+                    size_t pixelsPerDate,
+                    const std::vector<double>& maxValueDbl,
+                    bool convToDB,
+                    double fraction,
+                    int maxiter,
+                    unsigned int seed,
+                    bool tiled)
+{
+  std::stringstream key;
+  key << std::setprecision(17) << "dates " << describeMatchedScenes(dates)
+      << " pixels "
+      << pixelsPerDate << " maxValue";
+  for (double value : maxValueDbl) {
+    key << " " << value;
+  }
+  key << " dB " << convToDB << " fraction " << fraction << " maxiter "
+      << maxiter << " seed " << seed << " tiled " << tiled << " speckle "
+      << speckleFilter().describe();
+  return key.str();
+}
+
+inline bool
+isKMeansOutputComplete(int numClasses, const std::string& key)
+{
+  std::ifstream ifs(kmeansCompletePath(numClasses));
+  std::string marker;
+  return std::getline(ifs, marker) && marker == key;
+}
+
+// an output about to be rewritten is no longer complete
+inline void
+clearKMeansOutputComplete(int numClasses)
+{
+  std::error_code error;
+  fs::remove(kmeansCompletePath(numClasses), error);
+}
+
+inline void
+markKMeansOutputComplete(int numClasses, const std::string& key)
+{
+  writeFileAtomically(kmeansCompletePath(numClasses), key + "\n");
+}
+
+inline std::string
+thresholdCheckpointPath(const std::string& polarization)
+{
+  return workPath(".floodsar-cache/1d_output/" + polarization + "_correlations.txt");
+}
+
+/*
+* Correlations of evaluated thresholds, one "threshold correlation" line per
+* threshold after a key line. Appended batch by batch; a partly written last
+* line of an interrupted run is ignored.
+*/
+class ThresholdCheckpoint
+{
+public:
+  /*
+  * @param resume keeps correlations recorded for the same key, otherwise
+  * the checkpoint starts empty
+  */
+  ThresholdCheckpoint(const std::string& path,
+                      const std::string& key,
+                      bool resume)
+  {
+    if (resume) {
+      std::ifstream ifs(path);
+      std::string line;
+      if (std::getline(ifs, line) && line == key) {
+        while (std::getline(ifs, line)) {
+          // strtod also reads back nan of thresholds without flooded pixels
+          std::stringstream fields(line);
+          std::string threshold, correlation;
+          char* end = nullptr;
+          if (fields >> threshold >> correlation) {
+            const double value = std::strtod(correlation.c_str(), &end);
+            if (*end == '\0') {
+              m_correlations[threshold] = value;
+            }
+          }
+        }
+        std::cout << "Resuming: " << m_correlations.size()
+                  << " thresholds already evaluated\n";
+      }
+    }
+    m_ofs.open(path, std::ofstream::out | std::ofstream::trunc);
+    m_ofs << key << "\n" << std::setprecision(17);
+    for (const auto& [threshold, correlation] : m_correlations) {
+      m_ofs << threshold << " " << correlation << "\n";
+    }
+    m_ofs.flush();
+  }
+
+  /*
+  * Correlations of a batch: recorded ones are taken from the checkpoint,
+  * the others are scored and recorded.
+  */
+  std::vector<double> score(
+    const std::vector<double>& batch,
+    const std::function<std::vector<double>(const std::vector<double>&)>& scorer)
+  {
+    std::vector<double> missing;
+    for (double threshold : batch) {
+      if (!m_correlations.count(thresholdKey(threshold))) {
+        missing.push_back(threshold);
+      }
+    }
+    if (!missing.empty()) {
+      const auto correlations = scorer(missing);
+      for (size_t i = 0; i < missing.size(); i++) {
+        m_correlations[thresholdKey(missing[i])] = correlations[i];
+        m_ofs << thresholdKey(missing[i]) << " " << correlations[i] << "\n";
+      }
+      m_ofs.flush();
+    }
+    std::vector<double> correlations;
+    for (double threshold : batch) {
+      correlations.push_back(m_correlations[thresholdKey(threshold)]);
+    }
+    return correlations;
+  }
+
+private:
+  // thresholds of the grid compare equal after a round trip through text
+  static std::string thresholdKey(double threshold)
+  {
+    std::stringstream key;
+    key << std::setprecision(17) << threshold;
+    return key.str();
+  }
+
+  std::map<std::string, double> m_correlations;
+  std::ofstream m_ofs;
+};
@@ -1,7 +1,16 @@
 #pragma once
 
-#include <random>
+#include "labels.hpp"
+#include "trace.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <filesystem>
 #include <fstream>
+#include <random>
+
+namespace fs = std::filesystem;
 
 /*
 * The 2D algorithm that performs clustering on two SAR polarizations at the same time.
@@ -15,164 +24,301 @@
 */
 const std::string kmeansInputFilename = "KMEANS_INPUT";
 const int kmeansMinimumPoints = 100;
-/*
-*
-* Function performs k-means clustering for floodSar
-*
-*/
-void
-performClustering(std::vector<double>& vectorVH,
-    std::vector<double>& vectorVV,
-    int numClasses, int maxiter, double frac)
+// labels are stored as bytes, 0 is never assigned
+const int kmeansMaximumClasses = 255;
+//in case of pixel value = 0 durinf lin to dB conversion
+const double minValueDbl = -40.0;
+
+inline std::string
+kmeansOutputDir(int numClasses)
 {
+  return workPath(".floodsar-cache/kmeans_outputs/" + kmeansInputFilename +
+                  "_cl_" + std::to_string(numClasses));
+}
 
-    std::string outDir = ".floodsar-cache/kmeans_outputs/" + kmeansInputFilename +
-        "_cl_" + std::to_string(numClasses);
-    fs::create_directory(outDir);
+inline std::string
+kmeansClustersPath(int numClasses)
+{
+  return kmeansOutputDir(numClasses) + "/" + std::to_string(numClasses) +
+         "-clusters.txt";
+}
 
-	
-	//  initialization
-    int numPoints = vectorVH.size();
-    int numPointsFrac = round(numPoints * frac);
-    bool updated = false;
-    double best;
+inline std::string
+kmeansLabelsPath(int numClasses)
+{
+  return kmeansOutputDir(numClasses) + "/" + std::to_string(numClasses) +
+         "-labels.bin";
+}
 
+// numbers of all and flood classes of the best 2D configuration
+inline std::string
+bestClassPath()
+{
+  return workPath(".floodsar-cache/kmeans_outputs/best.txt");
+}
 
-    if (numPointsFrac < 1) numPointsFrac = kmeansMinimumPoints;
-    if (numPointsFrac > numPoints) numPointsFrac = numPoints;
-    std::cout << "Clustering sample: " << numPointsFrac  << " / All pixels: " << numPoints << "\n";
-    std::vector<size_t> allPointsInd(numPoints);
-    for (int i = 0; i < numPoints; i++) allPointsInd[i] = i;
-    std::vector<size_t> fracInd;
-	if(frac < 1)
-		std::sample(allPointsInd.begin(), allPointsInd.end(), std::back_inserter(fracInd), numPointsFrac, std::mt19937{ std::random_device{}() });
-	else
-		fracInd = allPointsInd;
-		
-
-    // randomization
-    std::random_device dev;
-    std::mt19937 rng(dev());
-    std::uniform_int_distribution<std::mt19937::result_type> mydist(
-        0, numPoints); 
-
-    std::vector<double> centroidsVH;
-    std::vector<double> centroidsVV;
-
-    std::vector<int> clusterAssignments;
-    std::vector<int> clusterAssignmentsFrac;
-    clusterAssignments.resize(numPoints, 0);
-    clusterAssignmentsFrac.resize(numPointsFrac, 0);
-
-    // first initialize
-    for (int i = 0; i < numClasses; i++) {
-        auto randPoint = mydist(rng);
-        centroidsVH.push_back(vectorVH.at(randPoint));
-        centroidsVV.push_back(vectorVV.at(randPoint));
-    }
+// dB conversion and clipping of the k-means input, for --update
+inline std::string
+kmeansInputOptionsPath()
+{
+  return workPath(".floodsar-cache/kmeans_outputs/input.txt");
+}
 
-    //Find clusters based on a fraction of the data
-    for (int iter = 0; iter < maxiter; iter++) {
-        std::cout << "Iter " << iter << "/" << maxiter << "\n";
-        updated = false;
-        for (int i = 0; i < numPointsFrac; i++) {
-            /* find nearest centre for each point */
-            int ii = fracInd[i];
-            best = std::numeric_limits<double>::max(); // positive infinity...
-            int newClusterNumber = 0;
-            for (int j = 0; j < numClasses; j++) {
-
-                double tmpVH = vectorVH.at(ii) - centroidsVH.at(j);
-                tmpVH *= tmpVH;
-                double tmpVV = vectorVV.at(ii) - centroidsVV.at(j);
-                tmpVV *= tmpVV;
-
-                double sum = tmpVH + tmpVV;
-
-                if (sum < best) {
-                    best = sum;
-                    newClusterNumber = j + 1;
-                }
-            }
-            if (clusterAssignmentsFrac[i] != newClusterNumber) {
-                updated = true;
-                clusterAssignmentsFrac[i] = newClusterNumber;
-            }
-        }
-
-        // After checking everywhere we look if there was an update
-        if (!updated)
-            break;
-
-        // recalculate centroids.
-        for (int i = 0; i < numClasses; i++) {
-            centroidsVH[i] = 0.0;
-            centroidsVV[i] = 0.0;
-        }
-
-        std::vector<int> counts;
-        counts.resize(numClasses, 0);
-
-        for (int i = 0; i < numPointsFrac; i++) {
-            auto centroidIndex = clusterAssignmentsFrac[i] - 1;
-            int ii = fracInd[i];
-            centroidsVH[centroidIndex] += vectorVH[ii];
-            centroidsVV[centroidIndex] += vectorVV[ii];
-            counts[centroidIndex]++;
-        }
-
-        for (int i = 0; i < numClasses; i++) {
-            centroidsVH[i] /= counts[i];
-            centroidsVV[i] /= counts[i];
-        }
+// speckle filter the k-means input was read with, for --update
+inline std::string
+kmeansSpecklePath()
+{
+  return workPath(".floodsar-cache/kmeans_outputs/speckle.txt");
+}
 
+inline void
+writeKMeansInputOptions(const std::vector<double>& maxValueDbl, bool convToDB)
+{
+  std::ofstream ofs(kmeansInputOptionsPath());
+  ofs << convToDB;
+  for (double value : maxValueDbl) {
+    ofs << " " << value;
+  }
+  ofs << "\n";
+}
+
+inline bool
+readKMeansInputOptions(std::vector<double>& maxValueDbl, bool& convToDB)
+{
+  std::ifstream ifs(kmeansInputOptionsPath());
+  if (!(ifs >> convToDB)) {
+    return false;
+  }
+  maxValueDbl.clear();
+  double value;
+  while (ifs >> value) {
+    maxValueDbl.push_back(value);
+  }
+  return true;
+}
+
+// label (1-based) of the centroid nearest to the point
+inline unsigned char
+nearestCentroid(double vh,
+                double vv,
+                const std::vector<double>& centroidsVH,
+                const std::vector<double>& centroidsVV)
+{
+  double best = std::numeric_limits<double>::max(); // positive infinity...
+  unsigned char newClusterNumber = 0;
+  for (size_t j = 0; j < centroidsVH.size(); j++) {
+    double tmpVH = vh - centroidsVH[j];
+    tmpVH *= tmpVH;
+    double tmpVV = vv - centroidsVV[j];
+    tmpVV *= tmpVV;
+
+    double sum = tmpVH + tmpVV;
+
+    if (sum < best) {
+      best = sum;
+      newClusterNumber = j + 1;
     }
+  }
+  return newClusterNumber;
+}
 
-    // now label all pixels based on the earlier clustering
-    std::cout << "Labelling all pixels...\n";
-    for (int i = 0; i < numPoints; i++) {
+// fixed seed for reproducible runs, 0 draws one from the system
+inline std::mt19937
+createRandomEngine(unsigned int seed)
+{
+  return std::mt19937(seed != 0 ? seed : std::random_device{}());
+}
+
+/*
+* Finds centroids of (VH, VV) points by k-means.
+* @param sample are indices of the points centroids are fitted to
+* @param seed of the initialization, 0 = random
+*/
+inline void
+fitKMeansCentroids(const std::vector<double>& vectorVH,
+                   const std::vector<double>& vectorVV,
+                   const std::vector<size_t>& sample,
+                   int numClasses,
+                   int maxiter,
+                   std::vector<double>& centroidsVH,
+                   std::vector<double>& centroidsVV,
+                   unsigned int seed = 0)
+{
+  centroidsVH.clear();
+  centroidsVV.clear();
+  if (sample.empty()) {
+    return;
+  }
 
-        best = std::numeric_limits<double>::max(); // positive infinity...
-        int newClusterNumber = 0;
-        for (int j = 0; j < numClasses; j++) {
+  // randomization
+  std::mt19937 rng = createRandomEngine(seed);
+  std::uniform_int_distribution<size_t> mydist(0, sample.size() - 1);
 
-            double tmpVH = vectorVH.at(i) - centroidsVH.at(j);
-            tmpVH *= tmpVH;
-            double tmpVV = vectorVV.at(i) - centroidsVV.at(j);
-            tmpVV *= tmpVV;
+  // first initialize
+  for (int i = 0; i < numClasses; i++) {
+    auto randPoint = sample[mydist(rng)];
+    centroidsVH.push_back(vectorVH[randPoint]);
+    centroidsVV.push_back(vectorVV[randPoint]);
+  }
 
-            double sum = tmpVH + tmpVV;
+  std::vector<unsigned char> clusterAssignmentsFrac(sample.size(), 0);
 
-            if (sum < best) {
-                best = sum;
-                newClusterNumber = j + 1;
-            }
-        }
-        clusterAssignments[i] = newClusterNumber;
+  //Find clusters based on a fraction of the data
+  for (int iter = 0; iter < maxiter; iter++) {
+    TraceScope trace("k-means iteration");
+    std::cout << "Iter " << iter << "/" << maxiter << "\n";
+    bool updated = false;
+    for (size_t i = 0; i < sample.size(); i++) {
+      /* find nearest centre for each point */
+      const size_t ii = sample[i];
+      const unsigned char newClusterNumber = nearestCentroid(
+        vectorVH[ii], vectorVV[ii], centroidsVH, centroidsVV);
+      if (clusterAssignmentsFrac[i] != newClusterNumber) {
+        updated = true;
+        clusterAssignmentsFrac[i] = newClusterNumber;
+      }
     }
 
+    // After checking everywhere we look if there was an update
+    if (!updated)
+      break;
+
+    // recalculate centroids.
+    std::fill(centroidsVH.begin(), centroidsVH.end(), 0.0);
+    std::fill(centroidsVV.begin(), centroidsVV.end(), 0.0);
+    std::vector<size_t> counts(numClasses, 0);
+
+    for (size_t i = 0; i < sample.size(); i++) {
+      auto centroidIndex = clusterAssignmentsFrac[i] - 1;
+      const size_t ii = sample[i];
+      centroidsVH[centroidIndex] += vectorVH[ii];
+      centroidsVV[centroidIndex] += vectorVV[ii];
+      counts[centroidIndex]++;
+    }
 
-    // dump result.
-    std::cout << "Finished clustering. Dump result...\n";
-    const std::string clustersPath =
-        outDir + "/" + std::to_string(numClasses) + "-clusters.txt";
-    const std::string pointsPath =
-        outDir + "/" + std::to_string(numClasses) + "-points.txt";
+    for (int i = 0; i < numClasses; i++) {
+      centroidsVH[i] /= counts[i];
+      centroidsVV[i] /= counts[i];
+    }
+  }
+}
 
-    std::ofstream ofsClusters;
-    ofsClusters.open(clustersPath, std::ofstream::out);
+// labels count points with their nearest centroid
+inline void
+labelPixels(const double* vectorVH,
+            const double* vectorVV,
+            size_t count,
+            const std::vector<double>& centroidsVH,
+            const std::vector<double>& centroidsVV,
+            unsigned char* labels)
+{
+  TraceScope trace("k-means labelling");
+  for (size_t i = 0; i < count; i++) {
+    labels[i] =
+      nearestCentroid(vectorVH[i], vectorVV[i], centroidsVH, centroidsVV);
+  }
+}
 
-    for (int i = 0; i < numClasses; i++) {
-        ofsClusters << centroidsVH[i] << " " << centroidsVV[i] << "\n";
+inline void
+writeKMeansClusters(int numClasses,
+                    const std::vector<double>& centroidsVH,
+                    const std::vector<double>& centroidsVV)
+{
+  fs::create_directory(kmeansOutputDir(numClasses));
+  // renamed when complete, like label stores
+  const std::string partialPath = kmeansClustersPath(numClasses) + ".partial";
+  {
+    std::ofstream ofsClusters(partialPath);
+    for (size_t i = 0; i < centroidsVH.size(); i++) {
+      ofsClusters << centroidsVH[i] << " " << centroidsVV[i] << "\n";
     }
+  }
+  fs::rename(partialPath, kmeansClustersPath(numClasses));
+}
 
-    std::ofstream ofsPoints;
-    ofsPoints.open(pointsPath, std::ofstream::out);
+/*
+* Clipping and dB conversion of k-means input, in place.
+* @param maxValueDbl is empty (no clipping) or holds VV and VH maximum values
+*/
+inline void
+prepareKMeansInput(std::vector<double>& vectorVH,
+                   std::vector<double>& vectorVV,
+                   const std::vector<double>& maxValueDbl,
+                   bool convToDB)
+{
+  if (maxValueDbl.size() >= 2) {
+    for (auto& value : vectorVV) value = std::min(value, maxValueDbl[0]);
+    for (auto& value : vectorVH) value = std::min(value, maxValueDbl[1]);
+  }
+  if (convToDB) {
+    for (auto& value : vectorVV) value = value > 0 ? 10.0 * log10(value) : minValueDbl;
+    for (auto& value : vectorVH) value = value > 0 ? 10.0 * log10(value) : minValueDbl;
+  }
+}
 
-    for (int i = 0; i < numPoints; i++) {
-        ofsPoints << clusterAssignments[i] << "\n";
+/*
+* Indices of the points centroids are fitted to: a fraction of all points
+* drawn with the seed, all of them when frac >= 1.
+*/
+inline std::vector<size_t>
+sampleKMeansPoints(size_t numPoints, double frac, unsigned int seed = 0)
+{
+    size_t numPointsFrac = round(numPoints * frac);
+
+    if (numPointsFrac < 1) numPointsFrac = kmeansMinimumPoints;
+    if (numPointsFrac > numPoints) numPointsFrac = numPoints;
+    std::cout << "Clustering sample: " << numPointsFrac  << " / All pixels: " << numPoints << "\n";
+    std::vector<size_t> allPointsInd(numPoints);
+    for (size_t i = 0; i < numPoints; i++) allPointsInd[i] = i;
+    if (frac >= 1) {
+        return allPointsInd;
+    }
+    std::vector<size_t> fracInd;
+    std::sample(allPointsInd.begin(), allPointsInd.end(), std::back_inserter(fracInd), numPointsFrac, createRandomEngine(seed));
+    return fracInd;
+}
+
+// stores labels of all dates of a k, date after date
+inline void
+writeKMeansLabels(int numClasses,
+                  const std::vector<unsigned char>& labels,
+                  size_t pixelsPerDate)
+{
+    LabelStoreWriter labelsWriter(kmeansLabelsPath(numClasses), pixelsPerDate);
+    for (size_t offset = 0; offset + pixelsPerDate <= labels.size();
+         offset += pixelsPerDate) {
+        labelsWriter.append(labels.data() + offset);
     }
+    labelsWriter.close();
 }
+// labels of the classesNum centroids picked as flooded by the strategy
+inline std::vector<unsigned int>
+orderFloodClasses(const std::vector<double>& centroidsVH,
+                  const std::vector<double>& centroidsVV,
+                  unsigned int classesNum,
+                  const std::string& strategy)
+{
+  std::vector<ClassifiedCentroid> centroids;
+  for (unsigned int i = 0; i < centroidsVH.size(); i++) {
+    centroids.push_back({ centroidsVH[i], centroidsVV[i], i + 1 });
+  }
+
+  if (strategy == "vh") {
+    std::sort(centroids.begin(), centroids.end(), compareByVH());
+  } else if (strategy == "sum") {
+    std::sort(centroids.begin(), centroids.end(), compareBySum());
+  } else {
+    std::sort(centroids.begin(), centroids.end(), compareByVV());
+  }
+
+  // now lets create the list...
+  std::vector<unsigned int> output;
+  for (unsigned int i = 0; i < classesNum && i < centroids.size(); i++) {
+    output.push_back(centroids[i].cl);
+  }
+  return output;
+}
+
 /*
 Function that returns a vector with classes list
 *
@@ -181,30 +327,21 @@ Function that returns a vector with classes list
 * @params is a strategy how to pick flood classes. Only applicable to 2D algorithm. Possible values: vh, vv, sum.
 * 
 */
-std::vector<unsigned int>
+inline std::vector<unsigned int>
 createFloodClassesList(std::string clustersFilePath,
                        unsigned int classesNum,
                        std::string strategy)
 {
-  unsigned int index = 1;
   std::ifstream infile(clustersFilePath);
   double centerX, centerY;
-  std::vector<ClassifiedCentroid> centroids;
+  std::vector<double> centroidsVH;
+  std::vector<double> centroidsVV;
   while (infile >> centerX >> centerY) {
-    centroids.push_back({ centerX, centerY, index });
-    index++;
-  }
-
-  if (strategy == "vh") {
-    std::sort(centroids.begin(), centroids.end(), compareByVH());
-  } else if (strategy == "sum") {
-    std::sort(centroids.begin(), centroids.end(), compareBySum());
-  } else {
-    std::sort(centroids.begin(), centroids.end(), compareByVV());
+    centroidsVH.push_back(centerX);
+    centroidsVV.push_back(centerY);
   }
 
-  // now lets create the list...
-  std::vector<unsigned int> output;
+  auto output = orderFloodClasses(centroidsVH, centroidsVV, classesNum, strategy);
 
   // also save output to file - it will be helpful for the plots.
   std::ofstream ofs;
@@ -212,57 +349,31 @@ createFloodClassesList(std::string clustersFilePath,
              "_floodclasses.txt",
            std::ofstream::out);
 
-  for (int i = 0; i < classesNum; i++) {
-    output.push_back(centroids[i].cl);
-    ofs << centroids[i].cl << "\n";
+  for (auto cl : output) {
+    ofs << cl << "\n";
   }
 
   ofs.close();
   return output;
 }
 
-
-void
 /*
-Function to calculate flooder Areas
-@params floodedAreas is a vector that is filled in during function invocation. 
-@params numberofClasses iz  total number of classes analyzed by k-means
-@params floodClassesNum is a number of flood classes to calculate area
+Function to calculate flooded areas
+@params floodedAreas is a vector that is filled in during function invocation.
+@params histograms are per-date label counts of the k-means output (see computeLabelHistograms)
+@params floodClasses are labels of the classes considered flooded
 */
+inline void
 calculateFloodedAreasFromKMeansOutput(
   std::vector<unsigned int>& floodedAreas, // vector to fill
-  unsigned int numberOfClasses,
-  unsigned int floodClassesNum,
-  int rowsPerDate,
-  std::string strategy)
+  const std::vector<std::array<unsigned int, 256>>& histograms,
+  const std::vector<unsigned int>& floodClasses)
 {
-  const std::string kmeansResultBasePath =
-    "./.floodsar-cache/kmeans_outputs/" + kmeansInputFilename + "_cl_" +
-    std::to_string(numberOfClasses) + "/";
-  const std::string clustersPath =
-    kmeansResultBasePath + std::to_string(numberOfClasses) + "-clusters.txt";
-  const std::string pointsPath =
-    kmeansResultBasePath + std::to_string(numberOfClasses) + "-points.txt";
-  auto floodClasses =
-    createFloodClassesList(clustersPath, floodClassesNum, strategy);
-
-  // loop for kmeans
-  int iterations = 0;
-  unsigned int sum = 0;
-  std::ifstream infile(pointsPath);
-  int point;
-  while (infile >> point) {
-    iterations++;
+  for (const auto& histogram : histograms) {
+    unsigned int sum = 0;
     for (auto c : floodClasses) {
-      if (point == c)
-        sum++;
-    }
-
-    if (iterations == rowsPerDate) {
-      // reset
-      floodedAreas.push_back(sum);
-      sum = 0;
-      iterations = 0;
+      sum += histogram[c];
     }
+    floodedAreas.push_back(sum);
   }
-}
\ No newline at end of file
+}
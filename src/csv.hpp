@@ -37,7 +37,7 @@ private:
   std::vector<int> m_data;
 };
 
-std::istream&
+inline std::istream&
 operator>>(std::istream& str, CSVRow& data)
 {
   data.readNextRow(str);
@@ -0,0 +1,388 @@
+#include "floodsar.hpp"
+#include "HydroDataReader.hpp"
+#include "aoi.hpp"
+#include "calibration.hpp"
+#include "clustering.hpp"
+#include "gdal/gdal_priv.h"
+#include "labels.hpp"
+#include "manifest.hpp"
+#include "maps.hpp"
+#include "polarization.hpp"
+#include "rasters.hpp"
+#include "stages.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <iostream>
+#include <map>
+
+/*
+*
+* Implementation of libfloodsar on top of the building blocks the command
+* line tools use. Unlike runAnalysis, buffers are handed from stage to stage
+* in memory and the cache is never written.
+*
+*/
+
+namespace floodsar {
+
+static_assert(noData == floodMapNoData, "masks use the no data of maps");
+
+namespace {
+
+GridInfo
+toGridInfo(const Grid& grid)
+{
+  GridInfo info;
+  info.xSize = grid.xSize;
+  info.ySize = grid.ySize;
+  std::copy(grid.geoTransform, grid.geoTransform + 6, info.geoTransform);
+  info.projection = grid.projection;
+  return info;
+}
+
+Grid
+toGrid(const GridInfo& info)
+{
+  Grid grid;
+  grid.xSize = info.xSize;
+  grid.ySize = info.ySize;
+  std::copy(info.geoTransform, info.geoTransform + 6, grid.geoTransform);
+  grid.projection = info.projection;
+  return grid;
+}
+
+AoiMask
+toAoiMask(const ImageStack& stack)
+{
+  return AoiMask{ stack.grid.pixels(), stack.masked, stack.validPixels };
+}
+
+// reads one image of the grid, pixels outside the area dropped
+bool
+readImage(const std::string& path,
+          const AoiMask& aoiMask,
+          ScopedStage& stage,
+          std::vector<double>& values)
+{
+  auto dataset = static_cast<GDALDataset*>(GDALOpen(path.c_str(), GA_ReadOnly));
+  if (dataset == nullptr) {
+    std::cout << "[loadImageStack] Could not open " << path << "\n";
+    return false;
+  }
+  const size_t pixels =
+    static_cast<size_t>(dataset->GetRasterXSize()) * dataset->GetRasterYSize();
+  if (pixels != aoiMask.gridWords) {
+    std::cout << "[loadImageStack] " << path
+              << " does not match the grid of the stack\n";
+    GDALClose(dataset);
+    return false;
+  }
+  const bool read = getPixelValuesFromRasterRows(
+    dataset, 0, dataset->GetRasterYSize(), values);
+  GDALClose(dataset);
+  stage.addPixels(values.size());
+  stage.addBytesRead(getFileSize(path));
+  applyAoiMask(values, aoiMask);
+  return read && values.size() == aoiMask.validWords();
+}
+
+} // namespace
+
+ImageStack
+loadImageStack(const std::vector<Scene>& scenes, const std::string& aoiMaskPath)
+{
+  ImageStack stack;
+  if (scenes.empty()) {
+    return stack;
+  }
+  // polarizations of the first scene are loaded for all of them
+  const bool loadVH = !scenes[0].vhPath.empty();
+  const bool loadVV = !scenes[0].vvPath.empty();
+  const GridInfo grid = readGridInfo(loadVH ? scenes[0].vhPath : scenes[0].vvPath);
+  if (grid.xSize == 0) {
+    return stack;
+  }
+  stack.grid = toGrid(grid);
+  const size_t gridWords = stack.grid.pixels();
+  const AoiMask aoiMask = aoiMaskPath.empty()
+                            ? AoiMask{ gridWords, false, {} }
+                            : loadAoiMask(gridWords, aoiMaskPath);
+  stack.masked = aoiMask.masked;
+  stack.validPixels = aoiMask.validPixels;
+
+  ScopedStage stage("load");
+  for (const auto& scene : scenes) {
+    if ((loadVH && scene.vhPath.empty()) || (loadVV && scene.vvPath.empty())) {
+      std::cout << "Skipping " << scene.date << ": missing polarization\n";
+      continue;
+    }
+    std::vector<double> vh;
+    std::vector<double> vv;
+    if ((loadVH && !readImage(scene.vhPath, aoiMask, stage, vh)) ||
+        (loadVV && !readImage(scene.vvPath, aoiMask, stage, vv))) {
+      std::cout << "Skipping " << scene.date << ": could not read images\n";
+      continue;
+    }
+    stack.dates.push_back(scene.date);
+    stack.elevations.push_back(scene.elevation);
+    if (loadVH) {
+      stack.vh.push_back(std::move(vh));
+    }
+    if (loadVV) {
+      stack.vv.push_back(std::move(vv));
+    }
+  }
+  return stack;
+}
+
+ImageStack
+loadCachedImageStack(const std::string& gaugeCsvPath,
+                     bool dualPol,
+                     Polarization pol)
+{
+  const SceneManifest sceneManifest = loadOrBuildSceneManifest();
+  std::map<Date, double> observations;
+  HydroDataReader().readFile(observations, gaugeCsvPath);
+
+  std::vector<::Polarization> polarizations;
+  if (dualPol) {
+    polarizations = { ::Polarization::VH, ::Polarization::VV };
+  } else {
+    polarizations = { pol == Polarization::VH ? ::Polarization::VH
+                                              : ::Polarization::VV };
+  }
+
+  std::vector<Scene> scenes;
+  for (const auto& match :
+       matchScenesWithGauge(sceneManifest, observations, polarizations)) {
+    Scene scene;
+    scene.date = match.date;
+    scene.elevation = match.elevation;
+    for (size_t i = 0; i < polarizations.size(); i++) {
+      auto& path = polarizations[i] == ::Polarization::VH ? scene.vhPath
+                                                          : scene.vvPath;
+      path = match.scenes[i]->cacheKey;
+    }
+    scenes.push_back(scene);
+  }
+  return loadImageStack(scenes, fs::exists(aoiMaskPath()) ? aoiMaskPath() : "");
+}
+
+ThresholdResult
+calibrateThreshold(const ImageStack& stack,
+                   Polarization pol,
+                   const ThresholdOptions& options)
+{
+  ThresholdResult result;
+  result.pol = pol;
+  const auto& images = stack.images(pol);
+  if (images.empty()) {
+    return result;
+  }
+  std::vector<double> elevations = stack.elevations;
+
+  ThresholdScorer scorer = [&](const std::vector<double>& batch) {
+    ScopedStage stage("correlate");
+    stage.addPixels(stack.pixelsPerDate() * images.size() * batch.size());
+    return scoreThresholdsOnStack(images, batch, elevations);
+  };
+  const ThresholdSearchResult search =
+    options.refine
+      ? refineThresholdSearch(options.start, options.end, options.step, scorer)
+      : exhaustiveThresholdSearch(options.start, options.end, options.step, scorer);
+  result.thresholds = search.thresholds;
+  result.correlations = search.correlations;
+
+  // first of the best, like the command line
+  if (!search.thresholds.empty()) {
+    result.threshold = search.thresholds[0];
+  }
+  for (size_t i = 0; i < search.correlations.size(); i++) {
+    if (result.correlation < search.correlations[i]) {
+      result.correlation = search.correlations[i];
+      result.threshold = search.thresholds[i];
+    }
+  }
+  for (const auto& pixelValues : images) {
+    result.floodedAreas.push_back(calcFloodedArea(pixelValues, result.threshold));
+  }
+  return result;
+}
+
+KMeansInput
+createKMeansInput(const ImageStack& stack, const KMeansOptions& options)
+{
+  KMeansInput input;
+  input.pixelsPerDate = stack.pixelsPerDate();
+  input.numDates = std::min(stack.vh.size(), stack.vv.size());
+  input.vh.reserve(input.pixelsPerDate * input.numDates);
+  input.vv.reserve(input.pixelsPerDate * input.numDates);
+  for (size_t d = 0; d < input.numDates; d++) {
+    input.vh.insert(input.vh.end(), stack.vh[d].begin(), stack.vh[d].end());
+    input.vv.insert(input.vv.end(), stack.vv[d].begin(), stack.vv[d].end());
+  }
+  prepareKMeansInput(input.vh, input.vv, options.maxValue, options.convToDB);
+  return input;
+}
+
+Clustering
+clusterKMeans(const KMeansInput& input,
+              int classes,
+              const KMeansOptions& options,
+              std::vector<unsigned char>* labels)
+{
+  ScopedStage stage("cluster k=" + std::to_string(classes));
+  const size_t numPoints = input.vh.size();
+  stage.addPixels(numPoints);
+
+  const std::vector<size_t> sample =
+    sampleKMeansPoints(numPoints, options.fraction, options.seed);
+
+  Clustering clustering;
+  clustering.classes = classes;
+  fitKMeansCentroids(input.vh,
+                     input.vv,
+                     sample,
+                     classes,
+                     options.maxiter,
+                     clustering.centroidsVH,
+                     clustering.centroidsVV,
+                     options.seed);
+
+  std::vector<unsigned char> allLabels(numPoints);
+  labelPixels(input.vh.data(),
+              input.vv.data(),
+              numPoints,
+              clustering.centroidsVH,
+              clustering.centroidsVV,
+              allLabels.data());
+  clustering.histograms =
+    computeLabelHistograms(allLabels.data(), input.pixelsPerDate, input.numDates);
+  if (labels != nullptr) {
+    *labels = std::move(allLabels);
+  }
+  return clustering;
+}
+
+KMeansResult
+scoreClustering(const Clustering& clustering,
+                const std::vector<double>& elevations,
+                const std::string& strategy)
+{
+  KMeansResult result;
+  result.correlation = -1.0;
+  std::vector<double> gauge = elevations;
+  for (int floodClassesNum = clustering.classes - 1; floodClassesNum > 0;
+       floodClassesNum--) {
+    const auto floodClasses = orderFloodClasses(clustering.centroidsVH,
+                                                clustering.centroidsVV,
+                                                floodClassesNum,
+                                                strategy);
+    std::vector<unsigned int> floodedAreas;
+    calculateFloodedAreasFromKMeansOutput(
+      floodedAreas, clustering.histograms, floodClasses);
+    const double corrCoeff = calcCorrelationCoeff(floodedAreas, gauge);
+    // first of the best, like the command line
+    if (corrCoeff > result.correlation) {
+      result.classes = clustering.classes;
+      result.floodClassesNum = floodClassesNum;
+      result.correlation = corrCoeff;
+      result.floodClasses = floodClasses;
+      result.floodedAreas = floodedAreas;
+    }
+  }
+  result.centroidsVH = clustering.centroidsVH;
+  result.centroidsVV = clustering.centroidsVV;
+  return result;
+}
+
+KMeansResult
+calibrateKMeans(const ImageStack& stack, const KMeansOptions& options)
+{
+  KMeansResult result;
+  if (stack.vh.empty() || stack.vh.size() != stack.vv.size()) {
+    std::cout << "[calibrateKMeans] The stack needs VH and VV images\n";
+    return result;
+  }
+  const KMeansInput input = createKMeansInput(stack, options);
+
+  std::vector<unsigned char> labels;
+  int kWithoutImprovement = 0;
+  const int maxClasses = std::min(options.maxClasses, kmeansMaximumClasses);
+  for (int cl = std::max(options.minClasses, 2); cl <= maxClasses; cl++) {
+    const Clustering clustering = clusterKMeans(input, cl, options, &labels);
+    ScopedStage stage("correlate");
+    stage.addPixels(input.vh.size());
+    KMeansResult ofK =
+      scoreClustering(clustering, stack.elevations, options.strategy);
+    const double correlationOfK = ofK.correlation;
+
+    const bool improved = correlationOfK > result.correlation;
+    if (improved) {
+      result = std::move(ofK);
+      result.labels = std::move(labels);
+    }
+
+    kWithoutImprovement = improved ? 0 : kWithoutImprovement + 1;
+    if (options.kPatience > 0 && kWithoutImprovement >= options.kPatience) {
+      break;
+    }
+    if (options.kMargin > 0 &&
+        correlationOfK < result.correlation - options.kMargin) {
+      break;
+    }
+  }
+  return result;
+}
+
+std::vector<unsigned char>
+createFloodMask(const ImageStack& stack,
+                size_t date,
+                const ThresholdResult& result)
+{
+  const auto& images = stack.images(result.pol);
+  if (date >= images.size()) {
+    return {};
+  }
+  std::vector<unsigned char> labels;
+  getThresholdingLabels(images[date], result.threshold, labels);
+
+  const AoiMask aoiMask = toAoiMask(stack);
+  std::vector<unsigned char> mask(aoiMask.gridWords);
+  expandToGrid(labels.data(), aoiMask, mask.data(), noData);
+  return mask;
+}
+
+std::vector<unsigned char>
+createFloodMask(const ImageStack& stack,
+                size_t date,
+                const KMeansResult& result)
+{
+  const size_t pixelsPerDate = stack.pixelsPerDate();
+  if (result.labels.size() < (date + 1) * pixelsPerDate) {
+    return {};
+  }
+  std::vector<unsigned char> compact(pixelsPerDate);
+  classifyLabels(result.labels.data() + date * pixelsPerDate,
+                 pixelsPerDate,
+                 createFloodLookup(result.floodClasses),
+                 compact.data());
+
+  const AoiMask aoiMask = toAoiMask(stack);
+  std::vector<unsigned char> mask(aoiMask.gridWords);
+  expandToGrid(compact.data(), aoiMask, mask.data(), noData);
+  return mask;
+}
+
+bool
+writeFloodMask(const std::string& path,
+               const ImageStack& stack,
+               const std::vector<unsigned char>& mask)
+{
+  if (mask.size() != stack.grid.pixels()) {
+    return false;
+  }
+  return writeFloodMap(path, toGridInfo(stack.grid), mask.data(), MapOptions());
+}
+
+} // namespace floodsar
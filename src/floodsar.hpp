@@ -0,0 +1,244 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/*
+*
+* libfloodsar: embeddable API of the floodsar calibration. A stack of images
+* is loaded once, calibrated by the 1D (threshold) or the 2D (k-means)
+* algorithm and turned into flood masks, all in memory: nothing is written
+* to the cache or to mapped/. GDALAllRegister() must be called before any
+* image is loaded. Link with the floodsar library (libfloodsar).
+*
+*/
+
+namespace floodsar {
+
+// georeferencing and size of the images of a stack
+class Grid
+{
+public:
+  int xSize = 0;
+  int ySize = 0;
+  double geoTransform[6] = { 0.0, 1.0, 0.0, 0.0, 0.0, 1.0 };
+  std::string projection;
+
+  size_t pixels() const { return static_cast<size_t>(xSize) * ySize; }
+};
+
+enum class Polarization
+{
+  VH,
+  VV
+};
+
+// a day of the stack: gauge observation and paths of the images of that day
+class Scene
+{
+public:
+  // yyyymmdd
+  std::string date;
+  // water level or discharge
+  double elevation = 0.0;
+  // empty when the polarization is not available
+  std::string vhPath;
+  std::string vvPath;
+};
+
+/*
+* Images of all dates, pixels outside the area of interest dropped.
+* Images of a polarization are empty when it was not loaded.
+*/
+class ImageStack
+{
+public:
+  Grid grid;
+  // false if the whole grid is inside the area of interest
+  bool masked = false;
+  // indices of grid pixels inside the area of interest, ascending. Only
+  // used when masked, an area without inside pixels has none.
+  std::vector<size_t> validPixels;
+  std::vector<std::string> dates;
+  std::vector<double> elevations;
+  // [date][pixel inside the area]
+  std::vector<std::vector<double>> vh;
+  std::vector<std::vector<double>> vv;
+
+  size_t numDates() const { return dates.size(); }
+
+  size_t pixelsPerDate() const
+  {
+    return masked ? validPixels.size() : grid.pixels();
+  }
+
+  const std::vector<std::vector<double>>& images(Polarization pol) const
+  {
+    return pol == Polarization::VH ? vh : vv;
+  }
+};
+
+/*
+* Reads images of the scenes. Scenes without an image of every loaded
+* polarization are skipped.
+* @param aoiMaskPath is a Byte raster on the grid of the images, pixels with
+* value 0 are outside the area of interest; empty = whole grid
+* @return an empty stack (no dates) when nothing could be read
+*/
+ImageStack
+loadImageStack(const std::vector<Scene>& scenes,
+               const std::string& aoiMaskPath = "");
+
+/*
+* Reads the cropped images of the .floodsar-cache of the current directory
+* (made by the preprocessing of floodsar) matched with a gauge CSV file.
+* @param dualPol loads VH and VV pairs, otherwise only polarization pol
+*/
+ImageStack
+loadCachedImageStack(const std::string& gaugeCsvPath,
+                     bool dualPol,
+                     Polarization pol = Polarization::VV);
+
+class ThresholdOptions
+{
+public:
+  double start = 0.0;
+  double end = 0.1;
+  double step = 0.001;
+  // successive grid refinement instead of evaluating every threshold
+  bool refine = false;
+};
+
+class ThresholdResult
+{
+public:
+  Polarization pol = Polarization::VV;
+  double threshold = 0.0;
+  double correlation = 0.0;
+  // flooded pixels of every date at the best threshold
+  std::vector<unsigned int> floodedAreas;
+  // evaluated thresholds, ascending, and their correlations
+  std::vector<double> thresholds;
+  std::vector<double> correlations;
+};
+
+// 1D algorithm: the threshold whose flooded areas best follow the gauge
+ThresholdResult
+calibrateThreshold(const ImageStack& stack,
+                   Polarization pol,
+                   const ThresholdOptions& options = ThresholdOptions());
+
+class KMeansOptions
+{
+public:
+  int minClasses = 2;
+  int maxClasses = 5;
+  int maxiter = 100;
+  // fraction of pixels centroids are fitted to
+  double fraction = 1.0;
+  // clipping of VV and VH values before clustering, empty = none
+  std::vector<double> maxValue;
+  bool convToDB = false;
+  // how flood classes are picked: vv, vh or sum
+  std::string strategy = "vv";
+  // 0 = random
+  unsigned int seed = 0;
+  // stop after this many k without a better correlation, 0 = try all
+  int kPatience = 0;
+  // stop when a k is this much below the best correlation, 0 = never
+  double kMargin = 0.0;
+};
+
+class KMeansResult
+{
+public:
+  int classes = 0;
+  int floodClassesNum = 0;
+  double correlation = 0.0;
+  std::vector<double> centroidsVH;
+  std::vector<double> centroidsVV;
+  // labels of the flooded classes
+  std::vector<unsigned int> floodClasses;
+  std::vector<unsigned int> floodedAreas;
+  // labels (1-based class) of the best configuration, date after date
+  std::vector<unsigned char> labels;
+};
+
+// 2D algorithm: the clustering whose flooded areas best follow the gauge
+KMeansResult
+calibrateKMeans(const ImageStack& stack,
+                const KMeansOptions& options = KMeansOptions());
+
+/*
+* Steps of calibrateKMeans, for callers that keep results between
+* calibrations (see floodsar --serve): input prepared once per clipping and
+* dB conversion, one clustering per k, scoring of every split into flood
+* classes from label counts only.
+*/
+
+// k-means input of all dates, date after date, clipped and converted
+class KMeansInput
+{
+public:
+  std::vector<double> vh;
+  std::vector<double> vv;
+  size_t pixelsPerDate = 0;
+  size_t numDates = 0;
+};
+
+// uses maxValue and convToDB of the options
+KMeansInput
+createKMeansInput(const ImageStack& stack, const KMeansOptions& options);
+
+// centroids of one k and how many pixels of each date carry each label
+class Clustering
+{
+public:
+  int classes = 0;
+  std::vector<double> centroidsVH;
+  std::vector<double> centroidsVV;
+  std::vector<std::array<unsigned int, 256>> histograms;
+};
+
+/*
+* Fits classes centroids (maxiter, fraction and seed of the options) and
+* labels all pixels.
+* @param labels receives labels of all pixels when not null
+*/
+Clustering
+clusterKMeans(const KMeansInput& input,
+              int classes,
+              const KMeansOptions& options,
+              std::vector<unsigned char>* labels = nullptr);
+
+// best split of a clustering into flood classes, labels are left empty
+KMeansResult
+scoreClustering(const Clustering& clustering,
+                const std::vector<double>& elevations,
+                const std::string& strategy);
+
+/*
+* Flood mask of one date on the full grid: 1 = flooded, 0 = not flooded,
+* noData outside the area of interest.
+*/
+const unsigned char noData = 255;
+
+std::vector<unsigned char>
+createFloodMask(const ImageStack& stack,
+                size_t date,
+                const ThresholdResult& result);
+
+std::vector<unsigned char>
+createFloodMask(const ImageStack& stack,
+                size_t date,
+                const KMeansResult& result);
+
+// writes a mask as a Cloud Optimized GeoTIFF on the grid of the stack
+bool
+writeFloodMask(const std::string& path,
+               const ImageStack& stack,
+               const std::vector<unsigned char>& mask);
+
+} // namespace floodsar
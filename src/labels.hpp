@@ -0,0 +1,320 @@
+#pragma once
+
+#include "utils.hpp"
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+/*
+*
+* Binary label store: per-pixel class labels of all dates, one byte per pixel.
+* Layout is a fixed header followed by the labels, date after date, in the
+* same order as pixels are read from the cropped rasters.
+*
+*/
+
+const char labelStoreMagic[8] = { 'F', 'S', 'L', 'A', 'B', 'E', 'L', '1' };
+
+struct LabelStoreHeader
+{
+  char magic[8];
+  uint64_t pixelsPerDate;
+  uint64_t numDates;
+};
+
+// lookup table: label -> 1 if label is a flood class, 0 otherwise
+typedef std::array<unsigned char, 256> FloodLookup;
+
+/*
+* Streams labels to disk date by date (or in parts of a date, in order).
+* Number of dates is written to the header on close(). The store is
+* written next to path and renamed on close(), so an interrupted run never
+* leaves a truncated store behind.
+* @param append keeps the dates of an existing store and writes after them;
+* the store is copied next to path first, it is left intact until close()
+*/
+class LabelStoreWriter
+{
+public:
+  LabelStoreWriter(const std::string& path,
+                   size_t pixelsPerDate,
+                   bool append = false)
+    : m_path(path)
+    , m_filePath(path + ".partial")
+    , m_file(openPartial(path, m_filePath, append))
+    , m_pixelsPerDate(pixelsPerDate)
+    , m_written(0)
+  {
+    if (m_file == nullptr) {
+      std::cout << "[LabelStoreWriter] Could not open " << path << "\n";
+      return;
+    }
+    if (!append) {
+      writeHeader();
+      return;
+    }
+    LabelStoreHeader header;
+    if (std::fread(&header, sizeof(header), 1, m_file) != 1 ||
+        std::memcmp(header.magic, labelStoreMagic, sizeof(header.magic)) != 0 ||
+        header.pixelsPerDate != pixelsPerDate) {
+      std::cout << "[LabelStoreWriter] " << path
+                << " is not a label store of " << pixelsPerDate
+                << " pixels per date\n";
+      std::fclose(m_file);
+      m_file = nullptr;
+      std::remove(m_filePath.c_str());
+      return;
+    }
+    // a partly written date is overwritten
+    m_written = header.numDates * pixelsPerDate;
+    std::fseek(m_file, sizeof(header) + m_written, SEEK_SET);
+  }
+
+  bool isOpen() const { return m_file != nullptr; }
+
+  ~LabelStoreWriter() { close(); }
+
+  // appends labels of one date, pixelsPerDate values are expected
+  void append(const unsigned char* labels)
+  {
+    appendPixels(labels, m_pixelsPerDate);
+  }
+
+  // appends labels of a part of a date (e.g. a strip of the grid)
+  void appendPixels(const unsigned char* labels, size_t count)
+  {
+    if (m_file == nullptr) {
+      return;
+    }
+    std::fwrite(labels, 1, count, m_file);
+    m_written += count;
+  }
+
+  void close()
+  {
+    if (m_file == nullptr) {
+      return;
+    }
+    std::fseek(m_file, 0, SEEK_SET);
+    writeHeader();
+    std::fclose(m_file);
+    m_file = nullptr;
+    std::rename(m_filePath.c_str(), m_path.c_str());
+  }
+
+private:
+  static std::FILE* openPartial(const std::string& path,
+                                const std::string& partialPath,
+                                bool append)
+  {
+    if (!append) {
+      return std::fopen(partialPath.c_str(), "wb");
+    }
+    std::error_code error;
+    fs::copy_file(path, partialPath, fs::copy_options::overwrite_existing, error);
+    return error ? nullptr : std::fopen(partialPath.c_str(), "r+b");
+  }
+
+  void writeHeader()
+  {
+    LabelStoreHeader header;
+    std::memcpy(header.magic, labelStoreMagic, sizeof(header.magic));
+    header.pixelsPerDate = m_pixelsPerDate;
+    // only complete dates count
+    header.numDates = m_pixelsPerDate ? m_written / m_pixelsPerDate : 0;
+    std::fwrite(&header, sizeof(header), 1, m_file);
+  }
+
+  std::string m_path;
+  std::string m_filePath;
+  std::FILE* m_file;
+  size_t m_pixelsPerDate;
+  size_t m_written;
+};
+
+/*
+* Read-only, memory-mapped view of a label store.
+*/
+class LabelStore
+{
+public:
+  LabelStore(const std::string& path)
+    : m_data(nullptr)
+    , m_size(0)
+    , m_pixelsPerDate(0)
+    , m_numDates(0)
+  {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      std::cout << "[LabelStore] Could not open " << path << "\n";
+      return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 &&
+        static_cast<size_t>(st.st_size) >= sizeof(LabelStoreHeader)) {
+      m_size = st.st_size;
+      void* mapped = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mapped != MAP_FAILED) {
+        m_data = static_cast<const unsigned char*>(mapped);
+        madvise(mapped, m_size, MADV_SEQUENTIAL);
+      }
+    }
+    ::close(fd);
+
+    if (m_data == nullptr) {
+      std::cout << "[LabelStore] Could not map " << path << "\n";
+      m_size = 0;
+      return;
+    }
+
+    LabelStoreHeader header;
+    std::memcpy(&header, m_data, sizeof(header));
+    if (std::memcmp(header.magic, labelStoreMagic, sizeof(header.magic)) != 0 ||
+        sizeof(header) + header.pixelsPerDate * header.numDates > m_size) {
+      std::cout << "[LabelStore] Not a valid label store: " << path << "\n";
+      return;
+    }
+    m_pixelsPerDate = header.pixelsPerDate;
+    m_numDates = header.numDates;
+  }
+
+  ~LabelStore()
+  {
+    if (m_data != nullptr) {
+      munmap(const_cast<unsigned char*>(m_data), m_size);
+    }
+  }
+
+  LabelStore(const LabelStore&) = delete;
+  LabelStore& operator=(const LabelStore&) = delete;
+
+  bool isValid() const { return m_numDates > 0; }
+  size_t pixelsPerDate() const { return m_pixelsPerDate; }
+  size_t numDates() const { return m_numDates; }
+
+  // labels of the date with given index
+  const unsigned char* date(size_t index) const
+  {
+    return m_data + sizeof(LabelStoreHeader) + index * m_pixelsPerDate;
+  }
+
+private:
+  const unsigned char* m_data;
+  size_t m_size;
+  size_t m_pixelsPerDate;
+  size_t m_numDates;
+};
+
+// labels of the 1D algorithm of a polarization, read by mapper and --update
+inline std::string
+thresholdLabelsPath(const std::string& polarization)
+{
+  return workPath(".floodsar-cache/1d_output/" + polarization);
+}
+
+// best threshold of a polarization, for --update
+inline std::string
+bestThresholdPath(const std::string& polarization)
+{
+  return thresholdLabelsPath(polarization) + "_threshold.txt";
+}
+
+// speckle filter the threshold of a polarization was found with
+inline std::string
+thresholdSpecklePath(const std::string& polarization)
+{
+  return thresholdLabelsPath(polarization) + "_speckle.txt";
+}
+
+inline FloodLookup
+createFloodLookup(const std::vector<unsigned int>& floodClasses)
+{
+  FloodLookup lookup;
+  lookup.fill(0);
+  for (auto c : floodClasses) {
+    if (c < lookup.size()) {
+      lookup[c] = 1;
+    }
+  }
+  return lookup;
+}
+
+/*
+* Maps labels to flood mask values (1 = flooded, 0 = not flooded).
+* With SSSE3 the table is applied 16 pixels at a time via byte shuffle, which
+* covers all classes below 16 - by far the common case of k-means up to 15.
+*/
+inline void
+classifyLabels(const unsigned char* labels,
+               size_t count,
+               const FloodLookup& lookup,
+               unsigned char* mask)
+{
+  size_t i = 0;
+#if defined(__SSSE3__)
+  bool smallClasses = true;
+  for (size_t c = 16; c < lookup.size(); c++) {
+    smallClasses = smallClasses && lookup[c] == 0;
+  }
+  if (smallClasses) {
+    const __m128i table =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(lookup.data()));
+    const __m128i highNibble = _mm_set1_epi8(static_cast<char>(0xF0));
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= count; i += 16) {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(labels + i));
+      // labels >= 16 are not flood classes here
+      __m128i inTable = _mm_cmpeq_epi8(_mm_and_si128(v, highNibble), zero);
+      __m128i result = _mm_and_si128(_mm_shuffle_epi8(table, v), inTable);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(mask + i), result);
+    }
+  }
+#endif
+  for (; i < count; i++) {
+    mask[i] = lookup[labels[i]];
+  }
+}
+
+/*
+* Counts how many pixels of each date carry each label. Flooded area of any
+* set of flood classes is then a sum over the histogram, no pixel is touched
+* again.
+*/
+inline std::vector<std::array<unsigned int, 256>>
+computeLabelHistograms(const unsigned char* labels,
+                       size_t pixelsPerDate,
+                       size_t numDates)
+{
+  std::vector<std::array<unsigned int, 256>> histograms(numDates);
+  for (size_t d = 0; d < numDates; d++) {
+    auto& histogram = histograms[d];
+    histogram.fill(0);
+    const unsigned char* dateLabels = labels + d * pixelsPerDate;
+    for (size_t i = 0; i < pixelsPerDate; i++) {
+      histogram[dateLabels[i]]++;
+    }
+  }
+  return histograms;
+}
+
+inline std::vector<std::array<unsigned int, 256>>
+computeLabelHistograms(const LabelStore& store)
+{
+  if (!store.isValid()) {
+    return {};
+  }
+  return computeLabelHistograms(
+    store.date(0), store.pixelsPerDate(), store.numDates());
+}
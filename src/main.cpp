@@ -7,15 +7,27 @@
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <set>
 #include <string_view>
 #include <thread>
 
 #include "HydroDataReader.hpp"
 #include "RasterInfo.hpp"
+#include "analysis.hpp"
+#include "batch.hpp"
+#include "catalog.hpp"
 #include "csv.hpp"
+#include "labels.hpp"
+#include "manifest.hpp"
+#include "maps.hpp"
 #include "polarization.hpp"
 #include "rasters.hpp"
+#include "serve.hpp"
+#include "speckle.hpp"
+#include "trace.hpp"
 #include "types.hpp"
+#include "update.hpp"
 #include "utils.hpp"
 #include "clustering.hpp"
 
@@ -54,18 +66,33 @@ main(int argc, char** argv)
     "e,extension",
     "Files with this extension will be attempted to be loaded.",
     cxxopts::value<std::string>()->default_value(".tif"))(
+    "catalog",
+    "Catalog of the SAR images directory created by analyze_dir. Used instead of scanning the directory; created if it does not exist.",
+    cxxopts::value<std::string>())(
     "n,threshold",
     "Comma separated sequence of search space, start,end[,step], e.g.: "
     "0.001,0.1,0.01 for thresholding, or 2,10 for clustering.",
     cxxopts::value<std::vector<std::string>>())(
     "o,aoi",
-    "Area of Interest file path. The program expects geocoded tiff (GTiff). "
-    "Content doesn't matter, the program just extracts the bounding box.",
+    "Area of Interest file path. Either a geocoded tiff (GTiff), content doesn't "
+    "matter unless --mask-aoi is given, the program just extracts the bounding box. "
+    "Or a vector file with polygons (shapefile, GeoPackage, GeoJSON), pixels outside "
+    "the polygons are then excluded from the analysis.",
+    cxxopts::value<std::string>())(
+    "mask-aoi",
+    "Use nonzero pixels of the raster area of interest (-o) as a mask, pixels outside are excluded from the analysis.")(
+    "batch",
+    "Csv file with many areas of interest to process over the same images, one per line: name,aoi,gauge,epsg. "
+    "Results of each area go to batch/<name>/. Replaces -o, -g and -p.",
     cxxopts::value<std::string>())(
     "p,epsg",
     "Target EPSG code for processing. Should be the same as for the area of "
     "interest. e.g.: EPSG:32630 for UTM 30N.",
     cxxopts::value<std::string>()->default_value("none"))(
+    "search",
+    "How the 1D algorithm searches thresholds: grid evaluates every threshold of -n, "
+    "refine evaluates a coarse grid and refines it around the best correlation down to the step of -n.",
+    cxxopts::value<std::string>()->default_value("grid"))(
     "s,skip-clustering",
     "Do not perform clustering, assume output files are there.")(
     "y,strategy",
@@ -79,7 +106,59 @@ main(int argc, char** argv)
     cxxopts::value<std::string>()->default_value("100"))(
     "f,fraction",
     "Fraction of pixels used to perform kmeans clustering. Only applicable to 2D algorithm.",
-     cxxopts::value<std::string>()->default_value("1.0"));
+     cxxopts::value<std::string>()->default_value("1.0"))(
+    "tile-memory",
+    "Process the area of interest in strips of rows that fit in this much memory (MiB), so pixel values and labels of all dates are never held at once. The area of interest index and map writing still take memory proportional to the grid. 0 = whole area at once.",
+    cxxopts::value<std::string>()->default_value("0"))(
+    "seed",
+    "Seed of k-means sampling and initialization, for reproducible results. 0 = random.",
+    cxxopts::value<std::string>()->default_value("0"))(
+    "memory-budget",
+    "Memory available to the analysis (MiB). The in-core footprint is predicted from the crop grid and the number of dates before images are loaded; if it does not fit, the area is processed in strips as with --tile-memory. 0 = no budget.",
+    cxxopts::value<std::string>()->default_value("0"))(
+    "k-patience",
+    "Stop the search over the number of k-means classes after this many values of k without a better correlation. 0 = try the whole -n range. Only applicable to 2D algorithm.",
+    cxxopts::value<std::string>()->default_value("0"))(
+    "k-margin",
+    "Stop the search over the number of k-means classes when the best correlation of a k is more than this below the best so far. 0 = never. Only applicable to 2D algorithm.",
+    cxxopts::value<std::string>()->default_value("0"))(
+    "coarse",
+    "Calibrate on images decimated by this factor (averaged blocks) first, then score only the best candidates at full resolution. 1 = off.",
+    cxxopts::value<std::string>()->default_value("1"))(
+    "coarse-candidates",
+    "Number of best thresholds (1D) or numbers of classes (2D) of the coarse calibration scored at full resolution.",
+    cxxopts::value<std::string>()->default_value("3"))(
+    "emit-maps",
+    "Write flood maps of the best configuration to ./mapped, like mapper does, without reading results back from disk.")(
+    "compress",
+    "Compression of maps written with --emit-maps, e.g. DEFLATE, ZSTD, LZW or NONE.",
+    cxxopts::value<std::string>()->default_value("DEFLATE"))(
+    "resampling",
+    "Resampling of overviews of maps written with --emit-maps: MODE or AVERAGE.",
+    cxxopts::value<std::string>()->default_value("MODE"))(
+    "no-cog",
+    "Write --emit-maps maps as plain tiled GeoTIFF, without overviews.")(
+    "no-aggregates",
+    "Do not write flood frequency and first/last flooded date rasters.")(
+    "trace",
+    "Record a timeline of stages, warps, crops, raster reads, k-means iterations and map writes of all threads to this file, in Chrome trace format (chrome://tracing, ui.perfetto.dev).",
+    cxxopts::value<std::string>()->default_value(""))(
+    "update",
+    "Label only images of dates that are not in the cache yet with the persisted calibration (best threshold, or centroids and flood classes of the best k) and append them to the label store; then run mapper --update.")(
+    "drift-sigma",
+    "With --update: report new dates whose flooded area is more than this many residual standard deviations off the gauge relation of the calibration. 0 = no check.",
+    cxxopts::value<std::string>()->default_value("0"))(
+    "speckle",
+    "Speckle filter applied to images as they are read, before thresholding and clustering: none, boxcar, lee or refined-lee.",
+    cxxopts::value<std::string>()->default_value("none"))(
+    "speckle-window",
+    "Window of the speckle filter in pixels, odd.",
+    cxxopts::value<std::string>()->default_value("5"))(
+    "resume",
+    "Continue an interrupted calibration from its checkpoints: reuses the cache like --cache-only, reads the pixel cube instead of the images (2D), skips every k whose outputs are complete and thresholds whose correlations are recorded (1D).")(
+    "serve",
+    "Keep the image stacks of the cache in memory and answer calibration and mapping requests (JSON lines) on this Unix domain socket. Other options give defaults of requests.",
+    cxxopts::value<std::string>()->implicit_value(serveSocketPath));
 
   auto userInput = options.parse(argc, argv);
   
@@ -89,90 +168,189 @@ main(int argc, char** argv)
         std::cout << options.help() << "\n";
         return 0;
     }
+
+  // written when floodsar returns
+  const TraceSession traceSession(userInput["trace"].as<std::string>());
     
+  const bool batchMode = userInput.count("batch");
+  std::vector<BatchJob> batchJobs;
+  if (batchMode) {
+    batchJobs = readBatchFile(userInput["batch"].as<std::string>());
+    if (batchJobs.empty()) {
+      std::cout << "No jobs in the batch file. Program will quit\n";
+      return 0;
+    }
+    std::cout << "Batch mode: " << batchJobs.size() << " areas of interest\n";
+  }
+
   // required parameters
-  if (!userInput.count("gauge")) {
+  if (!batchMode && !userInput.count("gauge")) {
     std::cout << "Path to water level data not provided, use -g option. \n"<< options.help() << "\nProgram will quit\n";
     return 0;
   }
-  auto hydroDataCsvFile = userInput["gauge"].as<std::string>();
+  std::string hydroDataCsvFile;
+  if (!batchMode) {
+    hydroDataCsvFile = userInput["gauge"].as<std::string>();
+  }
 
-  if (!userInput.count("threshold")) {
+  const bool serveMode = userInput.count("serve");
+  const bool updateMode = userInput.count("update");
+  if (batchMode && updateMode) {
+    std::cout << "--update works on a single area of interest. Program will quit\n";
+    return 0;
+  }
+  const bool resume = userInput.count("resume");
+  if (resume && updateMode) {
+    std::cout << "--resume continues a calibration, --update does not calibrate. Program will quit\n";
+    return 0;
+  }
+  // an interrupted run left its checkpoints in the cache
+  const bool cacheOnly = userInput.count("cache-only") || resume;
+  if (!userInput.count("threshold") && !serveMode && !updateMode) {
     std::cout
       << "Search space not provided, use -n option.\n"<< options.help() << "\nProgram will quit\n";
     return 0;
   }
-  auto thresholdSequence =
-    userInput["threshold"].as<std::vector<std::string>>();
+  std::vector<std::string> thresholdSequence;
+  if (userInput.count("threshold")) {
+    thresholdSequence = userInput["threshold"].as<std::vector<std::string>>();
+  }
 
-  if (!userInput.count("epsg")) {
+  if (!batchMode && !userInput.count("epsg")) {
     std::cout << "EPSG not provided, use -p option.\n"<< options.help() << "\nProgram will quit\n";
     return 0;
   }
   
   auto epsgCode = userInput["epsg"].as<std::string>();
   auto algo = userInput["algorithm"].as<std::string>();
-  auto strategy = userInput["strategy"].as<std::string>();
-  auto maxiter = std::stoi(userInput["maxiter"].as<std::string>());
-  auto fraction = std::stod(userInput["fraction"].as<std::string>());
-  if (fraction < 0 | fraction > 1.0) {
-      std::cout <<"Fraction of pixels is not in (0.0, 1.0>: "<< fraction << " Program will quit\n";
+
+  AnalysisConfig analysisConfig;
+  analysisConfig.hydroDataCsvFile = hydroDataCsvFile;
+  analysisConfig.thresholdSequence = thresholdSequence;
+  analysisConfig.strategy = userInput["strategy"].as<std::string>();
+  analysisConfig.maxiter = std::stoi(userInput["maxiter"].as<std::string>());
+  analysisConfig.fraction = std::stod(userInput["fraction"].as<std::string>());
+  if (analysisConfig.fraction < 0 | analysisConfig.fraction > 1.0) {
+      std::cout <<"Fraction of pixels is not in (0.0, 1.0>: "<< analysisConfig.fraction << " Program will quit\n";
       return 0;
   }
-  
-  //in case of pixel value = 0 durinf lin to dB conversion
-  const double minValueDbl = -40.0;
 
   // we defaults to 1D version.
-  bool isSinglePolVersion = true;
-  if (algo == "2D") {
-    isSinglePolVersion = false;
+  analysisConfig.isSinglePolVersion = algo != "2D";
+  analysisConfig.maxValue = userInput["maxValue"].as<std::vector<std::string>>();
+  analysisConfig.convToDB = userInput.count("conv-to-dB");
+  analysisConfig.skipClustering = userInput.count("skip-clustering");
+
+  analysisConfig.kPatience = std::stoi(userInput["k-patience"].as<std::string>());
+  analysisConfig.kMargin = std::stod(userInput["k-margin"].as<std::string>());
+  analysisConfig.coarseFactor = std::stoi(userInput["coarse"].as<std::string>());
+  analysisConfig.coarseCandidates =
+    std::max(1, std::stoi(userInput["coarse-candidates"].as<std::string>()));
+  analysisConfig.thresholdSearch = userInput["search"].as<std::string>();
+  if (analysisConfig.thresholdSearch != "grid" &&
+      analysisConfig.thresholdSearch != "refine") {
+    std::cout << "Unknown threshold search: " << analysisConfig.thresholdSearch
+              << ", use grid or refine. Program will quit\n";
+    return 0;
+  }
+  analysisConfig.tileMemory =
+    std::stoull(userInput["tile-memory"].as<std::string>()) * 1024 * 1024;
+  analysisConfig.seed = std::stoul(userInput["seed"].as<std::string>());
+  analysisConfig.memoryBudget =
+    std::stoull(userInput["memory-budget"].as<std::string>()) * 1024 * 1024;
+  if (analysisConfig.memoryBudget > 0 &&
+      GDALGetCacheMax64() > static_cast<GIntBig>(analysisConfig.memoryBudget / 4)) {
+    // the GDAL block cache is part of the budget
+    GDALSetCacheMax64(analysisConfig.memoryBudget / 4);
   }
-  
-  auto maxValue = userInput["maxValue"].as<std::vector<std::string>>();
 
-  bool convToDB = false;
-  if (userInput.count("conv-to-dB")) convToDB = true;
+  speckleFilter().type = userInput["speckle"].as<std::string>();
+  speckleFilter().window = std::stoi(userInput["speckle-window"].as<std::string>());
+  if (!isSpeckleFilterType(speckleFilter().type)) {
+    std::cout << "Unknown speckle filter: " << speckleFilter().type
+              << ", use none, boxcar, lee or refined-lee. Program will quit\n";
+    return 0;
+  }
+  if (speckleFilter().window < 3 || speckleFilter().window % 2 == 0) {
+    std::cout << "Speckle filter window must be odd and at least 3. Program will quit\n";
+    return 0;
+  }
 
-  bool cacheOnly = false;
-  if (userInput.count("cache-only")) {
-    createCacheDirectoryIfNotExists();
+  analysisConfig.resume = resume;
+  analysisConfig.emitMaps = userInput.count("emit-maps");
+  analysisConfig.mapOptions.compression = userInput["compress"].as<std::string>();
+  analysisConfig.mapOptions.overviewResampling = userInput["resampling"].as<std::string>();
+  analysisConfig.mapOptions.cog = !userInput.count("no-cog");
+  analysisConfig.mapOptions.aggregates = !userInput.count("no-aggregates");
+
+  if (cacheOnly) {
+    if (!batchMode) {
+      createCacheDirectoryIfNotExists();
+    }
     std::cout << "Using images from floodsar-cache" << '\n';
-    cacheOnly = true;
     // Choosing this path, we ASSUME .floodsar-cache/cropped folder is healthy
     // and contains images...
+  } else if (updateMode) {
+    std::cout << "Adding new images to the cache" << '\n';
+    createCacheDirectoryIfNotExists();
   } else {
     std::cout << "Creating new cache directory" << '\n';
     if(fs::exists(".floodsar-cache")) fs::remove_all(".floodsar-cache");
     createCacheDirectoryIfNotExists();
+  }
 
+  if (!cacheOnly) {
     auto dirname = userInput["directory"].as<std::string>();
     auto rasterExtension = userInput["extension"].as<std::string>();
 
-    if (!userInput.count("aoi")) {
+    if (!batchMode && !userInput.count("aoi")) {
       std::cout
         << "Area of interest not provided, use -o option. Program will quit\n";
       return 0;
     }
-    auto areaFilePath = userInput["aoi"].as<std::string>();
 
-    RasterInfoExtractor* extractor;
+    std::unique_ptr<RasterInfoExtractor> extractor;
 
     if (userInput.count("stdParser")) {
-        StdExtractor e;
-        extractor = &e;
+        extractor = std::make_unique<StdExtractor>();
         std::cout << "Using standard names parser - expecting YYYYMMDD_POL.ext\n";
     }
     else {
-        AsfExtractor e;
-        extractor = &e;
+        extractor = std::make_unique<AsfExtractor>();
         std::cout << "Using ASF HyP3 names parser.\n";
     }
-  
-    
 
-    std::vector<RasterInfo> rasterPathsBeforeMosaicking =
-      readRasterDirectory(dirname, rasterExtension, extractor);
+    std::vector<RasterInfo> rasterPathsBeforeMosaicking;
+    if (userInput.count("catalog")) {
+      // archive was already inventoried (analyze_dir), no need to scan it
+      auto catalogPath = userInput["catalog"].as<std::string>();
+      std::vector<CatalogEntry> catalog;
+      if (readCatalog(catalogPath, catalog)) {
+        std::cout << "Using catalog " << catalogPath << "\n";
+      } else {
+        std::cout << "Catalog " << catalogPath << " not found, creating it\n";
+        catalog = scanArchive(dirname, rasterExtension, extractor.get());
+        writeCatalog(catalogPath, catalog);
+      }
+      rasterPathsBeforeMosaicking = catalogToRasterInfos(catalog);
+    } else {
+      rasterPathsBeforeMosaicking =
+        readRasterDirectory(dirname, rasterExtension, extractor.get());
+    }
+    if (updateMode) {
+      // dates already in the cache are neither warped nor cropped again
+      const auto knownDates = loadOrBuildSceneManifest().dates();
+      const std::set<Date> known(knownDates.begin(), knownDates.end());
+      rasterPathsBeforeMosaicking.erase(
+        std::remove_if(rasterPathsBeforeMosaicking.begin(),
+                       rasterPathsBeforeMosaicking.end(),
+                       [&](const RasterInfo& r) { return known.count(r.date) > 0; }),
+        rasterPathsBeforeMosaicking.end());
+      if (rasterPathsBeforeMosaicking.empty()) {
+        std::cout << "No new images, the cache is up to date\n";
+        return 0;
+      }
+    }
     std::vector<RasterInfo> rasterPathsAfterMosaicking;
     std::for_each(rasterPathsBeforeMosaicking.begin(), rasterPathsBeforeMosaicking.end(), [](RasterInfo& r) {
         if (polToString(r.pol) == "ERROR") {
@@ -183,6 +361,14 @@ main(int argc, char** argv)
     std::cout << "floodsar: found " << rasterPathsBeforeMosaicking.size()
               << " rasters. Now finding dups & mosaicking \n";
 
+    if (batchMode) {
+      // one scan, one warp and mosaic per EPSG, shared by all areas
+      preprocessBatch(
+        batchJobs, rasterPathsBeforeMosaicking, userInput.count("mask-aoi"));
+      return runBatchAnalyses(batchJobs, analysisConfig);
+    }
+
+    auto areaFilePath = userInput["aoi"].as<std::string>();
     reprojectIfNeeded(rasterPathsBeforeMosaicking, epsgCode);
     performMosaicking(rasterPathsBeforeMosaicking, rasterPathsAfterMosaicking);
 
@@ -190,270 +376,39 @@ main(int argc, char** argv)
               << rasterPathsAfterMosaicking.size()
               << " rasters. Cropping... \n";
 
-    auto areaOfInterestDataset =
-      static_cast<GDALDataset*>(GDALOpen(areaFilePath.c_str(), GA_ReadOnly));
     std::cout << areaFilePath + "\n";
     std::cout << rasterPathsAfterMosaicking[0].absolutePath + "\n";
 
-    cropRastersToAreaOfInterest(
-      rasterPathsAfterMosaicking, areaOfInterestDataset, epsgCode);
-  }
-
-  HydroDataReader hydroReader;
-  std::map<Date, double> obsElevationsMap;
-  std::cout << hydroDataCsvFile + "\n";
-  hydroReader.readFile(obsElevationsMap, hydroDataCsvFile);
-  printMap(obsElevationsMap);
-  std::cout << "map ok\n";
-
-  std::ofstream datesFile;
-
-  if (isSinglePolVersion) {
-    std::cout << "Floodsar algorithm: single-pol (old)\n";
-    std::vector<double> thresholdSequenceDbl(thresholdSequence.size());
-    std::transform(thresholdSequence.begin(),
-                   thresholdSequence.end(),
-                   thresholdSequenceDbl.begin(),
-                   [](const std::string& val) { return std::stod(val); });
-    std::cout << "threshold from, to, step:\n";
-    std::cout << std::to_string(thresholdSequenceDbl[0]) + ", ";
-    std::cout << std::to_string(thresholdSequenceDbl[1]) + ", ";
-    std::cout << std::to_string(thresholdSequenceDbl[2]);
-    std::cout << "\n";
-
-    std::vector<std::string> polarizations{ "VH", "VV" };
-    datesFile.open(".floodsar-cache/dates.txt");
-    for (auto& polarization : polarizations) {
-      std::vector<double> elevations; // i.e. water levels or discharges
-      std::vector<std::string> croppedRasterPaths;
-
-      for (const auto& [day, elevation] : obsElevationsMap) {
-        // interesting for us are only dates when we have appropriate picture...
-        // so let's use only these...
-        // since we check filesystem... it's potential perf. bottleneck...
-        const std::string rpath =
-          "./.floodsar-cache/cropped/resampled__" + polarization + "_" + day;
-        if (fs::exists(rpath)) {
-          elevations.push_back(elevation);
-          croppedRasterPaths.push_back(rpath);
-          datesFile << day + "\n";
-        }
-      }
-      datesFile.close();
-      std::vector<double> correlations;
-      std::vector<double> thresholds = createSequence(thresholdSequenceDbl[0],
-                                                      thresholdSequenceDbl[1],
-                                                      thresholdSequenceDbl[2]);
-
-      for (double threshold : thresholds) {
-        std::vector<unsigned int> floodedAreaValues;
-
-        for (auto datasetPath : croppedRasterPaths) {
-          auto dataset = static_cast<GDALDataset*>(
-            GDALOpen(datasetPath.c_str(), GA_ReadOnly));
-          // std::cout << datasetPath + "\n";
-          const unsigned int area = calcFloodedArea(dataset, threshold);
-          // std::cout << "area for " << datasetPath << "->" << area << '\n';
-          floodedAreaValues.push_back(area);
-          GDALClose(dataset);
-        }
-
-        const double corrCoeff =
-          calcCorrelationCoeff(floodedAreaValues, elevations);
-
-        correlations.push_back(corrCoeff);
-      }
-
-      double bestCorrelation = 0.0;
-      unsigned int bestThrIndex = 0;
-
-      for (int i = 0; i < correlations.size(); i++) {
-        // std::cout << "THR: " << thresholds.at(i)
-                  // << " / COEFF: " << correlations.at(i) << '\n';
-
-        if (bestCorrelation < correlations.at(i)) {
-          bestCorrelation = correlations.at(i);
-          bestThrIndex = i;
-        }
-      }
-
-      std::cout << "---------------- RESULTS FOR ---------------- "
-                << polarization << " POLARIZATION ---------------" << '\n';
-      std::cout << "best threshold: " << thresholds.at(bestThrIndex)
-                << " with correlation coefficient of "
-                << correlations.at(bestThrIndex) << '\n';
-
-      std::cout << "also prepare file for mapping procedure...\n";
-
-      std::ofstream outputFileForMapper;
-      outputFileForMapper.open(".floodsar-cache/1d_output/" + polarization,
-                               std::ofstream::out);
-
-      for (auto datasetPath : croppedRasterPaths) {
-        auto dataset =
-          static_cast<GDALDataset*>(GDALOpen(datasetPath.c_str(), GA_ReadOnly));
-        writeThresholdingResultsToFile(
-          dataset, thresholds.at(bestThrIndex), outputFileForMapper);
-      }
-
-      outputFileForMapper.close();
-    }
-
-  } else {
-    std::cout << "Floodsar algorithm: dual-pol (new/improved)\n";
-    std::vector<int> thresholdSequenceInt(thresholdSequence.size());
-    std::transform(thresholdSequence.begin(),
-                   thresholdSequence.end(),
-                   thresholdSequenceInt.begin(),
-                   [](const std::string& val) { return std::stoi(val); });
-    std::cout << "classes from, to:\n";
-    std::cout << std::to_string(thresholdSequenceInt[0]) + ", ";
-    std::cout << std::to_string(thresholdSequenceInt[1]);
-    std::cout << "\n";
-
-    std::vector<int> numClassesToTry;
-    for (int j = thresholdSequenceInt[0]; j <= thresholdSequenceInt[1]; j++) {
-		if(j==1) continue;
-		numClassesToTry.push_back(j);
-		}
-	if(numClassesToTry.size() == 0)
-	{
-		std::cout << "to few classes for k-means, increase the -n parameter range\nProgram will quit\n";
-		return 0;
-	}
-    std::ofstream ofs;
-    ofs.open("./.floodsar-cache/kmeans_inputs/" + kmeansInputFilename,
-             std::ofstream::out);
-    int rowsPerDate = 0; // for starters
-
-    std::cout << "Will create input file for K-Means\n";
-
-    std::vector<double> elevations; // these are water levels or discharges
-    std::vector<std::string> croppedRasterPaths;
-    datesFile.open(".floodsar-cache/dates.txt");
-
-    // new kmeans impl
-    std::vector<double> vhAllPixelValues;
-    std::vector<double> vvAllPixelValues;
-    for (const auto& [day, elevation] : obsElevationsMap) {
-      // interesting for us are only dates when we have appropriate picture...
-      // so let's use only these...
-      // since we check filesystem... it's potential perf. bottleneck...
-      const std::string vhPath =
-        "./.floodsar-cache/cropped/resampled__VH_" + day;
-      const std::string vvPath =
-        "./.floodsar-cache/cropped/resampled__VV_" + day;
-
-      if (fs::exists(vhPath) && fs::exists(vvPath)) {
-        elevations.push_back(elevation);
-        std::cout << "Elevation for " << day << " = " << elevation << '\n';
-        // croppedRasterPathsFor2DCase.push_back({ vhPath, vvPath });
-        datesFile << day + "\n";
-
-        auto vhDataset =
-          static_cast<GDALDataset*>(GDALOpen(vhPath.c_str(), GA_ReadOnly));
-        auto vvDataset =
-          static_cast<GDALDataset*>(GDALOpen(vvPath.c_str(), GA_ReadOnly));
-
-        std::vector<double> vhPixelValues;
-        std::vector<double> vvPixelValues;
-
-        getPixelValuesFromRaster(vhDataset, vhPixelValues);
-        getPixelValuesFromRaster(vvDataset, vvPixelValues);
-
-        if (rowsPerDate != vhPixelValues.size()) {
-          std::cout << "WARNING: Suspicious pixelValues size: " << rowsPerDate
-                    << "/" << vhPixelValues.size() << '\n';
-          rowsPerDate = vhPixelValues.size();
-        }
-
-        for (int i = 0; i < vhPixelValues.size(); i++) {
-          ofs << vhPixelValues.at(i) << " " << vvPixelValues.at(i) << "\n";
-          vhAllPixelValues.push_back(vhPixelValues.at(i));
-          vvAllPixelValues.push_back(vvPixelValues.at(i));
-        }
-      }
-    }
-
-    datesFile.close();
-    ofs.close();
-	
-	if(maxValue[0] != "none") {
-		std::vector<double> maxValueDbl(maxValue.size());
-		std::transform(maxValue.begin(),
-					   maxValue.end(),
-					   maxValueDbl.begin(),
-					   [](const std::string& val) { return std::stod(val); });
-		std::cout << "clipping max values to VV, VH:\n";
-		std::cout << std::to_string(maxValueDbl[0]) + ", ";
-		std::cout << std::to_string(maxValueDbl[1]) + ", ";
-		std::cout << "\n";
-		
-		for (int i=0; i<vvAllPixelValues.size(); i++) if(vvAllPixelValues[i] > maxValueDbl[0]) vvAllPixelValues[i]=maxValueDbl[0];
-		for (int i=0; i<vhAllPixelValues.size(); i++) if(vhAllPixelValues[i] > maxValueDbl[1]) vhAllPixelValues[i]=maxValueDbl[1];
-	} else {
-		std::cout << "No clipping VV and VH values.\n";
-	}
-    if (convToDB) {
-        std::cout << "Converting linear power to dB.\n";
-        for (int i = 0; i < vvAllPixelValues.size(); i++) if (vvAllPixelValues[i] > 0) { vvAllPixelValues[i] = 10.0 * log10(vvAllPixelValues[i]); } else { vvAllPixelValues[i] = minValueDbl; }
-        for (int i = 0; i < vhAllPixelValues.size(); i++) if (vhAllPixelValues[i] > 0) { vhAllPixelValues[i] = 10.0 * log10(vhAllPixelValues[i]); } else { vhAllPixelValues[i] = minValueDbl; }
+    BoundingBox zone;
+    if (!getAoiBoundingBox(areaFilePath,
+                           epsgCode,
+                           rasterPathsAfterMosaicking[0].absolutePath,
+                           zone)) {
+      std::cout << "Program will quit\n";
+      return 0;
     }
+    cropRastersToAreasOfInterest(
+      rasterPathsAfterMosaicking, { { zone, ".floodsar-cache/cropped" } }, epsgCode);
 
+    const auto sceneManifest = buildSceneManifest(".floodsar-cache/cropped");
+    writeSceneManifest(sceneManifestPath(), sceneManifest);
 
-
-    std::cout << "Input ready. Have " << elevations.size()
-              << " pairs of images matched with gauge data\n";
-
-    if (!userInput.count("skip-clustering")) {
-      for (int i : numClassesToTry) {
-		  performClustering(vhAllPixelValues, vvAllPixelValues, i, maxiter, fraction);
-		  }
+    // rasterized once onto the crop grid, used by the analysis and mapper
+    if ((isVectorAoi(areaFilePath) || userInput.count("mask-aoi")) &&
+        !sceneManifest.entries.empty() && !updateMode) {
+      createAoiMask(areaFilePath, sceneManifest.entries[0].cacheKey);
     }
-
-    int indexForLogs = 0;
-
-    double bestCoeff = 0;
-    unsigned int bestMaxClasses;
-    unsigned int bestFloodClasses;
-
-    for (int cl : numClassesToTry) {
-
-      unsigned int floodClassesNum = cl-1;
-      while (floodClassesNum) {
-        std::vector<unsigned int> floodedAreaValues;
-        calculateFloodedAreasFromKMeansOutput(
-          floodedAreaValues, cl, floodClassesNum, rowsPerDate, strategy);
-        const double corrCoeff =
-          calcCorrelationCoeff(floodedAreaValues, elevations);
-
-        std::cout << "Calculated correlation [" << indexForLogs
-                  << "] allClasses: " << cl
-                  << " floodClasses: " << floodClassesNum
-                  << " - correlationCoeff is " << corrCoeff << "\n";
-
-        if (corrCoeff > bestCoeff) {
-          bestCoeff = corrCoeff;
-          bestMaxClasses = cl;
-          bestFloodClasses = floodClassesNum;
-        }
-
-        floodClassesNum--;
-        indexForLogs++;
-      }
-    }
-
-    const std::string bestClassPath =".floodsar-cache/kmeans_outputs/best.txt";
-    std::ofstream ofsBestClass;
-    ofsBestClass.open(bestClassPath, std::ofstream::out);
-    ofsBestClass <<  bestMaxClasses << " " << bestFloodClasses << "\n";
-    ofsBestClass.close();
-
-    std::cout << "RESULTS: Best config is: coeff/all classes/flood classes "
-              << bestCoeff << " / " << bestMaxClasses << " / "
-              << bestFloodClasses << "\n";
   }
 
-  LOG("test logging %s %d", "carrot", 5);
-  return 0;
+  if (batchMode) {
+    return runBatchAnalyses(batchJobs, analysisConfig);
+  }
+  if (updateMode) {
+    return runUpdate(analysisConfig,
+                     std::stod(userInput["drift-sigma"].as<std::string>()));
+  }
+  if (serveMode) {
+    return runServer(userInput["serve"].as<std::string>(), analysisConfig);
+  }
+  return runAnalysis(analysisConfig);
 }
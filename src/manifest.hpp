@@ -0,0 +1,349 @@
+#pragma once
+
+#include "gdal/gdal_priv.h"
+#include "maps.hpp"
+#include "polarization.hpp"
+#include "types.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+/*
+*
+* Scene manifest: compact binary index of the cropped scenes in the cache.
+* Written once by preprocessing, read by the analysis stage and the mapper
+* instead of probing the file system for every date.
+*
+*/
+
+const char sceneManifestMagic[8] = { 'F', 'S', 'S', 'C', 'E', 'N', 'E', '1' };
+inline std::string
+sceneManifestPath()
+{
+  return workPath(".floodsar-cache/scenes.manifest");
+}
+
+class SceneEntry
+{
+public:
+  Date date;
+  Polarization pol = Polarization::e;
+  int xSize = 0;
+  int ySize = 0;
+  double geoTransform[6] = { 0.0, 1.0, 0.0, 0.0, 0.0, 1.0 };
+  // path of the cropped raster in the cache
+  std::string cacheKey;
+};
+
+class SceneManifest
+{
+public:
+  // all cropped scenes share the projection
+  std::string projection;
+  // sorted by date, then polarization
+  std::vector<SceneEntry> entries;
+
+  // grid of the maps, taken from the first scene
+  GridInfo grid() const
+  {
+    GridInfo grid;
+    if (!entries.empty()) {
+      grid.xSize = entries[0].xSize;
+      grid.ySize = entries[0].ySize;
+      std::copy(
+        entries[0].geoTransform, entries[0].geoTransform + 6, grid.geoTransform);
+    }
+    grid.projection = projection;
+    return grid;
+  }
+
+  std::vector<Date> dates() const
+  {
+    std::vector<Date> out;
+    for (const auto& entry : entries) {
+      out.push_back(entry.date);
+    }
+    return out;
+  }
+};
+
+// manifest of the scenes matched with gauge data, in the order of labels
+inline std::string
+matchedScenesPath(const std::string& polarization = "")
+{
+  if (polarization.empty()) {
+    return workPath(".floodsar-cache/dates.manifest");
+  }
+  return workPath(".floodsar-cache/dates_" + polarization + ".manifest");
+}
+
+inline void
+sortSceneEntries(std::vector<SceneEntry>& entries)
+{
+  std::sort(entries.begin(),
+            entries.end(),
+            [](const SceneEntry& a, const SceneEntry& b) {
+              if (a.date != b.date) {
+                return a.date < b.date;
+              }
+              return a.pol < b.pol;
+            });
+}
+
+namespace manifest_io {
+template<typename T>
+void
+writeValue(std::ofstream& ofs, const T& value)
+{
+  ofs.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+inline void
+writeString(std::ofstream& ofs, const std::string& value)
+{
+  writeValue<uint32_t>(ofs, value.size());
+  ofs.write(value.data(), value.size());
+}
+
+template<typename T>
+bool
+readValue(std::ifstream& ifs, T& value)
+{
+  return static_cast<bool>(
+    ifs.read(reinterpret_cast<char*>(&value), sizeof(T)));
+}
+
+inline bool
+readString(std::ifstream& ifs, std::string& value)
+{
+  uint32_t size = 0;
+  if (!readValue(ifs, size)) {
+    return false;
+  }
+  value.resize(size);
+  return static_cast<bool>(ifs.read(&value[0], size));
+}
+}
+
+inline bool
+writeSceneManifest(const std::string& path, const SceneManifest& manifest)
+{
+  std::ofstream ofs(path, std::ios::binary);
+  if (!ofs) {
+    std::cout << "[writeSceneManifest] Could not open " << path << "\n";
+    return false;
+  }
+  ofs.write(sceneManifestMagic, sizeof(sceneManifestMagic));
+  manifest_io::writeValue<uint32_t>(ofs, manifest.entries.size());
+  manifest_io::writeString(ofs, manifest.projection);
+  for (const auto& entry : manifest.entries) {
+    manifest_io::writeString(ofs, entry.date);
+    manifest_io::writeValue<uint8_t>(ofs, static_cast<uint8_t>(entry.pol));
+    manifest_io::writeValue<int32_t>(ofs, entry.xSize);
+    manifest_io::writeValue<int32_t>(ofs, entry.ySize);
+    for (double value : entry.geoTransform) {
+      manifest_io::writeValue(ofs, value);
+    }
+    manifest_io::writeString(ofs, entry.cacheKey);
+  }
+  return static_cast<bool>(ofs);
+}
+
+inline bool
+readSceneManifest(const std::string& path, SceneManifest& manifest)
+{
+  std::ifstream ifs(path, std::ios::binary);
+  char magic[sizeof(sceneManifestMagic)];
+  if (!ifs.read(magic, sizeof(magic)) ||
+      std::memcmp(magic, sceneManifestMagic, sizeof(magic)) != 0) {
+    return false;
+  }
+  uint32_t count = 0;
+  if (!manifest_io::readValue(ifs, count) ||
+      !manifest_io::readString(ifs, manifest.projection)) {
+    return false;
+  }
+  manifest.entries.resize(count);
+  for (auto& entry : manifest.entries) {
+    uint8_t pol = 0;
+    int32_t xSize = 0, ySize = 0;
+    bool ok = manifest_io::readString(ifs, entry.date) &&
+              manifest_io::readValue(ifs, pol) &&
+              manifest_io::readValue(ifs, xSize) &&
+              manifest_io::readValue(ifs, ySize);
+    for (double& value : entry.geoTransform) {
+      ok = ok && manifest_io::readValue(ifs, value);
+    }
+    ok = ok && manifest_io::readString(ifs, entry.cacheKey);
+    if (!ok) {
+      std::cout << "[readSceneManifest] Truncated manifest " << path << "\n";
+      manifest.entries.clear();
+      return false;
+    }
+    entry.pol = static_cast<Polarization>(pol);
+    entry.xSize = xSize;
+    entry.ySize = ySize;
+  }
+  return true;
+}
+
+/*
+* Indexes cropped rasters (resampled__<POL>_<DATE>) of a cache directory.
+* Rasters are opened in parallel, only their headers are read.
+*/
+inline SceneManifest
+buildSceneManifest(const std::string& croppedDir)
+{
+  const std::string prefix = "resampled__";
+  std::vector<SceneEntry> entries;
+  for (auto& p : fs::directory_iterator(croppedDir)) {
+    const auto name = p.path().filename().string();
+    // resampled__VV_20190221
+    if (name.rfind(prefix, 0) != 0 || name.size() < prefix.size() + 4 ||
+        p.path().has_extension()) {
+      continue;
+    }
+    SceneEntry entry;
+    entry.pol = stringToPol(name.substr(prefix.size(), 2));
+    entry.date = name.substr(prefix.size() + 3);
+    entry.cacheKey = p.path().string();
+    if (entry.pol != Polarization::e) {
+      entries.push_back(entry);
+    }
+  }
+
+  std::vector<std::string> projections(entries.size());
+  parallelFor(entries.size(), [&](size_t i) {
+    auto& entry = entries[i];
+    auto dataset = static_cast<GDALDataset*>(
+      GDALOpen(entry.cacheKey.c_str(), GA_ReadOnly));
+    if (dataset == nullptr) {
+      std::cout << "[buildSceneManifest] Could not open " << entry.cacheKey
+                << "\n";
+      entry.pol = Polarization::e;
+      return;
+    }
+    entry.xSize = dataset->GetRasterXSize();
+    entry.ySize = dataset->GetRasterYSize();
+    dataset->GetGeoTransform(entry.geoTransform);
+    projections[i] = dataset->GetProjectionRef();
+    GDALClose(dataset);
+  });
+
+  SceneManifest manifest;
+  for (size_t i = 0; i < entries.size(); i++) {
+    if (entries[i].pol == Polarization::e) {
+      continue;
+    }
+    if (manifest.projection.empty()) {
+      manifest.projection = projections[i];
+    }
+    manifest.entries.push_back(entries[i]);
+  }
+  sortSceneEntries(manifest.entries);
+  return manifest;
+}
+
+/*
+* Loads the manifest of the cache, building it first if it is missing (e.g.
+* when cropped images were put into the cache by hand).
+*/
+inline SceneManifest
+loadOrBuildSceneManifest()
+{
+  SceneManifest manifest;
+  if (readSceneManifest(sceneManifestPath(), manifest)) {
+    return manifest;
+  }
+  std::cout << "Indexing cropped images in .floodsar-cache/cropped\n";
+  manifest = buildSceneManifest(workPath(".floodsar-cache/cropped"));
+  writeSceneManifest(sceneManifestPath(), manifest);
+  return manifest;
+}
+
+/*
+* A gauge observation together with scenes of the same day, one per
+* requested polarization.
+*/
+class MatchedScene
+{
+public:
+  Date date;
+  double elevation;
+  std::vector<const SceneEntry*> scenes;
+};
+
+/*
+* Joins scenes with gauge observations by date. Both sides are sorted by
+* date, so this is a single merge pass. Only days with a scene in every
+* requested polarization are returned.
+*/
+inline std::vector<MatchedScene>
+matchScenesWithGauge(const SceneManifest& manifest,
+                     const std::map<Date, double>& observations,
+                     const std::vector<Polarization>& polarizations)
+{
+  std::vector<MatchedScene> matched;
+  auto entry = manifest.entries.begin();
+  auto observation = observations.begin();
+
+  while (entry != manifest.entries.end() &&
+         observation != observations.end()) {
+    if (entry->date < observation->first) {
+      entry++;
+    } else if (observation->first < entry->date) {
+      observation++;
+    } else {
+      MatchedScene match{ observation->first, observation->second, {} };
+      for (auto pol : polarizations) {
+        const SceneEntry* found = nullptr;
+        for (auto it = entry;
+             it != manifest.entries.end() && it->date == match.date;
+             it++) {
+          if (it->pol == pol) {
+            found = &*it;
+          }
+        }
+        if (found == nullptr) {
+          break;
+        }
+        match.scenes.push_back(found);
+      }
+      if (match.scenes.size() == polarizations.size()) {
+        matched.push_back(match);
+      }
+      while (entry != manifest.entries.end() && entry->date == match.date) {
+        entry++;
+      }
+      observation++;
+    }
+  }
+  return matched;
+}
+
+/*
+* Writes the matched scenes of one polarization (index in the match) as a
+* manifest, in the order labels are stored.
+*/
+inline void
+writeMatchedScenes(const std::string& path,
+                   const SceneManifest& manifest,
+                   const std::vector<MatchedScene>& matched,
+                   size_t polarizationIndex)
+{
+  SceneManifest out;
+  out.projection = manifest.projection;
+  for (const auto& match : matched) {
+    out.entries.push_back(*match.scenes[polarizationIndex]);
+  }
+  writeSceneManifest(path, out);
+}
@@ -3,7 +3,13 @@
 #include "gdal/cpl_conv.h" // for CPLMalloc()
 #include "gdal/gdal_priv.h"
 #include "gdal/ogrsf_frmts.h"
+#include "bitmasks.hpp"
+#include "clustering.hpp"
+#include "labels.hpp"
+#include "manifest.hpp"
+#include "maps.hpp"
 #include "rasters.hpp"
+#include "trace.hpp"
 #include "utils.hpp"
 #include <algorithm>
 #include <cmath>
@@ -11,6 +17,7 @@
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <sstream>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -24,6 +31,84 @@ namespace fs = std::filesystem;
 * This is a postprocessing script for transforming floodSar results to rasters. 
 *
 */
+
+/*
+* Answers --areas, --union and --intersection from the flood mask cube.
+* @param range is "FROM,TO", dates as YYYYMMDD, both included
+*/
+int
+queryFloodMaskCube(const std::string& maskCubePath,
+                   const std::string& mapDirectory,
+                   const GridInfo& grid,
+                   const AoiMask& aoiMask,
+                   const MapOptions& mapOptions,
+                   bool areas,
+                   const std::string& unionRange,
+                   const std::string& intersectionRange)
+{
+  if (maskCubePath.empty() || !fs::exists(maskCubePath)) {
+    std::cout << "No flood mask cube of this configuration (run the analysis "
+                 "first, for 2D use the best k and flood classes). Program will quit\n";
+    return 1;
+  }
+  const FloodMaskCube cube(maskCubePath);
+  if (!cube.isValid() || cube.xSize() != grid.xSize || cube.ySize() != grid.ySize) {
+    std::cout << "Flood mask cube " << maskCubePath
+              << " does not match the grid. Program will quit\n";
+    return 1;
+  }
+
+  if (areas) {
+    const auto floodedAreas = cube.floodedAreas();
+    std::cout << "date,flooded_pixels\n";
+    for (size_t d = 0; d < cube.numDates(); d++) {
+      std::cout << cube.dates()[d] << "," << floodedAreas[d] << "\n";
+    }
+  }
+
+  auto writeRange = [&](const std::string& range, bool isUnion) {
+    const auto comma = range.find(',');
+    if (comma == std::string::npos) {
+      std::cout << "Date range " << range << " is not FROM,TO\n";
+      return false;
+    }
+    const Date from = range.substr(0, comma);
+    const Date to = range.substr(comma + 1);
+    const size_t first = cube.findDate(from);
+    const size_t end =
+      std::upper_bound(cube.dates().begin(), cube.dates().end(), to) -
+      cube.dates().begin();
+    if (first >= end) {
+      std::cout << "No dates between " << from << " and " << to << "\n";
+      return false;
+    }
+    const auto words =
+      isUnion ? cube.unionOf(first, end - 1) : cube.intersectionOf(first, end - 1);
+    std::vector<unsigned char> mask(static_cast<size_t>(grid.xSize) * grid.ySize);
+    unpackFloodMask(words.data(), grid, aoiMask, mask.data());
+    fs::create_directories(mapDirectory);
+    const std::string mapPath = mapDirectory + (isUnion ? "union_" : "intersection_") +
+                                from + "_" + to + ".tif";
+    std::cout << (isUnion ? "union " : "intersection ") << cube.dates()[first]
+              << ".." << cube.dates()[end - 1] << " (" << end - first
+              << " dates): " << countBits(words.data(), words.size())
+              << " flooded pixels\n";
+    if (!writeFloodMap(mapPath, grid, mask.data(), mapOptions)) {
+      return false;
+    }
+    std::cout << "saved: " + mapPath + '\n';
+    return true;
+  };
+  bool written = true;
+  if (!unionRange.empty()) {
+    written = writeRange(unionRange, true) && written;
+  }
+  if (!intersectionRange.empty()) {
+    written = writeRange(intersectionRange, false) && written;
+  }
+  return written ? 0 : 1;
+}
+
 int
 main(int argc, char** argv)
 {
@@ -37,34 +122,53 @@ main(int argc, char** argv)
     "use base algo, provide polarization",
     cxxopts::value<std::string>())(
     "a,auto",
-    "automatically use best k-means results");
+    "automatically use best k-means results")(
+    "z,compress",
+    "Compression of output maps, e.g. DEFLATE, ZSTD, LZW or NONE.",
+    cxxopts::value<std::string>()->default_value("DEFLATE"))(
+    "r,resampling",
+    "Resampling of map overviews: MODE or AVERAGE.",
+    cxxopts::value<std::string>()->default_value("MODE"))(
+    "no-cog",
+    "Write plain tiled GeoTIFF maps, without overviews.")(
+    "no-aggregates",
+    "Do not write flood frequency and first/last flooded date rasters.")(
+    "update",
+    "Write only maps of dates that have none in the map directory yet (dates added by floodsar --update); aggregates are rewritten.")(
+    "areas",
+    "Print the flooded area (pixels) of every date from the flood mask cube instead of writing maps.")(
+    "union",
+    "Write pixels flooded on any date of FROM,TO (YYYYMMDD,YYYYMMDD) from the flood mask cube instead of writing maps.",
+    cxxopts::value<std::string>()->default_value(""))(
+    "intersection",
+    "Write pixels flooded on every date of FROM,TO (YYYYMMDD,YYYYMMDD) from the flood mask cube instead of writing maps.",
+    cxxopts::value<std::string>()->default_value(""))(
+    "trace",
+    "Record a timeline of map writes of all threads to this file, in Chrome trace format (chrome://tracing, ui.perfetto.dev).",
+    cxxopts::value<std::string>()->default_value(""));
 
 //default values for 1D algorithm
   int numAllClassess = 2;
   int numFloodClasses = 1;
-  int aa;
 
-  std::vector<int> floodClasses;
+  std::vector<unsigned int> floodClasses;
   std::string pointsFile;
   std::string mapDirectory;
-  std::ifstream datesFile(".floodsar-cache/dates.txt");
+  std::string datesManifestPath;
+  // flood masks of the mapped configuration, if the analysis packed them
+  std::string maskCubePath;
   std::vector<std::string> dates;
-  std::string line;
 
   auto userInput = options.parse(argc, argv);
+  // written when mapper returns
+  const TraceSession traceSession(userInput["trace"].as<std::string>());
 
-  if (datesFile.is_open()) {
-    while (getline(datesFile, line)) {
-      dates.push_back(line);
-    }
-    datesFile.close();
-  } else
-    std::cout << "Unable to open ./floodsar-cache/dates.txt";
+  MapOptions mapOptions;
+  mapOptions.compression = userInput["compress"].as<std::string>();
+  mapOptions.overviewResampling = userInput["resampling"].as<std::string>();
+  mapOptions.cog = !userInput.count("no-cog");
+  mapOptions.aggregates = !userInput.count("no-aggregates");
 
-  if (fs::exists("./raster")) fs::remove("./raster");
-  std::cout << "copy as template: ./.floodsar-cache/cropped/resampled__VV_" + dates[0] << "\n";
-  fs::copy_file("./.floodsar-cache/cropped/resampled__VV_" + dates[0], "./raster");
-  
   //one may want to clean-up all, however, it is better ro remove only directories with conflict as now implemented
   //if (fs::exists("mapped")) fs::remove_all("mapped");
   
@@ -75,28 +179,33 @@ main(int argc, char** argv)
     std::string pol = userInput["base"].as<std::string>();
     // either VV or VH
 
-    pointsFile = "./.floodsar-cache/1d_output/" + pol;
+    pointsFile = thresholdLabelsPath(pol);
+    datesManifestPath = matchedScenesPath(pol);
+    maskCubePath = thresholdMaskCubePath(pol);
     mapDirectory = "./mapped/base_algo_pol_" + pol + "/";
   } else {
     // 2D algroithm
+    int bestAllClasses = 0;
+    int bestFloodClasses = 0;
+    std::ifstream bestClassStream(bestClassPath());
+    bestClassStream >> bestAllClasses >> bestFloodClasses;
     if (userInput.count("auto")) 
        {
-        std::ifstream bestClassStream(".floodsar-cache/kmeans_outputs/best.txt");
-        bestClassStream >> numAllClassess >> numFloodClasses;
+        numAllClassess = bestAllClasses;
+        numFloodClasses = bestFloodClasses;
         std::cout <<"Auto best classes\n k-means classes: " + std::to_string(numAllClassess) + ", Flood classes: " + std::to_string(numFloodClasses) +"\n";
        } else {
         numAllClassess = userInput["classes"].as<int>();
         numFloodClasses = userInput["floods"].as<int>();
        }
 
-    std::string floodclassesFile =
-      "./.floodsar-cache/kmeans_outputs/KMEANS_INPUT_cl_" +
-      std::to_string(numAllClassess) + "/" + std::to_string(numAllClassess) +
-      "-clusters.txt_" + std::to_string(numFloodClasses) + "_floodclasses.txt";
+    std::string floodclassesFile = kmeansClustersPath(numAllClassess) + "_" +
+                                   std::to_string(numFloodClasses) +
+                                   "_floodclasses.txt";
 
     std::ifstream floodclassesFileStream(floodclassesFile);
 
-    int floodClass;
+    unsigned int floodClass;
 
     while (floodclassesFileStream >> floodClass) {
       floodClasses.push_back(floodClass);
@@ -104,90 +213,81 @@ main(int argc, char** argv)
 
     floodclassesFileStream.close();
 
-    pointsFile = "./.floodsar-cache/kmeans_outputs/KMEANS_INPUT_cl_" +
-                 std::to_string(numAllClassess) + "/" +
-                 std::to_string(numAllClassess) + "-points.txt";
+    pointsFile = kmeansLabelsPath(numAllClassess);
+    datesManifestPath = matchedScenesPath();
+    // the cube holds masks of the best configuration only
+    if (numAllClassess == bestAllClasses && numFloodClasses == bestFloodClasses) {
+      maskCubePath = kmeansMaskCubePath();
+    }
 
     mapDirectory = "./mapped/" + std::to_string(numAllClassess) + "__" +
                    std::to_string(numFloodClasses) + "/";
   }
 
-  std::string rasterToClassify = "./raster";
-
-  std::ifstream pointsStream(pointsFile);
+  // dates in the order of labels, and the grid the scenes were cropped to
+  SceneManifest datesManifest;
+  if (!readSceneManifest(datesManifestPath, datesManifest) ||
+      datesManifest.entries.empty()) {
+    std::cout << "Unable to read " << datesManifestPath
+              << ", no dates to map. Program will quit\n";
+    return 0;
+  }
+  dates = datesManifest.dates();
+  GridInfo grid = datesManifest.grid();
+  // labels are stored only for pixels inside the area of interest
+  const AoiMask aoiMask =
+    loadAoiMask(static_cast<size_t>(grid.xSize) * grid.ySize);
+
+  const std::string unionRange = userInput["union"].as<std::string>();
+  const std::string intersectionRange = userInput["intersection"].as<std::string>();
+  if (userInput.count("areas") || !unionRange.empty() ||
+      !intersectionRange.empty()) {
+    return queryFloodMaskCube(maskCubePath,
+                              mapDirectory,
+                              grid,
+                              aoiMask,
+                              mapOptions,
+                              userInput.count("areas"),
+                              unionRange,
+                              intersectionRange);
+  }
 
-  int point;
-  int dateIndex = 0;
-  int bufferIndex = 0;
+  LabelStore labelStore(pointsFile);
+  if (!labelStore.isValid() ||
+      labelStore.pixelsPerDate() != aoiMask.validWords()) {
+    std::cout << "Labels in " << pointsFile << " do not match raster size "
+              << grid.xSize << "x" << grid.ySize << " and the AOI mask ("
+              << aoiMask.validWords() << " pixels). Program will quit\n";
+    return 0;
+  }
+  dates.resize(std::min(dates.size(), labelStore.numDates()));
 
-  //remove only conflicts
-  if (!fs::exists("mapped")) fs::create_directory("mapped");
-  if (fs::exists(mapDirectory)) fs::remove_all(mapDirectory);
-  fs::create_directory(mapDirectory);
-  
+  // aggregates are counted on the cube when it holds these dates
+  std::unique_ptr<FloodMaskCube> maskCube;
+  if (!maskCubePath.empty() && fs::exists(maskCubePath)) {
+    maskCube = std::make_unique<FloodMaskCube>(maskCubePath);
+  }
 
-  std::string mapPath = mapDirectory + dates[dateIndex] + ".tif";
-  std::filesystem::copy_file(rasterToClassify, mapPath);
-
-  int NoDataValue = -1;
-  auto raster = static_cast<GDALDataset*>(GDALOpen(mapPath.c_str(), GA_Update));
-  auto rasterBand = raster->GetRasterBand(1);
-  unsigned int xSize = rasterBand->GetXSize();
-  unsigned int ySize = rasterBand->GetYSize();
-  const unsigned int words = xSize * ySize;
-  double* buffer = static_cast<double*>(CPLMalloc(sizeof(double) * words));
-
-  int pointsExpected = xSize * ySize * dates.size();
-  int pointsActual = 0;
-  pointsActual += xSize * ySize;
-
-  while (pointsStream >> point) {
-    if (std::find(floodClasses.begin(), floodClasses.end(), point) !=
-        floodClasses.end()) {
-      buffer[bufferIndex] = 1;
-    } else {
-      buffer[bufferIndex] = 0;
-    }
-    bufferIndex++;
-
-    if (bufferIndex == words) {
-      bufferIndex = 0;
-
-      auto error = rasterBand->RasterIO(
-        GF_Write, 0, 0, xSize, ySize, buffer, xSize, ySize, GDT_Float64, 0, 0);
-
-      if (error == CE_Failure) {
-        std::cout << "[] Could not read raster\n";
-      } else {
-        std::cout << "saved: " + mapPath + '\n';
-      }
-
-      auto noDataError = rasterBand->SetNoDataValue(NoDataValue);
-      if(noDataError == CE_Failure) std::cout << "Could not set NoDataValue\n";
-
-      raster->FlushCache();
-      GDALClose(raster);
-
-      dateIndex++;
-      if (dateIndex >= dates.size()) {
-        std::cout << "Its time to stop. \n";
-        break;
-      }
-	  //mapPath contains reults raster for particular date
-      mapPath = mapDirectory + dates[dateIndex] + ".tif";
-      std::filesystem::copy_file(rasterToClassify, mapPath);
-
-      raster = static_cast<GDALDataset*>(GDALOpen(mapPath.c_str(), GA_Update));
-      rasterBand = raster->GetRasterBand(1);
-      xSize = rasterBand->GetXSize();
-      ySize = rasterBand->GetYSize();
-      pointsActual += xSize * ySize;
+  // dates are appended by --update, so maps already written come first
+  size_t firstMappedDate = 0;
+  if (userInput.count("update")) {
+    while (firstMappedDate < dates.size() &&
+           fs::exists(mapDirectory + dates[firstMappedDate] + ".tif")) {
+      firstMappedDate++;
     }
+    std::cout << "Update: " << dates.size() - firstMappedDate << " of "
+              << dates.size() << " dates to map\n";
   }
 
-  pointsStream.close();
-
-  CPLFree(buffer);
+  writeFloodMaps(mapDirectory,
+                 grid,
+                 dates,
+                 labelStore.date(0),
+                 createFloodLookup(floodClasses),
+                 mapOptions,
+                 aoiMask,
+                 firstMappedDate,
+                 maskCube.get());
 
   return 0;
 }
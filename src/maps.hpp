@@ -0,0 +1,571 @@
+#pragma once
+
+#include "aoi.hpp"
+#include "bitmasks.hpp"
+#include "gdal/gdal_priv.h"
+#include "labels.hpp"
+#include "memory.hpp"
+#include "stages.hpp"
+#include "trace.hpp"
+#include "types.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <filesystem>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+/*
+*
+* Utilities for writing flood maps directly from in-memory masks.
+*
+*/
+
+// value written for pixels that have no classification
+const unsigned char floodMapNoData = 255;
+
+/*
+* Georeferencing and size of the cropped rasters, i.e. the grid all maps are
+* written on.
+*/
+class GridInfo
+{
+public:
+  int xSize = 0;
+  int ySize = 0;
+  double geoTransform[6] = { 0.0, 1.0, 0.0, 0.0, 0.0, 1.0 };
+  std::string projection;
+};
+
+/*
+* Reads grid description from an existing raster, without copying it.
+* @param rasterPath is a path to any of the cropped rasters
+*/
+inline GridInfo
+readGridInfo(const std::string& rasterPath)
+{
+  GridInfo grid;
+  auto dataset =
+    static_cast<GDALDataset*>(GDALOpen(rasterPath.c_str(), GA_ReadOnly));
+  if (dataset == nullptr) {
+    std::cout << "[readGridInfo] Could not open " << rasterPath << "\n";
+    return grid;
+  }
+  grid.xSize = dataset->GetRasterXSize();
+  grid.ySize = dataset->GetRasterYSize();
+  dataset->GetGeoTransform(grid.geoTransform);
+  grid.projection = dataset->GetProjectionRef();
+  GDALClose(dataset);
+  return grid;
+}
+
+/*
+* How maps are written. By default as Cloud Optimized GeoTIFF: tiled,
+* compressed, with internal overviews placed before full-resolution data.
+*/
+class MapOptions
+{
+public:
+  // GTiff/COG COMPRESS creation option, e.g. DEFLATE, ZSTD, LZW, NONE
+  std::string compression = "DEFLATE";
+  // resampling of overviews, MODE keeps masks binary, AVERAGE gives shades
+  std::string overviewResampling = "MODE";
+  // write overviews and COG layout, plain tiled GeoTIFF otherwise
+  bool cog = true;
+  // threads GDAL may use to compress one file
+  unsigned int threads = 1;
+  // also write flood frequency and first/last flooded date rasters
+  bool aggregates = true;
+  // bytes the map workers may take together, fewer dates are mapped in
+  // parallel when their buffers exceed it; 0 = no limit
+  size_t memoryBudget = 0;
+};
+
+const int mapBlockSize = 256;
+
+// overview factors 2, 4, 8... until the overview fits in one block
+inline std::vector<int>
+getOverviewLevels(const GridInfo& grid)
+{
+  std::vector<int> levels;
+  for (int level = 2; std::max(grid.xSize, grid.ySize) / (level / 2) > mapBlockSize;
+       level *= 2) {
+    levels.push_back(level);
+  }
+  return levels;
+}
+
+/*
+* Writes a single-band raster on the grid as GeoTIFF, layout per options.
+* The raster is assembled in memory first, so overviews are computed from
+* memory and the file is written once, in its final layout.
+* @param data holds xSize*ySize values of given type
+*/
+inline bool
+writeGeoTiff(const std::string& path,
+             const GridInfo& grid,
+             const void* data,
+             GDALDataType type,
+             double noData,
+             const MapOptions& options)
+{
+  TraceScope trace(traceName("write ", fs::path(path).filename().string()));
+  auto memDriver = GetGDALDriverManager()->GetDriverByName("MEM");
+  if (memDriver == nullptr) {
+    std::cout << "[writeGeoTiff] MEM driver not available\n";
+    return false;
+  }
+  auto memRaster =
+    memDriver->Create("", grid.xSize, grid.ySize, 1, type, nullptr);
+  if (memRaster == nullptr) {
+    std::cout << "[writeGeoTiff] Could not allocate " << path << "\n";
+    return false;
+  }
+
+  double geoTransform[6];
+  std::copy(grid.geoTransform, grid.geoTransform + 6, geoTransform);
+  memRaster->SetGeoTransform(geoTransform);
+  memRaster->SetProjection(grid.projection.c_str());
+
+  auto rasterBand = memRaster->GetRasterBand(1);
+  rasterBand->SetNoDataValue(noData);
+  auto error = rasterBand->RasterIO(GF_Write,
+                                    0,
+                                    0,
+                                    grid.xSize,
+                                    grid.ySize,
+                                    const_cast<void*>(data),
+                                    grid.xSize,
+                                    grid.ySize,
+                                    type,
+                                    0,
+                                    0);
+  if (error == CE_Failure) {
+    std::cout << "[writeGeoTiff] Could not fill " << path << "\n";
+    GDALClose(memRaster);
+    return false;
+  }
+
+  const std::string blockSize = std::to_string(mapBlockSize);
+  const std::string threads = std::to_string(std::max(1u, options.threads));
+  auto cogDriver = GetGDALDriverManager()->GetDriverByName("COG");
+  GDALDriver* driver = nullptr;
+  char** createOptions = nullptr;
+  createOptions =
+    CSLSetNameValue(createOptions, "COMPRESS", options.compression.c_str());
+  createOptions = CSLSetNameValue(createOptions, "NUM_THREADS", threads.c_str());
+
+  if (options.cog && cogDriver != nullptr) {
+    driver = cogDriver;
+    createOptions =
+      CSLSetNameValue(createOptions, "BLOCKSIZE", blockSize.c_str());
+    createOptions = CSLSetNameValue(
+      createOptions, "OVERVIEW_RESAMPLING", options.overviewResampling.c_str());
+  } else {
+    // no COG driver (GDAL < 3.1): the same layout via GTiff and
+    // overviews copied from the in-memory dataset
+    driver = GetGDALDriverManager()->GetDriverByName("GTiff");
+    createOptions = CSLSetNameValue(createOptions, "TILED", "YES");
+    createOptions =
+      CSLSetNameValue(createOptions, "BLOCKXSIZE", blockSize.c_str());
+    createOptions =
+      CSLSetNameValue(createOptions, "BLOCKYSIZE", blockSize.c_str());
+    auto levels = getOverviewLevels(grid);
+    if (options.cog && !levels.empty()) {
+      memRaster->BuildOverviews(options.overviewResampling.c_str(),
+                                levels.size(),
+                                levels.data(),
+                                0,
+                                nullptr,
+                                GDALDummyProgress,
+                                nullptr);
+      createOptions =
+        CSLSetNameValue(createOptions, "COPY_SRC_OVERVIEWS", "YES");
+    }
+  }
+
+  GDALDataset* raster = nullptr;
+  if (driver != nullptr) {
+    raster = driver->CreateCopy(
+      path.c_str(), memRaster, FALSE, createOptions, GDALDummyProgress, nullptr);
+  }
+  CSLDestroy(createOptions);
+  GDALClose(memRaster);
+
+  if (raster == nullptr) {
+    std::cout << "[writeGeoTiff] Could not write " << path << "\n";
+    return false;
+  }
+  GDALClose(raster);
+  return true;
+}
+
+/*
+* Writes one flood map as a Byte raster.
+* @param mapPath is the output file path
+* @param grid is the georeferencing of the output
+* @param mask holds xSize*ySize values: 1 = flooded, 0 = not flooded,
+* floodMapNoData = unknown
+*/
+inline bool
+writeFloodMap(const std::string& mapPath,
+              const GridInfo& grid,
+              const unsigned char* mask,
+              const MapOptions& options)
+{
+  return writeGeoTiff(mapPath, grid, mask, GDT_Byte, floodMapNoData, options);
+}
+
+/*
+* Per-pixel statistics of a map stack, accumulated from the classified
+* labels, so the stack never has to be read back:
+* - how many dates the pixel was flooded (saturating uint16 counter),
+* - first and last date (1-based index) the pixel was flooded,
+* - how many dates the pixel had a valid classification.
+* Dates may be added in any order. Disjoint ranges of pixels may be added
+* from different threads.
+*/
+class FloodAggregator
+{
+public:
+  FloodAggregator(size_t words)
+    : frequency(words, 0)
+    , observed(words, 0)
+    , firstFlooded(words, notFlooded)
+    , lastFlooded(words, 0)
+  {
+  }
+
+  /*
+  * Adds a mask of pixels [first, first + count), all pixels by default.
+  * Branch-free, so the compiler vectorizes it.
+  */
+  void add(const unsigned char* mask,
+           uint16_t dateNumber,
+           size_t first = 0,
+           size_t count = std::numeric_limits<size_t>::max())
+  {
+    count = std::min(count, frequency.size() - first);
+    // mask is a byte array, which may alias anything - tell it does not
+    uint16_t* __restrict freq = frequency.data() + first;
+    uint16_t* __restrict obs = observed.data() + first;
+    uint16_t* __restrict firstDate = firstFlooded.data() + first;
+    uint16_t* __restrict lastDate = lastFlooded.data() + first;
+    for (size_t i = 0; i < count; i++) {
+      const uint16_t flooded = mask[i] == 1;
+      const uint16_t valid = mask[i] != floodMapNoData;
+      const uint16_t floodedBits = -flooded;
+      // dateNumber if flooded, 0 / notFlooded otherwise
+      const uint16_t lastCandidate = dateNumber & floodedBits;
+      const uint16_t firstCandidate = lastCandidate | ~floodedBits;
+      freq[i] += flooded & (freq[i] != 0xFFFF);
+      obs[i] += valid & (obs[i] != 0xFFFF);
+      firstDate[i] = firstDate[i] < firstCandidate ? firstDate[i] : firstCandidate;
+      lastDate[i] = lastDate[i] > lastCandidate ? lastDate[i] : lastCandidate;
+    }
+  }
+
+  static const uint16_t notFlooded = 0xFFFF;
+
+  std::vector<uint16_t> frequency;
+  std::vector<uint16_t> observed;
+  std::vector<uint16_t> firstFlooded;
+  std::vector<uint16_t> lastFlooded;
+};
+
+const uint16_t floodFrequencyNoData = 0xFFFF;
+const uint32_t floodDateNoData = 0xFFFFFFFF;
+
+/*
+* Writes aggregate rasters to the directory:
+* frequency.tif - number of flooded dates (UInt16),
+* first_flooded.tif, last_flooded.tif - date as YYYYMMDD number (UInt32),
+* 0 if the pixel was never flooded.
+* Pixels never observed are no data.
+*/
+inline void
+writeFloodAggregates(const std::string& directory,
+                     const GridInfo& grid,
+                     const std::vector<Date>& dates,
+                     const FloodAggregator& aggregator,
+                     const MapOptions& options)
+{
+  fs::create_directories(directory);
+  const size_t words = aggregator.frequency.size();
+
+  // YYYYMMDD numbers by 1-based date number, 0 = never flooded
+  std::vector<uint32_t> dateNumbers(dates.size() + 1, 0);
+  for (size_t d = 0; d < dates.size(); d++) {
+    dateNumbers[d + 1] = std::stoul(dates[d]);
+  }
+
+  std::vector<uint16_t> frequency(words);
+  std::vector<uint32_t> firstDate(words);
+  std::vector<uint32_t> lastDate(words);
+  for (size_t i = 0; i < words; i++) {
+    const bool observed = aggregator.observed[i] > 0;
+    const bool flooded = aggregator.frequency[i] > 0;
+    frequency[i] = observed ? aggregator.frequency[i] : floodFrequencyNoData;
+    firstDate[i] = !observed ? floodDateNoData
+                   : flooded ? dateNumbers[aggregator.firstFlooded[i]]
+                             : 0;
+    lastDate[i] = !observed ? floodDateNoData : dateNumbers[aggregator.lastFlooded[i]];
+  }
+
+  // averaging dates or counts in overviews makes no sense
+  MapOptions aggregateOptions = options;
+  aggregateOptions.overviewResampling = "NEAREST";
+
+  const std::string frequencyPath = directory + "frequency.tif";
+  if (writeGeoTiff(frequencyPath,
+                   grid,
+                   frequency.data(),
+                   GDT_UInt16,
+                   floodFrequencyNoData,
+                   aggregateOptions)) {
+    std::cout << "saved: " + frequencyPath + '\n';
+  }
+  const std::string firstPath = directory + "first_flooded.tif";
+  if (writeGeoTiff(firstPath,
+                   grid,
+                   firstDate.data(),
+                   GDT_UInt32,
+                   floodDateNoData,
+                   aggregateOptions)) {
+    std::cout << "saved: " + firstPath + '\n';
+  }
+  const std::string lastPath = directory + "last_flooded.tif";
+  if (writeGeoTiff(lastPath,
+                   grid,
+                   lastDate.data(),
+                   GDT_UInt32,
+                   floodDateNoData,
+                   aggregateOptions)) {
+    std::cout << "saved: " + lastPath + '\n';
+  }
+}
+
+// removes only the map directory we are about to write (if it exists)
+inline void
+prepareMapDirectory(const std::string& mapDirectory)
+{
+  if (fs::exists(mapDirectory)) fs::remove_all(mapDirectory);
+  fs::create_directories(mapDirectory);
+}
+
+// rows of the grid aggregated by a thread at once
+const size_t mapRowsPerTask = 64;
+
+/*
+* Adds all dates to the aggregator, the grid split into ranges of rows
+* aggregated in parallel, so a single aggregator is needed and each thread
+* only classifies the labels of its rows.
+* @param labels holds labels of all dates, date after date, one per pixel
+* inside the area of interest
+*/
+inline void
+aggregateFloodMaps(FloodAggregator& aggregator,
+                   const GridInfo& grid,
+                   size_t numDates,
+                   const unsigned char* labels,
+                   const FloodLookup& lookup,
+                   const AoiMask& aoiMask)
+{
+  TraceScope trace("aggregate maps");
+  const size_t labelsPerDate = aoiMask.validWords();
+  const size_t tasks = (grid.ySize + mapRowsPerTask - 1) / mapRowsPerTask;
+  parallelFor(tasks, [&](size_t task) {
+    const size_t rowWords = grid.xSize;
+    const size_t first = task * mapRowsPerTask * rowWords;
+    const size_t count =
+      std::min(mapRowsPerTask * rowWords, aoiMask.gridWords - first);
+    // labels of pixels inside the area of interest in these rows
+    size_t firstLabel = first;
+    size_t endLabel = first + count;
+    if (!aoiMask.isFull()) {
+      const auto& valid = aoiMask.validPixels;
+      firstLabel = std::lower_bound(valid.begin(), valid.end(), first) - valid.begin();
+      endLabel = std::lower_bound(valid.begin(), valid.end(), first + count) -
+                 valid.begin();
+    }
+    std::vector<unsigned char> mask(count, floodMapNoData);
+    for (size_t dateIndex = 0; dateIndex < numDates; dateIndex++) {
+      const unsigned char* dateLabels = labels + dateIndex * labelsPerDate;
+      if (aoiMask.isFull()) {
+        classifyLabels(dateLabels + first, count, lookup, mask.data());
+      } else {
+        for (size_t i = firstLabel; i < endLabel; i++) {
+          mask[aoiMask.validPixels[i] - first] = lookup[dateLabels[i]];
+        }
+      }
+      aggregator.add(mask.data(), dateIndex + 1, first, count);
+    }
+  });
+}
+
+/*
+* Adds all dates of a flood mask cube to the aggregator, ranges of rows in
+* parallel. Only set bits are visited, the labels are not classified again.
+* @param numDates dates of the cube to add, its first ones
+*/
+inline void
+aggregateFloodMaskCube(FloodAggregator& aggregator,
+                       const FloodMaskCube& cube,
+                       size_t numDates,
+                       const AoiMask& aoiMask)
+{
+  TraceScope trace("aggregate mask cube");
+  const size_t xSize = cube.xSize();
+  const uint16_t observed = std::min<size_t>(numDates, 0xFFFF);
+  const size_t tasks = (cube.ySize() + mapRowsPerTask - 1) / mapRowsPerTask;
+  parallelFor(tasks, [&](size_t task) {
+    const size_t firstRow = task * mapRowsPerTask;
+    const size_t endRow = std::min<size_t>(cube.ySize(), firstRow + mapRowsPerTask);
+    const size_t first = firstRow * xSize;
+    const size_t end = endRow * xSize;
+    // every date observes the pixels inside the area of interest
+    if (aoiMask.isFull()) {
+      std::fill(aggregator.observed.begin() + first,
+                aggregator.observed.begin() + end,
+                observed);
+    } else {
+      const auto& valid = aoiMask.validPixels;
+      for (auto it = std::lower_bound(valid.begin(), valid.end(), first);
+           it != valid.end() && *it < end;
+           ++it) {
+        aggregator.observed[*it] = observed;
+      }
+    }
+    for (size_t d = 0; d < numDates; d++) {
+      const uint16_t dateNumber = d + 1;
+      cube.forEachFlooded(d, firstRow, endRow, [&](size_t i) {
+        aggregator.frequency[i] += aggregator.frequency[i] != 0xFFFF;
+        aggregator.firstFlooded[i] = std::min(aggregator.firstFlooded[i], dateNumber);
+        aggregator.lastFlooded[i] = dateNumber;
+      });
+    }
+  });
+}
+
+/*
+* Unpacks words of a cube (a date, a union...) to a flood map: 1 = flooded,
+* 0 = not flooded, floodMapNoData outside the area of interest.
+* @param mask receives xSize*ySize values
+*/
+inline void
+unpackFloodMask(const uint64_t* words,
+                const GridInfo& grid,
+                const AoiMask& aoiMask,
+                unsigned char* mask)
+{
+  const size_t wordsPerRow = getWordsPerRow(grid.xSize);
+  parallelFor(static_cast<size_t>(grid.ySize), [&](size_t y) {
+    unsigned char* row = mask + y * grid.xSize;
+    for (int x = 0; x < grid.xSize; x++) {
+      row[x] = (words[y * wordsPerRow + x / 64] >> (x % 64)) & 1;
+    }
+  });
+  if (!aoiMask.isFull()) {
+    std::vector<unsigned char> inside(aoiMask.gridWords, 0);
+    for (size_t pixel : aoiMask.validPixels) {
+      inside[pixel] = 1;
+    }
+    for (size_t i = 0; i < aoiMask.gridWords; i++) {
+      mask[i] = inside[i] ? mask[i] : floodMapNoData;
+    }
+  }
+}
+
+/*
+* Classifies labels of all dates and writes one map per date, dates in
+* parallel. Each worker creates its own dataset, no GDAL object is shared.
+* Aggregates are computed afterwards, from the flood mask cube when it
+* holds these dates (see aggregateFloodMaskCube), otherwise from the labels
+* over ranges of rows (see aggregateFloodMaps).
+* @param labels holds labels of all dates, date after date, one per pixel
+* inside the area of interest
+* @param lookup tells which labels are flooded
+* @param aoiMask tells where the labels go, pixels outside are no data
+* @param firstMappedDate skips maps of earlier dates, which are kept in the
+* directory (--update); aggregates always cover all dates
+* @param cube holds flood masks of the dates, if there is one
+*/
+inline void
+writeFloodMaps(const std::string& mapDirectory,
+               const GridInfo& grid,
+               const std::vector<Date>& dates,
+               const unsigned char* labels,
+               const FloodLookup& lookup,
+               const MapOptions& options,
+               const AoiMask& aoiMask,
+               size_t firstMappedDate = 0,
+               const FloodMaskCube* cube = nullptr)
+{
+  ScopedStage stage("map");
+  const size_t words = static_cast<size_t>(grid.xSize) * grid.ySize;
+  const size_t labelsPerDate = aoiMask.validWords();
+  if (firstMappedDate == 0) {
+    prepareMapDirectory(mapDirectory);
+  } else {
+    fs::create_directories(mapDirectory);
+  }
+  stage.addPixels(words * dates.size());
+  stage.addBytesRead(labelsPerDate * dates.size());
+
+  // cores left over by the date workers go to compression of each file
+  const size_t mappedDates = dates.size() - std::min(firstMappedDate, dates.size());
+  const unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+  const size_t workers =
+    countMapWorkers(labelsPerDate, words, mappedDates, options.memoryBudget);
+  MapOptions fileOptions = options;
+  fileOptions.threads = std::max<size_t>(1, cores / workers);
+
+  // each worker takes every n-th date
+  memoryTracker().set("map buffers", workers * mapWorkerBytes(labelsPerDate, words));
+  parallelFor(
+    workers,
+    [&](size_t worker) {
+      std::vector<unsigned char> mask(words);
+      std::vector<unsigned char> compactMask(aoiMask.isFull() ? 0 : labelsPerDate);
+      for (size_t dateIndex = firstMappedDate + worker; dateIndex < dates.size();
+           dateIndex += workers) {
+        TraceScope trace(traceName("map ", dates[dateIndex]));
+        const unsigned char* dateLabels = labels + dateIndex * labelsPerDate;
+        if (aoiMask.isFull()) {
+          classifyLabels(dateLabels, words, lookup, mask.data());
+        } else {
+          classifyLabels(dateLabels, labelsPerDate, lookup, compactMask.data());
+          expandToGrid(compactMask.data(), aoiMask, mask.data(), floodMapNoData);
+        }
+
+        // mapPath contains reults raster for particular date
+        const std::string mapPath = mapDirectory + dates[dateIndex] + ".tif";
+        if (writeFloodMap(mapPath, grid, mask.data(), fileOptions)) {
+          std::cout << "saved: " + mapPath + '\n';
+        }
+      }
+    },
+    workers);
+  memoryTracker().release("map buffers");
+
+  if (options.aggregates && !dates.empty()) {
+    memoryTracker().set("map aggregates", 4 * words * sizeof(uint16_t));
+    FloodAggregator aggregator(words);
+    if (cube != nullptr && cube->covers(dates, grid.xSize, grid.ySize)) {
+      aggregateFloodMaskCube(aggregator, *cube, dates.size(), aoiMask);
+    } else {
+      aggregateFloodMaps(aggregator, grid, dates.size(), labels, lookup, aoiMask);
+    }
+    MapOptions aggregateOptions = options;
+    aggregateOptions.threads = cores;
+    writeFloodAggregates(
+      mapDirectory + "aggregates/", grid, dates, aggregator, aggregateOptions);
+    memoryTracker().release("map aggregates");
+  }
+  stage.addBytesWritten(getDirectorySize(mapDirectory));
+}
@@ -0,0 +1,226 @@
+#pragma once
+
+#include "gdal/gdal_priv.h"
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <sys/resource.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+/*
+*
+* Memory accounting: resident set size of the process, sizes of the large
+* structures of the analysis (pixel vectors, label arrays, GDAL block cache)
+* and a prediction of the in-core footprint, made from the grid and the
+* number of dates before any image is loaded.
+*
+*/
+
+const size_t bytesPerMiB = 1024 * 1024;
+
+// high-water mark of the resident set size of the process, in bytes
+inline size_t
+getPeakRss()
+{
+  rusage usage{};
+  getrusage(RUSAGE_SELF, &usage);
+  // kilobytes on Linux
+  return static_cast<size_t>(usage.ru_maxrss) * 1024;
+}
+
+// physical memory of the machine in bytes, 0 if unknown
+inline size_t
+getPhysicalMemory()
+{
+  const long pages = sysconf(_SC_PHYS_PAGES);
+  const long pageSize = sysconf(_SC_PAGE_SIZE);
+  return pages > 0 && pageSize > 0 ? static_cast<size_t>(pages) * pageSize : 0;
+}
+
+template<typename T>
+inline size_t
+getVectorBytes(const std::vector<T>& values)
+{
+  return values.capacity() * sizeof(T);
+}
+
+template<typename T>
+inline size_t
+getVectorBytes(const std::vector<std::vector<T>>& stack)
+{
+  size_t bytes = 0;
+  for (const auto& values : stack) {
+    bytes += getVectorBytes(values);
+  }
+  return bytes;
+}
+
+class MemoryRecord
+{
+public:
+  std::string name;
+  size_t current = 0;
+  size_t peak = 0;
+};
+
+/*
+* Current and peak size of named structures. Structures report their size
+* when they grow and 0 when they are freed; thread-safe.
+*/
+class MemoryTracker
+{
+public:
+  void set(const std::string& name, size_t bytes)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto record = std::find_if(m_records.begin(),
+                               m_records.end(),
+                               [&](const MemoryRecord& r) { return r.name == name; });
+    if (record == m_records.end()) {
+      m_records.push_back({ name, 0, 0 });
+      record = m_records.end() - 1;
+    }
+    record->current = bytes;
+    record->peak = std::max(record->peak, bytes);
+  }
+
+  void release(const std::string& name) { set(name, 0); }
+
+  // bytes held by all structures now
+  size_t total() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    size_t bytes = 0;
+    for (const auto& record : m_records) {
+      bytes += record.current;
+    }
+    return bytes;
+  }
+
+  std::vector<MemoryRecord> records() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_records;
+  }
+
+  void clear()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_records.clear();
+  }
+
+private:
+  mutable std::mutex m_mutex;
+  std::vector<MemoryRecord> m_records;
+};
+
+inline MemoryTracker&
+memoryTracker()
+{
+  static MemoryTracker tracker;
+  return tracker;
+}
+
+// the GDAL block cache is tracked like the structures of the analysis
+inline void
+trackGdalBlockCache()
+{
+  memoryTracker().set("GDAL block cache", static_cast<size_t>(GDALGetCacheUsed64()));
+}
+
+// bytes a map worker holds: the grid mask, the labels of a date and the
+// in-memory dataset the map is assembled in
+inline size_t
+mapWorkerBytes(size_t pixelsPerDate, size_t gridPixels)
+{
+  return 2 * gridPixels + pixelsPerDate;
+}
+
+/*
+* Workers writing maps of dates in parallel: one per core and date, fewer if
+* their buffers would not fit the budget (0 = no budget), at least one.
+*/
+inline size_t
+countMapWorkers(size_t pixelsPerDate, size_t gridPixels, size_t dates, size_t budget)
+{
+  const size_t cores = std::max(1u, std::thread::hardware_concurrency());
+  size_t workers = std::max<size_t>(1, std::min(cores, dates));
+  if (budget > 0) {
+    workers = std::min(
+      workers, std::max<size_t>(1, budget / mapWorkerBytes(pixelsPerDate, gridPixels)));
+  }
+  return workers;
+}
+
+/*
+* Peak memory of writing maps: the date workers first, then the aggregates,
+* a single aggregator (4 uint16 per pixel), the output rasters (uint16 and
+* two uint32 per pixel) and the in-memory dataset of one of them.
+*/
+inline size_t
+predictMapFootprint(size_t pixelsPerDate,
+                    size_t gridPixels,
+                    size_t dates,
+                    bool aggregates,
+                    size_t budget = 0)
+{
+  const size_t workers = countMapWorkers(pixelsPerDate, gridPixels, dates, budget);
+  const size_t mapBytes = workers * mapWorkerBytes(pixelsPerDate, gridPixels);
+  const size_t aggregateBytes =
+    aggregates ? gridPixels * (4 * sizeof(uint16_t) + sizeof(uint16_t) +
+                               3 * sizeof(uint32_t))
+               : 0;
+  return std::max(mapBytes, aggregateBytes);
+}
+
+/*
+* Peak memory of the in-core analysis, which reads the whole stack at once.
+* @param pixelsPerDate pixels of a date inside the area of interest
+* @param gridPixels pixels of the crop grid, one date is read at full size
+* @param dates number of dates matched with the gauge (pairs for 2D)
+*/
+inline size_t
+predictInCoreFootprint(size_t pixelsPerDate,
+                       size_t gridPixels,
+                       size_t dates,
+                       bool dualPol,
+                       bool emitMaps)
+{
+  const size_t stackPixels = pixelsPerDate * dates;
+  size_t bytes = 0;
+  if (dualPol) {
+    // VH and VV of all dates, labels of one k and a read buffer of a pair
+    bytes = stackPixels * (2 * sizeof(double) + 1) + 2 * gridPixels * sizeof(double);
+    if (emitMaps) {
+      // labels of the best k are kept
+      bytes += stackPixels;
+    }
+  } else {
+    // one polarization at a time: stack and labels
+    bytes = stackPixels * (sizeof(double) + 1) + gridPixels * sizeof(double);
+  }
+  if (emitMaps) {
+    bytes += predictMapFootprint(pixelsPerDate, gridPixels, dates, true);
+  }
+  return bytes + static_cast<size_t>(GDALGetCacheMax64());
+}
+
+inline void
+printMemoryReport(const std::vector<MemoryRecord>& records)
+{
+  std::cout << std::left << std::setw(24) << "structure" << std::right
+            << std::setw(12) << "peak MB" << "\n";
+  std::cout << std::fixed << std::setprecision(2);
+  for (const auto& record : records) {
+    std::cout << std::left << std::setw(24) << record.name << std::right
+              << std::setw(12) << record.peak / 1e6 << "\n";
+  }
+  std::cout << std::left << std::setw(24) << "process peak RSS" << std::right
+            << std::setw(12) << getPeakRss() / 1e6 << "\n";
+  std::cout << std::defaultfloat << std::setprecision(6);
+}
@@ -16,7 +16,7 @@ enum class Polarization
   e
 };
 
-std::string
+inline std::string
 polToString(Polarization pol)
 {
   if (pol == Polarization::VV) {
@@ -28,7 +28,7 @@ polToString(Polarization pol)
   }
 }
 
-Polarization
+inline Polarization
 stringToPol(std::string str)
 {
   Polarization pol;
@@ -4,8 +4,17 @@
 #include "RasterInfo.hpp"
 #include "XYPair.hpp"
 #include "gdal/gdal_priv.h"
+#include "gdal/gdal_utils.h"
+#include "gdal/ogr_spatialref.h"
+#include "speckle.hpp"
+#include "stages.hpp"
+#include "trace.hpp"
+#include "utils.hpp"
 #include <thread>
+#include <cmath>
+#include <cstdint>
 #include <fstream>
+#include <limits>
 
 
 /*
@@ -14,7 +23,7 @@
 *
 */
  
-BoundingBox
+inline BoundingBox
 getRasterBoundingBox(GDALDataset* raster)
 {
   BoundingBox boundingBox;
@@ -50,145 +59,182 @@ getRasterBoundingBox(GDALDataset* raster)
 
 /*
 * The functions crops satellite imagery in smaller region of interes
+* Cropping runs in-process (GDALTranslate), on an already open dataset.
+* @param source is the opened imagery
 * @param zoneBbox defines area of interest
-* @param info is a georeference info GDAL
 * @param epsgCode is projection code applied in satelltie imagery*
+* @param outputPath is where the cropped raster is written
 */
- 
-void
-cropToZone(BoundingBox zoneBBox, RasterInfo info, std::string epsgCode)
+inline bool
+cropDatasetToZone(GDALDataset* source,
+                  BoundingBox zoneBBox,
+                  std::string epsgCode,
+                  std::string outputPath)
 {
-  std::string command = "gdal_translate";
-  command.append(" -strict -r bilinear -outsize ");
-  command.append(std::to_string(zoneBBox.widthInPixels));
-  command.append(" ");
-  command.append(std::to_string(zoneBBox.heightInPixels));
-  command.append(" -projwin_srs " + epsgCode + " -projwin ");
-  command.append(std::to_string(zoneBBox.upperLeftX));
-  command.append(" ");
-  command.append(std::to_string(zoneBBox.upperLeftY));
-  command.append(" ");
-  command.append(std::to_string(zoneBBox.lowerRightX));
-  command.append(" ");
-  command.append(std::to_string(zoneBBox.lowerRightY));
-  command.append(" ");
-  command.append(info.absolutePath);
-  command.append(" ");
+  TraceScope trace(traceName("crop ", fs::path(outputPath).filename().string()));
+  const std::vector<std::string> args = {
+    "-strict",
+    "-r",
+    "bilinear",
+    "-outsize",
+    std::to_string(zoneBBox.widthInPixels),
+    std::to_string(zoneBBox.heightInPixels),
+    "-projwin_srs",
+    epsgCode,
+    "-projwin",
+    std::to_string(zoneBBox.upperLeftX),
+    std::to_string(zoneBBox.upperLeftY),
+    std::to_string(zoneBBox.lowerRightX),
+    std::to_string(zoneBBox.lowerRightY),
+  };
+  char** argv = nullptr;
+  for (const auto& arg : args) {
+    argv = CSLAddString(argv, arg.c_str());
+  }
+  auto translateOptions = GDALTranslateOptionsNew(argv, nullptr);
+  CSLDestroy(argv);
 
-  command.append(".floodsar-cache/cropped/resampled__" + polToString(info.pol) +
-                 "_" + info.date);
+  int usageError = FALSE;
+  auto cropped = GDALTranslate(
+    outputPath.c_str(), source, translateOptions, &usageError);
+  GDALTranslateOptionsFree(translateOptions);
 
-  std::cout << command << "\n";
-  std::system(command.c_str());
+  if (cropped == nullptr) {
+    std::cout << "Could not crop to " << outputPath << "\n";
+    return false;
+  }
+  GDALClose(cropped);
+  return true;
 }
 
-/* The function reduces geographcially raster to the area of interest in order to save memory.
+/*
+* Area of interest together with the cache directory its crops go to.
+*/
+class CropTarget
+{
+public:
+  BoundingBox zone;
+  std::string croppedDirectory;
+};
+
+/* The function reduces geographcially rasters to areas of interest in order to save memory.
+* Every raster is opened once and cropped to all targets, rasters are
+* processed in parallel.
 *
 * @param rasterPaths is a vector of raster information  (RasterInfo) of analyzed satellite imageries
-* @param aoiDataset is a pointer to imagery data
+* @param targets are areas of interest and their output directories
 * @param epsgCode is a cartographic projection code used in imagery (assumed equal to every imagery)
 *
 */
-void
-cropRastersToAreaOfInterest(std::vector<RasterInfo>& rasterPaths,
-                            GDALDataset* aoiDataset,
-                            std::string epsgCode)
+inline void
+cropRastersToAreasOfInterest(std::vector<RasterInfo>& rasterPaths,
+                             const std::vector<CropTarget>& targets,
+                             std::string epsgCode)
 {
-  const unsigned int maxThreads = std::thread::hardware_concurrency();
-  auto zoneBB = getRasterBoundingBox(aoiDataset);
-
-  // the overhead of creating threads might be a problem later when there is
-  // more rasters to process Ideally, there should be some sort of queue system
-  // and number of threads fixed on hardware_concurrency
-  // now it works in a number of tests
-  std::vector<std::thread> threads;
-
-  std::cout << "processing " << rasterPaths.size() << " rasters \n";
-
-  for (int i = 0; i < rasterPaths.size(); i++) {
-    std::cout << i << ". process " << rasterPaths.at(i).absolutePath << '\n';
-    // non-threaded v for debugging:
-    cropToZone(zoneBB, rasterPaths.at(i), epsgCode);
-    // threads.push_back(std::thread(cropToZone, zoneBB, rasterPaths.at(i),
-    // epsgCode));
+  ScopedStage stage("crop");
+  std::cout << "processing " << rasterPaths.size() << " rasters for "
+            << targets.size() << " areas\n";
+
+  parallelFor(rasterPaths.size(), [&](size_t i) {
+    const auto& info = rasterPaths.at(i);
+    std::cout << i << ". process " + info.absolutePath + "\n";
+    auto source = static_cast<GDALDataset*>(
+      GDALOpen(info.absolutePath.c_str(), GA_ReadOnly));
+    if (source == nullptr) {
+      std::cout << "Could not open " + info.absolutePath + "\n";
+      return;
+    }
+    for (const auto& target : targets) {
+      cropDatasetToZone(source,
+                        target.zone,
+                        epsgCode,
+                        target.croppedDirectory + "/resampled__" +
+                          polToString(info.pol) + "_" + info.date);
+    }
+    GDALClose(source);
+  });
+  for (const auto& target : targets) {
+    stage.addBytesWritten(getDirectorySize(target.croppedDirectory));
   }
+}
 
-  for (auto& th : threads) {
-    th.join();
+// get imagery projection info as authority code, e.g. EPSG:32630.
+// Empty when the projection can not be identified.
+inline std::string
+getRasterCrs(GDALDataset* raster)
+{
+  const char* wkt = raster->GetProjectionRef();
+  if (wkt == nullptr || wkt[0] == '\0') {
+    return "";
   }
+  OGRSpatialReference srs;
+  if (srs.importFromWkt(wkt) != OGRERR_NONE) {
+    return "";
+  }
+  srs.AutoIdentifyEPSG();
+  const char* authority = srs.GetAuthorityName(nullptr);
+  const char* code = srs.GetAuthorityCode(nullptr);
+  if (authority == nullptr || code == nullptr) {
+    return "";
+  }
+  return std::string(authority) + ":" + code;
 }
 
-//get imagery projection info
-void
-getProjectionInfo(std::string rasterPath, std::string proj4filePath)
+inline std::string
+getRasterCrs(const std::string& rasterPath)
 {
-  std::string command = "gdalsrsinfo";
-
-  command.append(" --single-line -o epsg ");
-  command.append(rasterPath);
-  command.append(" >" + proj4filePath);
-
-  std::system(command.c_str());
+  auto raster =
+    static_cast<GDALDataset*>(GDALOpen(rasterPath.c_str(), GA_ReadOnly));
+  if (raster == nullptr) {
+    std::cout << "Could not open " << rasterPath << "\n";
+    return "";
+  }
+  auto crs = getRasterCrs(raster);
+  GDALClose(raster);
+  return crs;
 }
 
-void
-printProjCrs(RasterInfo info)
+// whether the file looks like SAR imagery we can use
+inline bool
+isCandidateRaster(const fs::path& filepath, const std::string& fileExtension)
 {
-  std::string command = "gdalsrsinfo";
-  command.append(" --single-line -o epsg");
-  command.append(" ");
-  command.append(info.absolutePath);
-
-  std::system(command.c_str());
+  if (filepath.extension().string() != fileExtension) {
+    // skip if extension does not match
+    return false;
+  }
+  auto name = filepath.filename().string();
+  // skip if filename does not contain "VV" or "VH" substring
+  return name.find("VV") != std::string::npos ||
+         name.find("VH") != std::string::npos;
 }
 
 // returns absolute paths to all images that will take part in calculating the result...
-std::vector<RasterInfo>
+inline std::vector<RasterInfo>
 readRasterDirectory(std::string dirname,
                     std::string fileExtension,
                     RasterInfoExtractor* extractor)
 {
+  ScopedStage stage("scan");
   std::vector<RasterInfo> infos;
 
   std::cout << "Scanning directory: " << dirname << " for " << fileExtension
             << " images..." << std::endl;
   for (auto& p : fs::recursive_directory_iterator(dirname)) {
     auto filepath = p.path();
-
-    auto ext = filepath.extension().string();
-    if (ext != fileExtension) {
-      // skip if extension does not match
-      continue;
-    }
-
-    auto name = filepath.filename().string();
-    if (name.find("VV") == std::string::npos &&
-        name.find("VH") == std::string::npos) {
-      // skip if filename does not contain "VV" or "VH" substring
-      continue;
+    if (isCandidateRaster(filepath, fileExtension)) {
+      infos.push_back(extractor->extractFromPath(filepath.string()));
     }
-
-    std::string proj4Path = ".floodsar-cache/proj4/" + name + "_proj4";
-    // std::cout << "proj4Path " << proj4Path << "\n";
-    // std::cout << "Getting projection info for " + filepath.string();
-    getProjectionInfo(filepath.string(), proj4Path);
-
-    std::ifstream proj4file(proj4Path);
-
-    RasterInfo extractedInfo = extractor->extractFromPath(filepath.string());
-
-    std::getline(proj4file, extractedInfo.proj4);
-    // std::cout << polToString(extractedInfo.pol)+"\n";
-    // std::cout << extractedInfo.date+"\n";
-    // std::cout << extractedInfo.proj4+"\n";
-    // std::cout << "\n";
-    infos.push_back(extractedInfo);
   }
 
+  // projection is read in-process, only the raster header is touched
+  parallelFor(infos.size(), [&](size_t i) {
+    infos[i].proj4 = getRasterCrs(infos[i].absolutePath);
+  });
+
   return infos;
 }
 
-void
+inline void
 mosaicRasters(const std::string targetPath,
               const std::vector<std::string>& rasterList)
 {
@@ -205,10 +251,12 @@ mosaicRasters(const std::string targetPath,
 }
 
 //if two rasters with the same are present then mosaicing is performed...
-void
+inline void
 performMosaicking(std::vector<RasterInfo>& rasterInfos,
-                  std::vector<RasterInfo>& outputVector)
+                  std::vector<RasterInfo>& outputVector,
+                  const std::string& epsgCode = "")
 {
+  ScopedStage stage("mosaic");
   std::map<std::string, std::vector<RasterInfo>> rastersMap;
 
   std::vector<std::thread> threads;
@@ -234,7 +282,8 @@ performMosaicking(std::vector<RasterInfo>& rasterInfos,
         pathsOnly.push_back(info.absolutePath);
       }
 
-      std::string targetPath = "./.floodsar-cache/vrt/" + key + ".vrt";
+      std::string targetPath = "./.floodsar-cache/vrt/" + key +
+                               toFileNameToken(epsgCode) + ".vrt";
 
       // there is more, probably two. Need to mosaic them.
       threads.push_back(std::thread(mosaicRasters, targetPath, pathsOnly));
@@ -249,12 +298,14 @@ performMosaicking(std::vector<RasterInfo>& rasterInfos,
 }
 
 //prefrom reprojection using GDAL (gdalwarp) 
-std::string
+inline std::string
 performReprojection(RasterInfo& info, std::string epsgCode)
 {
+  TraceScope trace(traceName("warp ", polToString(info.pol) + "_" + info.date));
   std::string command = "gdalwarp";
   std::string filename = ".floodsar-cache/reprojected/repd_" +
-                         polToString(info.pol) + "_" + info.date;
+                         polToString(info.pol) + "_" + info.date +
+                         toFileNameToken(epsgCode);
   // reading cache data prevents some chages
   /*
   if (fs::exists(filename)) {
@@ -272,9 +323,10 @@ performReprojection(RasterInfo& info, std::string epsgCode)
   return filename;
 }
 //in case of different projection of a raster file..
-void
+inline void
 reprojectIfNeeded(std::vector<RasterInfo>& rasters, std::string epsgCode)
 {
+  ScopedStage stage("reproject");
   int reprojectedCount = 0;
   int skippedCount = 0;
   for (auto& it : rasters) {
@@ -283,7 +335,9 @@ reprojectIfNeeded(std::vector<RasterInfo>& rasters, std::string epsgCode)
     if (epsgCode != it.proj4) {
       // needs reprojection.
       std::cout << "... yes\n";
+      stage.addBytesRead(getFileSize(it.absolutePath));
       auto newPath = performReprojection(it, epsgCode);
+      stage.addBytesWritten(getFileSize(newPath));
       std::cout << "reprojection for " << it.absolutePath << " now is "
                 << newPath + "\n";
       reprojectedCount++;
@@ -300,85 +354,207 @@ reprojectIfNeeded(std::vector<RasterInfo>& rasters, std::string epsgCode)
             << " images, skipped " << skippedCount << " images\n";
 }
 
-void
-getPixelValuesFromRaster(GDALDataset* raster,
-                         std::vector<double>& pixelValuesVector)
+/*
+* Reads rows [firstRow, firstRow + rows) of the first band, row after row,
+* and appends them to pixelValuesVector. With a speckle filter set (see
+* speckle.hpp) the rows are filtered as part of the read; the rows around
+* them the window needs are read too, so strips match a whole-image read.
+*/
+inline bool
+getPixelValuesFromRasterRows(GDALDataset* raster,
+                             int firstRow,
+                             int rows,
+                             std::vector<double>& pixelValuesVector)
 {
+  TraceScope trace("RasterIO read");
   auto rasterBand = raster->GetRasterBand(1);
 
-  const unsigned int xSize = rasterBand->GetXSize();
-  const unsigned int ySize = rasterBand->GetYSize();
-  const unsigned int words = xSize * ySize;
-  double* buffer = static_cast<double*>(CPLMalloc(sizeof(double) * words));
-  auto error = rasterBand->RasterIO(
-    GF_Read, 0, 0, xSize, ySize, buffer, xSize, ySize, GDT_Float64, 0, 0);
+  const int xSize = rasterBand->GetXSize();
+  const SpeckleFilter& filter = speckleFilter();
+  const int haloTop = std::min(filter.halo(), firstRow);
+  const int haloBottom = std::clamp(
+    rasterBand->GetYSize() - firstRow - rows, 0, filter.halo());
+  const int readRows = haloTop + rows + haloBottom;
+
+  // size_t: whole large AOIs overflow 32 bits
+  const size_t words = static_cast<size_t>(xSize) * rows;
+  const size_t offset = pixelValuesVector.size();
+  std::vector<double> block;
+  double* target;
+  if (filter.isEnabled()) {
+    block.resize(static_cast<size_t>(xSize) * readRows);
+    target = block.data();
+  } else {
+    pixelValuesVector.resize(offset + words);
+    target = pixelValuesVector.data() + offset;
+  }
+  auto error = rasterBand->RasterIO(GF_Read,
+                                    0,
+                                    firstRow - haloTop,
+                                    xSize,
+                                    readRows,
+                                    target,
+                                    xSize,
+                                    readRows,
+                                    GDT_Float64,
+                                    0,
+                                    0);
 
   if (error == CE_Failure) {
     std::cout << "[getPixelValuesFromRaster] Could not read raster\n";
-  } else {
-    for (int i = 0; i < words; i++) {
-      pixelValuesVector.push_back(buffer[i]);
-    }
+    pixelValuesVector.resize(offset);
+    return false;
   }
+  if (filter.isEnabled()) {
+    applySpeckleFilter(block, xSize, readRows, filter);
+    const auto first = block.begin() + static_cast<size_t>(haloTop) * xSize;
+    pixelValuesVector.insert(pixelValuesVector.end(), first, first + words);
+  }
+  return true;
+}
 
-  CPLFree(buffer);
+inline void
+getPixelValuesFromRaster(GDALDataset* raster,
+                         std::vector<double>& pixelValuesVector)
+{
+  getPixelValuesFromRasterRows(
+    raster, 0, raster->GetRasterYSize(), pixelValuesVector);
 }
 
-// Method to calculae flooder area basing on threshold in 1D algorithm
-unsigned int
-calcFloodedArea(GDALDataset* raster, double threshold)
+// size of a grid decimated by factor
+inline int
+getDecimatedSize(int size, int factor)
 {
-  auto rasterBand = raster->GetRasterBand(1);
-  unsigned int floodedArea = 0; // sum of flooded pixels according to threshold;
-  const unsigned int xSize = rasterBand->GetXSize();
-  const unsigned int ySize = rasterBand->GetYSize();
-  const unsigned int words = xSize * ySize;
-  double* buffer = static_cast<double*>(CPLMalloc(sizeof(double) * words));
-  auto error = rasterBand->RasterIO(
-    GF_Read, 0, 0, xSize, ySize, buffer, xSize, ySize, GDT_Float64, 0, 0);
+  return std::max(1, size / std::max(1, factor));
+}
 
-  if (error == CE_Failure) {
-    std::cout << "Could not read raster";
-    return 0;
+// coarse rows averaged from one filtered read
+const int decimatedRowsPerRead = 64;
+
+/*
+* Decimated read with a speckle filter: full-resolution rows are read
+* filtered (see getPixelValuesFromRasterRows), a batch of coarse rows at a
+* time, and averaged in blocks, so the coarse stage sees the same filter as
+* the full-resolution one. NaN pixels are left out of the averages.
+*/
+inline bool
+getFilteredDecimatedPixelValues(GDALDataset* raster,
+                                int coarseX,
+                                int coarseY,
+                                std::vector<double>& pixelValuesVector)
+{
+  const int xSize = raster->GetRasterXSize();
+  const int ySize = raster->GetRasterYSize();
+  // first full-resolution row of a coarse row
+  auto blockRow = [&](int coarseRow) {
+    return static_cast<int>(static_cast<int64_t>(coarseRow) * ySize / coarseY);
+  };
+  std::vector<int> blockColumn(xSize);
+  for (int x = 0; x < xSize; x++) {
+    blockColumn[x] = static_cast<int>(static_cast<int64_t>(x) * coarseX / xSize);
   }
 
-  for (int i = 0; i < words; i++) {
-    if (buffer[i] < threshold) {
-      ++floodedArea;
+  const size_t offset = pixelValuesVector.size();
+  std::vector<double> rows;
+  std::vector<double> sums(coarseX);
+  std::vector<size_t> counts(coarseX);
+  for (int firstCoarse = 0; firstCoarse < coarseY;
+       firstCoarse += decimatedRowsPerRead) {
+    const int endCoarse = std::min(coarseY, firstCoarse + decimatedRowsPerRead);
+    const int firstRow = blockRow(firstCoarse);
+    rows.clear();
+    if (!getPixelValuesFromRasterRows(
+          raster, firstRow, blockRow(endCoarse) - firstRow, rows)) {
+      pixelValuesVector.resize(offset);
+      return false;
+    }
+    for (int coarseRow = firstCoarse; coarseRow < endCoarse; coarseRow++) {
+      std::fill(sums.begin(), sums.end(), 0.0);
+      std::fill(counts.begin(), counts.end(), 0);
+      for (int y = blockRow(coarseRow); y < blockRow(coarseRow + 1); y++) {
+        const double* row = rows.data() + static_cast<size_t>(y - firstRow) * xSize;
+        for (int x = 0; x < xSize; x++) {
+          if (!std::isnan(row[x])) {
+            sums[blockColumn[x]] += row[x];
+            counts[blockColumn[x]]++;
+          }
+        }
+      }
+      for (int c = 0; c < coarseX; c++) {
+        pixelValuesVector.push_back(counts[c] > 0
+                                      ? sums[c] / counts[c]
+                                      : std::numeric_limits<double>::quiet_NaN());
+      }
     }
   }
-
-  CPLFree(buffer);
-
-  return floodedArea;
+  return true;
 }
 
-void
-writeThresholdingResultsToFile(GDALDataset* raster,
-                               double threshold,
-                               std::ofstream& ofs)
+/*
+* Reads the first band decimated by factor, every value is the average of
+* a block of about factor x factor pixels. Values are appended. With a
+* speckle filter set the image is filtered before it is averaged.
+*/
+inline bool
+getDecimatedPixelValues(GDALDataset* raster,
+                        int factor,
+                        std::vector<double>& pixelValuesVector)
 {
+  TraceScope trace("RasterIO decimated read");
   auto rasterBand = raster->GetRasterBand(1);
-  const unsigned int xSize = rasterBand->GetXSize();
-  const unsigned int ySize = rasterBand->GetYSize();
-  const unsigned int words = xSize * ySize;
-  double* buffer = static_cast<double*>(CPLMalloc(sizeof(double) * words));
-  auto error = rasterBand->RasterIO(
-    GF_Read, 0, 0, xSize, ySize, buffer, xSize, ySize, GDT_Float64, 0, 0);
+  const int xSize = rasterBand->GetXSize();
+  const int ySize = rasterBand->GetYSize();
+  const int coarseX = getDecimatedSize(xSize, factor);
+  const int coarseY = getDecimatedSize(ySize, factor);
+  if (speckleFilter().isEnabled()) {
+    return getFilteredDecimatedPixelValues(
+      raster, coarseX, coarseY, pixelValuesVector);
+  }
 
+  GDALRasterIOExtraArg extraArg;
+  INIT_RASTERIO_EXTRA_ARG(extraArg);
+  extraArg.eResampleAlg = GRIORA_Average;
+
+  const size_t offset = pixelValuesVector.size();
+  pixelValuesVector.resize(offset + static_cast<size_t>(coarseX) * coarseY);
+  auto error = rasterBand->RasterIO(GF_Read,
+                                    0,
+                                    0,
+                                    xSize,
+                                    ySize,
+                                    pixelValuesVector.data() + offset,
+                                    coarseX,
+                                    coarseY,
+                                    GDT_Float64,
+                                    0,
+                                    0,
+                                    &extraArg);
   if (error == CE_Failure) {
-    std::cout << "Could not read raster";
+    std::cout << "[getDecimatedPixelValues] Could not read raster\n";
+    pixelValuesVector.resize(offset);
+    return false;
   }
+  return true;
+}
 
-  for (int i = 0; i < words; i++) {
-    if (buffer[i] < threshold) {
-      ofs << "1"
-          << "\n";
-    } else {
-      ofs << "0"
-          << "\n";
-    }
+// Method to calculae flooder area basing on threshold in 1D algorithm
+inline unsigned int
+calcFloodedArea(const std::vector<double>& pixelValues, double threshold)
+{
+  unsigned int floodedArea = 0; // sum of flooded pixels according to threshold;
+  for (double value : pixelValues) {
+    floodedArea += value < threshold ? 1 : 0;
   }
+  return floodedArea;
+}
 
-  CPLFree(buffer);
+// appends labels of one date: 1 below threshold (flooded), 0 otherwise
+inline void
+getThresholdingLabels(const std::vector<double>& pixelValues,
+                      double threshold,
+                      std::vector<unsigned char>& labels)
+{
+  for (double value : pixelValues) {
+    labels.push_back(value < threshold ? 1 : 0);
+  }
 }
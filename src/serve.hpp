@@ -0,0 +1,721 @@
+#pragma once
+
+#include "analysis.hpp"
+#include "aoi.hpp"
+#include "calibration.hpp"
+#include "clustering.hpp"
+#include "floodsar.hpp"
+#include "labels.hpp"
+#include "maps.hpp"
+#include "memory.hpp"
+#include "utils.hpp"
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+/*
+*
+* Resident mode (floodsar --serve): the image stacks of the cache are read
+* once and kept in memory together with sorted copies for the 1D algorithm
+* and every k-means clustering computed so far (centroids and per-date label
+* counts). Calibration and mapping requests come over a Unix domain socket,
+* one JSON object per line, each answered by one JSON line, e.g.
+*   {"cmd":"calibrate","algorithm":"2D","n":[2,6],"strategy":"sum"}
+*   {"ok":true,"classes":4,"flood_classes":2,"correlation":0.93,"ms":3.1}
+* A change of strategy or of the range of k only re-scores cached
+* clusterings; a threshold range is scored by binary search per date.
+*
+*/
+
+const std::string serveSocketPath = ".floodsar-cache/floodsar.sock";
+// longer lines are not requests
+const size_t serveMaxRequestBytes = 1 << 20;
+// a connection without a request for this long is closed
+const int serveClientTimeoutSeconds = 60;
+
+/*
+* Parses a flat JSON object: values are strings, numbers, true/false or
+* arrays of those. Array elements are joined with commas, like values of the
+* command line options.
+*/
+inline bool
+parseJsonRequest(const std::string& line,
+                 std::map<std::string, std::string>& fields)
+{
+  size_t pos = 0;
+  auto skipSpace = [&]() {
+    while (pos < line.size() && std::isspace(static_cast<unsigned char>(line[pos]))) {
+      pos++;
+    }
+  };
+  auto parseString = [&](std::string& out) {
+    if (pos >= line.size() || line[pos] != '"') {
+      return false;
+    }
+    for (pos++; pos < line.size() && line[pos] != '"'; pos++) {
+      if (line[pos] == '\\' && pos + 1 < line.size()) {
+        pos++;
+      }
+      out.push_back(line[pos]);
+    }
+    return pos++ < line.size();
+  };
+  auto parseScalar = [&](std::string& out) {
+    skipSpace();
+    if (pos < line.size() && line[pos] == '"') {
+      return parseString(out);
+    }
+    while (pos < line.size() && line[pos] != ',' && line[pos] != '}' &&
+           line[pos] != ']' && !std::isspace(static_cast<unsigned char>(line[pos]))) {
+      out.push_back(line[pos++]);
+    }
+    return !out.empty();
+  };
+
+  skipSpace();
+  if (pos >= line.size() || line[pos++] != '{') {
+    return false;
+  }
+  skipSpace();
+  if (pos < line.size() && line[pos] == '}') {
+    return true;
+  }
+  while (pos < line.size()) {
+    std::string key;
+    std::string value;
+    skipSpace();
+    if (!parseString(key)) {
+      return false;
+    }
+    skipSpace();
+    if (pos >= line.size() || line[pos++] != ':') {
+      return false;
+    }
+    skipSpace();
+    if (pos < line.size() && line[pos] == '[') {
+      pos++;
+      skipSpace();
+      while (pos < line.size() && line[pos] != ']') {
+        std::string element;
+        if (!parseScalar(element)) {
+          return false;
+        }
+        value += (value.empty() ? "" : ",") + element;
+        skipSpace();
+        if (pos < line.size() && line[pos] == ',') {
+          pos++;
+        }
+      }
+      if (pos++ >= line.size()) {
+        return false;
+      }
+    } else if (!parseScalar(value)) {
+      return false;
+    }
+    fields[key] = value;
+    skipSpace();
+    if (pos < line.size() && line[pos] == ',') {
+      pos++;
+    } else if (pos < line.size() && line[pos] == '}') {
+      return true;
+    } else {
+      return false;
+    }
+  }
+  return false;
+}
+
+inline std::string
+toJsonString(const std::string& value)
+{
+  std::string out = "\"";
+  for (char c : value) {
+    if (c == '"' || c == '\\') {
+      out.push_back('\\');
+    }
+    out.push_back(c == '\n' ? ' ' : c);
+  }
+  return out + "\"";
+}
+
+inline std::vector<std::string>
+splitList(const std::string& value)
+{
+  std::vector<std::string> items;
+  std::stringstream ss(value);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    items.push_back(item);
+  }
+  return items;
+}
+
+/*
+* State kept between requests. Requests are handled one at a time.
+*/
+class FloodsarServer
+{
+public:
+  explicit FloodsarServer(const AnalysisConfig& config)
+    : m_config(config)
+  {
+  }
+
+  bool isStopped() const { return m_stopped; }
+
+  // stacks of the algorithm of the command line are read before the first
+  // request, so even that one is warm
+  void preload()
+  {
+    if (m_config.isSinglePolVersion) {
+      singlePolStack("VH");
+      singlePolStack("VV");
+    } else {
+      dualPolStack();
+    }
+  }
+
+  // one request line in, one response line out
+  std::string handle(const std::string& line)
+  {
+    const auto start = std::chrono::steady_clock::now();
+    std::map<std::string, std::string> request;
+    std::stringstream response;
+    response << std::setprecision(10) << "{\"ok\":";
+    try {
+      if (!parseJsonRequest(line, request)) {
+        throw std::runtime_error("malformed request, expected a JSON object");
+      }
+      const std::string cmd = request["cmd"];
+      std::stringstream body;
+      body << std::setprecision(10);
+      if (cmd == "calibrate") {
+        calibrate(request, body);
+      } else if (cmd == "map") {
+        map(request, body);
+      } else if (cmd == "status") {
+        status(body);
+      } else if (cmd == "drop") {
+        m_clusterings.clear();
+        m_kmeansInputKey.clear();
+        m_kmeansInput = floodsar::KMeansInput();
+      } else if (cmd == "shutdown") {
+        m_stopped = true;
+      } else {
+        throw std::runtime_error("unknown cmd: " + cmd);
+      }
+      response << "true" << body.str();
+    } catch (const std::exception& e) {
+      response << "false,\"error\":" << toJsonString(e.what());
+    }
+    response << ",\"ms\":"
+             << std::chrono::duration<double, std::milli>(
+                  std::chrono::steady_clock::now() - start)
+                  .count()
+             << "}";
+    return response.str();
+  }
+
+private:
+  // stack of one polarization for the 1D algorithm and its sorted copy
+  class SinglePolStack
+  {
+  public:
+    floodsar::ImageStack stack;
+    std::vector<std::vector<double>> sorted;
+  };
+
+  SinglePolStack& singlePolStack(const std::string& polarization)
+  {
+    const floodsar::Polarization pol = toPolarization(polarization);
+    auto found = m_singlePol.find(polarization);
+    if (found != m_singlePol.end()) {
+      return found->second;
+    }
+    ScopedStage stage("serve load " + polarization);
+    SinglePolStack& resident = m_singlePol[polarization];
+    resident.stack =
+      floodsar::loadCachedImageStack(m_config.hydroDataCsvFile, false, pol);
+    resident.sorted = sortPixelStack(resident.stack.images(pol));
+    trackResidentMemory();
+    std::cout << "Resident " << polarization << " stack: "
+              << resident.stack.numDates() << " dates\n";
+    return resident;
+  }
+
+  floodsar::ImageStack& dualPolStack()
+  {
+    if (!m_dualPolLoaded) {
+      ScopedStage stage("serve load VH+VV");
+      m_dualPol = floodsar::loadCachedImageStack(m_config.hydroDataCsvFile, true);
+      m_dualPolLoaded = true;
+      trackResidentMemory();
+      std::cout << "Resident VH+VV stack: " << m_dualPol.numDates()
+                << " pairs\n";
+    }
+    return m_dualPol;
+  }
+
+  static floodsar::Polarization toPolarization(const std::string& polarization)
+  {
+    if (polarization == "VH") {
+      return floodsar::Polarization::VH;
+    }
+    if (polarization == "VV") {
+      return floodsar::Polarization::VV;
+    }
+    throw std::runtime_error("unknown polarization: " + polarization);
+  }
+
+  void trackResidentMemory()
+  {
+    size_t bytes = getVectorBytes(m_dualPol.vh) + getVectorBytes(m_dualPol.vv) +
+                   getVectorBytes(m_kmeansInput.vh) +
+                   getVectorBytes(m_kmeansInput.vv);
+    for (const auto& [polarization, resident] : m_singlePol) {
+      bytes += getVectorBytes(resident.stack.vh) +
+               getVectorBytes(resident.stack.vv) + getVectorBytes(resident.sorted);
+    }
+    memoryTracker().set("resident stacks", bytes);
+  }
+
+  bool isDualPol(std::map<std::string, std::string>& request) const
+  {
+    const std::string algorithm = request["algorithm"];
+    if (algorithm.empty()) {
+      return !m_config.isSinglePolVersion;
+    }
+    if (algorithm != "1D" && algorithm != "2D") {
+      throw std::runtime_error("unknown algorithm: " + algorithm);
+    }
+    return algorithm == "2D";
+  }
+
+  std::vector<std::string> range(std::map<std::string, std::string>& request) const
+  {
+    const auto values =
+      request.count("n") ? splitList(request["n"]) : m_config.thresholdSequence;
+    if (values.size() < 2) {
+      throw std::runtime_error("search space not provided, use \"n\"");
+    }
+    return values;
+  }
+
+  // polarizations of a 1D request, both by default like the command line
+  static std::vector<std::string> polarizations(
+    std::map<std::string, std::string>& request)
+  {
+    if (request.count("pol")) {
+      return { request["pol"] };
+    }
+    return { "VH", "VV" };
+  }
+
+  floodsar::KMeansOptions kmeansOptions(
+    std::map<std::string, std::string>& request) const
+  {
+    floodsar::KMeansOptions options;
+    const auto n = range(request);
+    options.minClasses = std::stoi(n[0]);
+    options.maxClasses = std::stoi(n[1]);
+    if (options.maxClasses > kmeansMaximumClasses) {
+      throw std::runtime_error("too many classes for k-means");
+    }
+    options.strategy =
+      request.count("strategy") ? request["strategy"] : m_config.strategy;
+    options.maxiter = request.count("maxiter") ? std::stoi(request["maxiter"])
+                                               : m_config.maxiter;
+    options.fraction = request.count("fraction") ? std::stod(request["fraction"])
+                                                 : m_config.fraction;
+    if (options.fraction <= 0 || options.fraction > 1.0) {
+      throw std::runtime_error("fraction of pixels is not in (0.0, 1.0>");
+    }
+    const auto maxValue = request.count("maxValue") ? splitList(request["maxValue"])
+                                                    : m_config.maxValue;
+    if (!maxValue.empty() && maxValue[0] != "none") {
+      for (const auto& value : maxValue) {
+        options.maxValue.push_back(std::stod(value));
+      }
+    }
+    options.convToDB = request.count("convToDB")
+                         ? request["convToDB"] == "true"
+                         : m_config.convToDB;
+    options.seed = request.count("seed") ? std::stoul(request["seed"])
+                                         : m_config.seed;
+    options.kPatience = m_config.kPatience;
+    options.kMargin = m_config.kMargin;
+    return options;
+  }
+
+  void calibrate(std::map<std::string, std::string>& request,
+                 std::stringstream& body)
+  {
+    if (isDualPol(request)) {
+      calibrateKMeans(request, body);
+      return;
+    }
+
+    const auto n = range(request);
+    const std::string search =
+      request.count("search") ? request["search"] : m_config.thresholdSearch;
+    const double start = std::stod(n[0]);
+    const double end = std::stod(n[1]);
+    const double step = n.size() > 2 ? std::stod(n[2]) : 0.001;
+    body << ",\"results\":[";
+    bool first = true;
+    for (const auto& polarization : polarizations(request)) {
+      auto& resident = singlePolStack(polarization);
+      std::vector<double> elevations = resident.stack.elevations;
+      ThresholdScorer scorer = [&](const std::vector<double>& batch) {
+        return scoreThresholdsOnSortedStack(resident.sorted, batch, elevations);
+      };
+      const ThresholdSearchResult result =
+        search == "refine" ? refineThresholdSearch(start, end, step, scorer)
+                           : exhaustiveThresholdSearch(start, end, step, scorer);
+
+      // first of the best, like the command line
+      floodsar::ThresholdResult best;
+      best.pol = toPolarization(polarization);
+      if (!result.thresholds.empty()) {
+        best.threshold = result.thresholds[0];
+      }
+      for (size_t i = 0; i < result.correlations.size(); i++) {
+        if (best.correlation < result.correlations[i]) {
+          best.correlation = result.correlations[i];
+          best.threshold = result.thresholds[i];
+        }
+      }
+      m_thresholds[polarization] = best;
+      body << (first ? "" : ",") << "{\"pol\":\"" << polarization
+           << "\",\"dates\":" << resident.stack.numDates()
+           << ",\"threshold\":" << best.threshold
+           << ",\"correlation\":" << best.correlation
+           << ",\"evaluated\":" << result.thresholds.size() << "}";
+      first = false;
+    }
+    body << "]";
+  }
+
+  void calibrateKMeans(std::map<std::string, std::string>& request,
+                       std::stringstream& body)
+  {
+    const floodsar::ImageStack& stack = dualPolStack();
+    if (stack.numDates() == 0) {
+      throw std::runtime_error("no VH and VV pairs matched with gauge data");
+    }
+    const floodsar::KMeansOptions options = kmeansOptions(request);
+    const std::string inputKey =
+      request["maxValue"] + "|" + std::to_string(options.convToDB);
+    if (inputKey != m_kmeansInputKey) {
+      m_kmeansInput = floodsar::createKMeansInput(stack, options);
+      m_kmeansInputKey = inputKey;
+      trackResidentMemory();
+    }
+
+    floodsar::KMeansResult best;
+    int clustered = 0;
+    int kWithoutImprovement = 0;
+    for (int cl = std::max(options.minClasses, 2); cl <= options.maxClasses;
+         cl++) {
+      // everything the centroids depend on
+      std::stringstream key;
+      key << inputKey << "|" << options.fraction << "|" << options.maxiter
+          << "|" << options.seed << "|" << cl;
+      auto cached = m_clusterings.find(key.str());
+      if (cached == m_clusterings.end()) {
+        cached = m_clusterings
+                   .emplace(key.str(),
+                            floodsar::clusterKMeans(m_kmeansInput, cl, options))
+                   .first;
+        clustered++;
+      }
+      floodsar::KMeansResult ofK =
+        floodsar::scoreClustering(cached->second, stack.elevations, options.strategy);
+      const double correlationOfK = ofK.correlation;
+      const bool improved = correlationOfK > best.correlation;
+      if (improved) {
+        best = std::move(ofK);
+      }
+      kWithoutImprovement = improved ? 0 : kWithoutImprovement + 1;
+      if (options.kPatience > 0 && kWithoutImprovement >= options.kPatience) {
+        break;
+      }
+      if (options.kMargin > 0 &&
+          correlationOfK < best.correlation - options.kMargin) {
+        break;
+      }
+    }
+    m_kmeans = best;
+    m_kmeansKey = inputKey;
+    body << ",\"dates\":" << stack.numDates() << ",\"classes\":" << best.classes
+         << ",\"flood_classes\":" << best.floodClassesNum
+         << ",\"correlation\":" << best.correlation
+         << ",\"clustered\":" << clustered;
+  }
+
+  // maps of the last calibration, where the command line would put them
+  void map(std::map<std::string, std::string>& request, std::stringstream& body)
+  {
+    const bool dualPol = isDualPol(request);
+    std::vector<std::string> directories;
+    if (dualPol) {
+      if (m_kmeans.classes == 0 || m_kmeansKey != m_kmeansInputKey) {
+        throw std::runtime_error("calibrate 2D before mapping");
+      }
+      const auto& stack = dualPolStack();
+      std::vector<unsigned char> labels(m_kmeansInput.vh.size());
+      labelPixels(m_kmeansInput.vh.data(),
+                  m_kmeansInput.vv.data(),
+                  labels.size(),
+                  m_kmeans.centroidsVH,
+                  m_kmeans.centroidsVV,
+                  labels.data());
+      directories.push_back(
+        mapDirectory(request,
+                     "./mapped/" + std::to_string(m_kmeans.classes) + "__" +
+                       std::to_string(m_kmeans.floodClassesNum) + "/"));
+      writeMaps(directories.back(), stack, labels, createFloodLookup(m_kmeans.floodClasses));
+    } else {
+      for (const auto& polarization : polarizations(request)) {
+        auto found = m_thresholds.find(polarization);
+        if (found == m_thresholds.end()) {
+          throw std::runtime_error("calibrate 1D " + polarization +
+                                   " before mapping");
+        }
+        const auto& stack = singlePolStack(polarization).stack;
+        std::vector<unsigned char> labels;
+        for (const auto& pixelValues : stack.images(found->second.pol)) {
+          getThresholdingLabels(pixelValues, found->second.threshold, labels);
+        }
+        directories.push_back(
+          mapDirectory(request,
+                       "./mapped/base_algo_pol_" + polarization + "/",
+                       request.count("pol") ? "" : "_" + polarization));
+        writeMaps(directories.back(), stack, labels, createFloodLookup({ 1 }));
+      }
+    }
+    body << ",\"directories\":[";
+    for (size_t i = 0; i < directories.size(); i++) {
+      body << (i ? "," : "") << toJsonString(directories[i]);
+    }
+    body << "]";
+  }
+
+  // "output" overrides the directory, suffixed when several are written
+  static std::string mapDirectory(std::map<std::string, std::string>& request,
+                                  const std::string& defaultDirectory,
+                                  const std::string& suffix = "")
+  {
+    if (!request.count("output")) {
+      return defaultDirectory;
+    }
+    const std::string directory = request["output"] + suffix;
+    return directory.back() == '/' ? directory : directory + "/";
+  }
+
+  void writeMaps(const std::string& directory,
+                 const floodsar::ImageStack& stack,
+                 const std::vector<unsigned char>& labels,
+                 const FloodLookup& lookup)
+  {
+    GridInfo grid;
+    grid.xSize = stack.grid.xSize;
+    grid.ySize = stack.grid.ySize;
+    std::copy(stack.grid.geoTransform, stack.grid.geoTransform + 6, grid.geoTransform);
+    grid.projection = stack.grid.projection;
+    AoiMask aoiMask;
+    aoiMask.gridWords = stack.grid.pixels();
+    aoiMask.masked = stack.masked;
+    aoiMask.validPixels = stack.validPixels;
+    writeFloodMaps(
+      directory, grid, stack.dates, labels.data(), lookup, m_config.mapOptions, aoiMask);
+  }
+
+  void status(std::stringstream& body)
+  {
+    body << ",\"stacks\":[";
+    bool first = true;
+    for (const auto& [polarization, resident] : m_singlePol) {
+      body << (first ? "" : ",") << "{\"name\":\"" << polarization
+           << "\",\"dates\":" << resident.stack.numDates()
+           << ",\"pixels_per_date\":" << resident.stack.pixelsPerDate() << "}";
+      first = false;
+    }
+    if (m_dualPolLoaded) {
+      body << (first ? "" : ",") << "{\"name\":\"VH+VV\",\"dates\":"
+           << m_dualPol.numDates()
+           << ",\"pixels_per_date\":" << m_dualPol.pixelsPerDate() << "}";
+    }
+    body << "],\"clusterings\":" << m_clusterings.size()
+         << ",\"resident_bytes\":" << memoryTracker().total()
+         << ",\"peak_rss_bytes\":" << getPeakRss();
+  }
+
+  AnalysisConfig m_config;
+  bool m_stopped = false;
+  std::map<std::string, SinglePolStack> m_singlePol;
+  floodsar::ImageStack m_dualPol;
+  bool m_dualPolLoaded = false;
+  // k-means input of the last clipping and dB conversion
+  floodsar::KMeansInput m_kmeansInput;
+  std::string m_kmeansInputKey;
+  // by input, fraction, maxiter, seed and k
+  std::map<std::string, floodsar::Clustering> m_clusterings;
+  // last calibrations, for map requests
+  std::map<std::string, floodsar::ThresholdResult> m_thresholds;
+  floodsar::KMeansResult m_kmeans;
+  std::string m_kmeansKey;
+};
+
+inline bool
+sendLine(int client, const std::string& line)
+{
+  const std::string data = line + "\n";
+  size_t sent = 0;
+  while (sent < data.size()) {
+    const ssize_t n =
+      send(client, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    sent += n;
+  }
+  return true;
+}
+
+/*
+* Requests of one connection until it is closed, stays idle for
+* serveClientTimeoutSeconds or the server stops. Clients are served one
+* after another, so a client that neither sends nor closes must not keep
+* the others waiting.
+*/
+inline void
+serveClient(int client, FloodsarServer& server)
+{
+  timeval timeout{};
+  timeout.tv_sec = serveClientTimeoutSeconds;
+  setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  std::string buffer;
+  char chunk[4096];
+  while (!server.isStopped()) {
+    const ssize_t n = recv(client, chunk, sizeof(chunk), 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      std::cout << "Client idle for " << serveClientTimeoutSeconds
+                << " s, closing the connection\n";
+      return;
+    }
+    if (n <= 0) {
+      return;
+    }
+    buffer.append(chunk, n);
+    size_t newline;
+    while ((newline = buffer.find('\n')) != std::string::npos) {
+      const std::string line = buffer.substr(0, newline);
+      buffer.erase(0, newline + 1);
+      if (line.find_first_not_of(" \t\r") == std::string::npos) {
+        continue;
+      }
+      if (!sendLine(client, server.handle(line)) || server.isStopped()) {
+        return;
+      }
+    }
+    if (buffer.size() > serveMaxRequestBytes) {
+      sendLine(client, "{\"ok\":false,\"error\":\"request too long\"}");
+      return;
+    }
+  }
+}
+
+/*
+* Serves requests on a Unix domain socket until a shutdown request. Clients
+* are served one after another, e.g. socat - UNIX-CONNECT:<socketPath>
+* @param config holds defaults of requests (the command line options)
+*/
+inline int
+runServer(const std::string& socketPath, const AnalysisConfig& config)
+{
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if (socketPath.size() >= sizeof(address.sun_path)) {
+    std::cout << "Socket path too long: " << socketPath << "\n";
+    return 1;
+  }
+  std::strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+  // a socket left by a server that did not shut down is removed, one a
+  // server still listens on is not
+  std::error_code error;
+  if (fs::is_socket(socketPath, error)) {
+    bool listening = false;
+    bool refused = false;
+    const int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe >= 0) {
+      listening =
+        connect(probe, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+      refused = !listening && errno == ECONNREFUSED;
+      close(probe);
+    }
+    if (refused) {
+      fs::remove(socketPath, error);
+    } else if (listening) {
+      std::cout << "Another server is listening on " << socketPath << "\n";
+      return 1;
+    }
+  }
+
+  const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0 ||
+      bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 ||
+      listen(listener, 8) < 0) {
+    std::cout << "Could not listen on " << socketPath << ": "
+              << std::strerror(errno) << "\n";
+    if (listener >= 0) {
+      close(listener);
+    }
+    return 1;
+  }
+
+  FloodsarServer server(config);
+  server.preload();
+  std::cout << "Serving on " << socketPath << "\n";
+  while (!server.isStopped()) {
+    const int client = accept(listener, nullptr, nullptr);
+    if (client < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      std::cout << "accept failed: " << std::strerror(errno) << "\n";
+      break;
+    }
+    serveClient(client, server);
+    close(client);
+  }
+  close(listener);
+  fs::remove(socketPath, error);
+  std::cout << "Server stopped\n";
+  return 0;
+}
@@ -0,0 +1,375 @@
+#pragma once
+
+#include "trace.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+/*
+*
+* Speckle filters applied to images while they are read (see
+* getPixelValuesFromRasterRows), before thresholding and clustering, so no
+* filtered copy of the crops is ever written:
+* - boxcar: mean of the window,
+* - lee: Lee filter, the pixel is pulled to the window mean the more the
+*   window looks like pure speckle,
+* - refined-lee: Lee filter on the half of the window on the side of the
+*   strongest edge, so edges of water bodies are not blurred.
+* Window statistics are separable sliding sums (along rows, then down the
+* columns), rows are filtered in parallel. NaN pixels are skipped in the
+* statistics and stay NaN. Images are expected in linear power.
+*
+*/
+
+class SpeckleFilter
+{
+public:
+  // none, boxcar, lee or refined-lee
+  std::string type = "none";
+  // odd size of the square window in pixels
+  int window = 5;
+  // equivalent number of looks, sets the speckle level of Lee filters
+  // (Sentinel-1 IW GRD high resolution)
+  double looks = 4.4;
+
+  bool isEnabled() const { return type != "none"; }
+
+  // rows needed above and below a filtered row
+  int halo() const { return isEnabled() ? window / 2 : 0; }
+
+  std::string describe() const
+  {
+    return isEnabled() ? type + " " + std::to_string(window) : "none";
+  }
+};
+
+inline bool
+isSpeckleFilterType(const std::string& type)
+{
+  return type == "none" || type == "boxcar" || type == "lee" ||
+         type == "refined-lee";
+}
+
+// filter applied by all image reads of the process, set from the command line
+inline SpeckleFilter&
+speckleFilter()
+{
+  static SpeckleFilter filter;
+  return filter;
+}
+
+/*
+* Records the filter a calibration was made with, so --update reads new
+* scenes the same way.
+*/
+inline void
+writeSpeckleFilter(const std::string& path, const SpeckleFilter& filter)
+{
+  std::ofstream ofs(path);
+  ofs << std::setprecision(17) << filter.type << " " << filter.window << " "
+      << filter.looks << "\n";
+}
+
+// @return false if no filter was recorded (calibrations made before it was)
+inline bool
+readSpeckleFilter(const std::string& path, SpeckleFilter& filter)
+{
+  std::ifstream ifs(path);
+  SpeckleFilter recorded;
+  if (!(ifs >> recorded.type >> recorded.window >> recorded.looks) ||
+      !isSpeckleFilterType(recorded.type)) {
+    return false;
+  }
+  filter = recorded;
+  return true;
+}
+
+/*
+* Reads new scenes of --update with the filter of the calibration: it is
+* applied when no filter was given, a different one is refused, as labels
+* of the new dates would not be comparable with the calibration.
+* @return false if the filter given differs from the recorded one
+*/
+inline bool
+useCalibrationSpeckleFilter(const std::string& path)
+{
+  SpeckleFilter recorded;
+  if (!readSpeckleFilter(path, recorded)) {
+    std::cout << "No speckle filter recorded in " << path << ", new scenes are read with "
+              << speckleFilter().describe() << "\n";
+    return true;
+  }
+  if (!speckleFilter().isEnabled() && recorded.isEnabled()) {
+    std::cout << "Speckle filter of the calibration: " << recorded.describe() << "\n";
+    speckleFilter() = recorded;
+    return true;
+  }
+  if (speckleFilter().describe() != recorded.describe()) {
+    std::cout << "Speckle filter " << speckleFilter().describe()
+              << " differs from " << recorded.describe()
+              << " of the calibration, run --update with the same --speckle "
+                 "or without it\n";
+    return false;
+  }
+  return true;
+}
+
+// rows of the vertical pass handed to a thread at once
+const size_t speckleRowsPerTask = 64;
+
+/*
+* Mean and variance of valid values in the window x window box around every
+* pixel, boxes clipped at the borders of the block; NaN where the box holds
+* no valid value.
+* @param variance not computed when null
+*/
+inline void
+computeBoxStatistics(const double* values,
+                     int xSize,
+                     int ySize,
+                     int window,
+                     std::vector<double>& mean,
+                     std::vector<double>* variance)
+{
+  const int r = window / 2;
+  const size_t pixels = static_cast<size_t>(xSize) * ySize;
+  std::vector<double> rowCount(pixels);
+  std::vector<double> rowSum(pixels);
+  std::vector<double> rowSumSq(pixels);
+
+  // sliding sums along every row
+  parallelFor(ySize, [&](size_t y) {
+    const double* row = values + y * xSize;
+    double* count = rowCount.data() + y * xSize;
+    double* sum = rowSum.data() + y * xSize;
+    double* sumSq = rowSumSq.data() + y * xSize;
+    double c = 0.0, s = 0.0, q = 0.0;
+    auto slide = [&](int x, double sign) {
+      const bool valid = !std::isnan(row[x]);
+      const double v = valid ? row[x] : 0.0;
+      c += sign * valid;
+      s += sign * v;
+      q += sign * v * v;
+    };
+    for (int x = 0; x < std::min(r, xSize); x++) {
+      slide(x, 1.0);
+    }
+    for (int x = 0; x < xSize; x++) {
+      if (x + r < xSize) {
+        slide(x + r, 1.0);
+      }
+      if (x - r - 1 >= 0) {
+        slide(x - r - 1, -1.0);
+      }
+      count[x] = c;
+      sum[x] = s;
+      sumSq[x] = q;
+    }
+  });
+
+  // sliding sums down the columns: whole rows are added and removed, the
+  // loops over x are contiguous and branch-free, so the compiler vectorizes
+  // them
+  mean.resize(pixels);
+  if (variance) {
+    variance->resize(pixels);
+  }
+  const size_t tasks = (ySize + speckleRowsPerTask - 1) / speckleRowsPerTask;
+  parallelFor(tasks, [&](size_t task) {
+    const int firstRow = task * speckleRowsPerTask;
+    const int lastRow =
+      std::min<int>(ySize, firstRow + speckleRowsPerTask);
+    std::vector<double> c(xSize, 0.0), s(xSize, 0.0), q(xSize, 0.0);
+    double* __restrict cv = c.data();
+    double* __restrict sv = s.data();
+    double* __restrict qv = q.data();
+    auto addRow = [&](int y, double sign) {
+      const size_t offset = static_cast<size_t>(y) * xSize;
+      const double* __restrict count = rowCount.data() + offset;
+      const double* __restrict sum = rowSum.data() + offset;
+      const double* __restrict sumSq = rowSumSq.data() + offset;
+      for (int x = 0; x < xSize; x++) {
+        cv[x] += sign * count[x];
+        sv[x] += sign * sum[x];
+        qv[x] += sign * sumSq[x];
+      }
+    };
+    for (int y = std::max(0, firstRow - r); y < std::min(ySize, firstRow + r); y++) {
+      addRow(y, 1.0);
+    }
+    for (int y = firstRow; y < lastRow; y++) {
+      if (y + r < ySize) {
+        addRow(y + r, 1.0);
+      }
+      // rows above the task were never added
+      if (y > firstRow && y - r - 1 >= 0) {
+        addRow(y - r - 1, -1.0);
+      }
+      double* __restrict m = mean.data() + static_cast<size_t>(y) * xSize;
+      for (int x = 0; x < xSize; x++) {
+        // 0 / 0 = NaN for boxes without valid values
+        m[x] = sv[x] / cv[x];
+      }
+      if (variance) {
+        double* __restrict v = variance->data() + static_cast<size_t>(y) * xSize;
+        for (int x = 0; x < xSize; x++) {
+          // sums slide, rounding may take the variance slightly below 0
+          v[x] = std::max(0.0, qv[x] / cv[x] - m[x] * m[x]);
+        }
+      }
+    }
+  });
+}
+
+/*
+* Lee estimate of a pixel from the statistics of its window:
+* mean + b * (value - mean), b = 1 - speckle / observed variation.
+* @param cu2 is the squared coefficient of variation of speckle, 1 / looks
+*/
+inline double
+leeEstimate(double value, double mean, double variance, double cu2)
+{
+  const double speckleVariance = mean * mean * cu2;
+  const double b = variance > 0.0
+                     ? (variance - speckleVariance) / (variance * (1.0 + cu2))
+                     : 0.0;
+  return mean + std::clamp(b, 0.0, 1.0) * (value - mean);
+}
+
+/*
+* Refined Lee: the window is split into 3 x 3 overlapping sub-windows; the
+* strongest of the vertical, horizontal and two diagonal gradients of their
+* means picks an edge direction, the side of the edge closer to the centre
+* gives the pixels whose statistics are used.
+*/
+inline void
+refinedLeeFilter(std::vector<double>& values,
+                 int xSize,
+                 int ySize,
+                 int window,
+                 double cu2)
+{
+  const int r = window / 2;
+  // smallest odd sub-window covering a third of the window
+  int sub = (window + 2) / 3;
+  sub += sub % 2 == 0;
+  const int stride = std::max(1, (window - sub) / 2);
+  std::vector<double> subMean;
+  computeBoxStatistics(values.data(), xSize, ySize, sub, subMean, nullptr);
+
+  const std::vector<double> input = values;
+  parallelFor(ySize, [&](size_t row) {
+    const int y = static_cast<int>(row);
+    for (int x = 0; x < xSize; x++) {
+      const double value = input[row * xSize + x];
+      if (std::isnan(value)) {
+        continue;
+      }
+      // means of sub-windows, [row][column] from top left
+      double m[3][3];
+      for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+          const int sy = std::clamp(y + (i - 1) * stride, 0, ySize - 1);
+          const int sx = std::clamp(x + (j - 1) * stride, 0, xSize - 1);
+          const double mean = subMean[static_cast<size_t>(sy) * xSize + sx];
+          m[i][j] = std::isnan(mean) ? value : mean;
+        }
+      }
+      // both sides of the edge of every direction
+      const double sides[4][2] = {
+        { m[0][0] + m[1][0] + m[2][0], m[0][2] + m[1][2] + m[2][2] },
+        { m[0][0] + m[0][1] + m[0][2], m[2][0] + m[2][1] + m[2][2] },
+        { m[0][0] + m[0][1] + m[1][0], m[1][2] + m[2][1] + m[2][2] },
+        { m[0][1] + m[0][2] + m[1][2], m[1][0] + m[2][0] + m[2][1] },
+      };
+      int direction = 0;
+      for (int d = 1; d < 4; d++) {
+        if (std::abs(sides[d][1] - sides[d][0]) >
+            std::abs(sides[direction][1] - sides[direction][0])) {
+          direction = d;
+        }
+      }
+      const bool second = std::abs(sides[direction][1] / 3 - m[1][1]) <
+                          std::abs(sides[direction][0] / 3 - m[1][1]);
+
+      double count = 0.0, sum = 0.0, sumSq = 0.0;
+      for (int dy = -r; dy <= r; dy++) {
+        const int py = y + dy;
+        if (py < 0 || py >= ySize) {
+          continue;
+        }
+        for (int dx = -r; dx <= r; dx++) {
+          const int px = x + dx;
+          if (px < 0 || px >= xSize) {
+            continue;
+          }
+          // signed distance from the edge through the centre
+          const int side = direction == 0   ? dx
+                           : direction == 1 ? dy
+                           : direction == 2 ? dx + dy
+                                            : dy - dx;
+          if (second ? side < 0 : side > 0) {
+            continue;
+          }
+          const double v = input[static_cast<size_t>(py) * xSize + px];
+          if (!std::isnan(v)) {
+            count += 1.0;
+            sum += v;
+            sumSq += v * v;
+          }
+        }
+      }
+      const double mean = sum / count;
+      const double variance = std::max(0.0, sumSq / count - mean * mean);
+      values[row * xSize + x] = leeEstimate(value, mean, variance, cu2);
+    }
+  });
+}
+
+/*
+* Filters a block of rows in place. Windows are clipped at the borders of
+* the block, so a strip is read with filter.halo() extra rows on each side.
+*/
+inline void
+applySpeckleFilter(std::vector<double>& values,
+                   int xSize,
+                   int ySize,
+                   const SpeckleFilter& filter)
+{
+  if (!filter.isEnabled() || values.empty()) {
+    return;
+  }
+  TraceScope trace("speckle filter");
+  const double cu2 = 1.0 / filter.looks;
+  if (filter.type == "refined-lee") {
+    refinedLeeFilter(values, xSize, ySize, filter.window, cu2);
+    return;
+  }
+
+  std::vector<double> mean;
+  std::vector<double> variance;
+  const bool lee = filter.type == "lee";
+  computeBoxStatistics(
+    values.data(), xSize, ySize, filter.window, mean, lee ? &variance : nullptr);
+  const size_t pixels = values.size();
+  if (!lee) {
+    for (size_t i = 0; i < pixels; i++) {
+      // NaN stays NaN
+      values[i] = std::isnan(values[i]) ? values[i] : mean[i];
+    }
+    return;
+  }
+  parallelFor(ySize, [&](size_t y) {
+    for (size_t i = y * xSize; i < (y + 1) * xSize; i++) {
+      values[i] = std::isnan(values[i])
+                    ? values[i]
+                    : leeEstimate(values[i], mean[i], variance[i], cu2);
+    }
+  });
+}
@@ -0,0 +1,260 @@
+#pragma once
+
+#include "memory.hpp"
+#include "trace.hpp"
+#include "utils.hpp"
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+/*
+*
+* Per-stage instrumentation: wall time, CPU time (of all threads), pixels
+* processed, bytes read and written and memory (peak RSS of the process,
+* bytes of tracked structures at the end of the stage) of every stage of a
+* run (scan, reproject, mosaic, crop, load, cluster per k, correlate, map).
+* Stages of the same name are summed, memory is the maximum. The report is printed as a table and written as
+* JSON to the cache when the analysis finishes. Stages are events of the
+* trace as well (see trace.hpp).
+*
+*/
+
+inline std::string
+stageReportPath()
+{
+  return workPath(".floodsar-cache/stages.json");
+}
+
+class StageStats
+{
+public:
+  std::string name;
+  size_t calls = 0;
+  double wallSeconds = 0.0;
+  double cpuSeconds = 0.0;
+  size_t pixels = 0;
+  size_t bytesRead = 0;
+  size_t bytesWritten = 0;
+  size_t peakRssBytes = 0;
+  size_t trackedBytes = 0;
+};
+
+// stages of the run in the order they first started; thread-safe
+class StageReport
+{
+public:
+  void add(const StageStats& stats)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto& stage : m_stages) {
+      if (stage.name == stats.name) {
+        stage.calls += stats.calls;
+        stage.wallSeconds += stats.wallSeconds;
+        stage.cpuSeconds += stats.cpuSeconds;
+        stage.pixels += stats.pixels;
+        stage.bytesRead += stats.bytesRead;
+        stage.bytesWritten += stats.bytesWritten;
+        stage.peakRssBytes = std::max(stage.peakRssBytes, stats.peakRssBytes);
+        stage.trackedBytes = std::max(stage.trackedBytes, stats.trackedBytes);
+        return;
+      }
+    }
+    m_stages.push_back(stats);
+  }
+
+  std::vector<StageStats> stages() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stages;
+  }
+
+  void clear()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stages.clear();
+  }
+
+private:
+  mutable std::mutex m_mutex;
+  std::vector<StageStats> m_stages;
+};
+
+inline StageReport&
+stageReport()
+{
+  static StageReport report;
+  return report;
+}
+
+/*
+* Measures a stage from construction to destruction and adds it to the
+* report. Pixels and bytes are counted by the stage itself.
+*/
+class ScopedStage
+{
+public:
+  explicit ScopedStage(const std::string& name)
+    : m_wallStart(std::chrono::steady_clock::now())
+    , m_cpuStart(std::clock())
+    , m_trace(name)
+  {
+    m_stats.name = name;
+    m_stats.calls = 1;
+  }
+
+  ~ScopedStage()
+  {
+    m_stats.wallSeconds = std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - m_wallStart)
+                            .count();
+    m_stats.cpuSeconds =
+      static_cast<double>(std::clock() - m_cpuStart) / CLOCKS_PER_SEC;
+    trackGdalBlockCache();
+    m_stats.peakRssBytes = getPeakRss();
+    m_stats.trackedBytes = memoryTracker().total();
+    stageReport().add(m_stats);
+    LOG("%s: %.3f s wall, %.3f s CPU",
+        m_stats.name.c_str(),
+        m_stats.wallSeconds,
+        m_stats.cpuSeconds);
+  }
+
+  ScopedStage(const ScopedStage&) = delete;
+  ScopedStage& operator=(const ScopedStage&) = delete;
+
+  void addPixels(size_t pixels) { m_stats.pixels += pixels; }
+  void addBytesRead(size_t bytes) { m_stats.bytesRead += bytes; }
+  void addBytesWritten(size_t bytes) { m_stats.bytesWritten += bytes; }
+
+private:
+  StageStats m_stats;
+  std::chrono::steady_clock::time_point m_wallStart;
+  std::clock_t m_cpuStart;
+  TraceScope m_trace;
+};
+
+// size of a file, 0 if it does not exist (e.g. a failed write)
+inline size_t
+getFileSize(const std::string& path)
+{
+  std::error_code error;
+  const auto size = fs::file_size(path, error);
+  return error ? 0 : static_cast<size_t>(size);
+}
+
+// total size of regular files in a directory tree
+inline size_t
+getDirectorySize(const std::string& path)
+{
+  std::error_code error;
+  size_t size = 0;
+  for (auto it = fs::recursive_directory_iterator(path, error);
+       !error && it != fs::recursive_directory_iterator();
+       it.increment(error)) {
+    if (it->is_regular_file()) {
+      size += getFileSize(it->path().string());
+    }
+  }
+  return size;
+}
+
+inline std::string
+stageReportToJson(const std::vector<StageStats>& stages,
+                  const std::vector<MemoryRecord>& memory)
+{
+  std::stringstream json;
+  json << "{\n  \"created\": \"" << getCurrentTimeString()
+       << "\",\n  \"stages\": [\n";
+  for (size_t i = 0; i < stages.size(); i++) {
+    const auto& s = stages[i];
+    json << "    {\"name\": \"" << s.name << "\", \"calls\": " << s.calls
+         << ", \"wall_s\": " << s.wallSeconds << ", \"cpu_s\": " << s.cpuSeconds
+         << ", \"pixels\": " << s.pixels
+         << ", \"pixels_per_s\": "
+         << (s.wallSeconds > 0.0 ? s.pixels / s.wallSeconds : 0.0)
+         << ", \"bytes_read\": " << s.bytesRead
+         << ", \"bytes_written\": " << s.bytesWritten
+         << ", \"peak_rss_bytes\": " << s.peakRssBytes
+         << ", \"tracked_bytes\": " << s.trackedBytes << "}"
+         << (i + 1 < stages.size() ? "," : "") << "\n";
+  }
+  json << "  ],\n  \"memory\": [\n";
+  for (size_t i = 0; i < memory.size(); i++) {
+    json << "    {\"name\": \"" << memory[i].name
+         << "\", \"peak_bytes\": " << memory[i].peak << "}"
+         << (i + 1 < memory.size() ? "," : "") << "\n";
+  }
+  json << "  ],\n  \"peak_rss_bytes\": " << getPeakRss() << "\n}\n";
+  return json.str();
+}
+
+inline void
+printStageReport(const std::vector<StageStats>& stages)
+{
+  std::cout << std::left << std::setw(24) << "stage" << std::right
+            << std::setw(7) << "calls" << std::setw(11) << "wall s"
+            << std::setw(11) << "CPU s" << std::setw(14) << "Mpixels/s"
+            << std::setw(12) << "MB read" << std::setw(12) << "MB written"
+            << std::setw(10) << "RSS MB" << std::setw(12) << "tracked MB"
+            << "\n";
+  std::cout << std::fixed << std::setprecision(2);
+  for (const auto& s : stages) {
+    std::cout << std::left << std::setw(24) << s.name << std::right
+              << std::setw(7) << s.calls << std::setw(11) << s.wallSeconds
+              << std::setw(11) << s.cpuSeconds << std::setw(14)
+              << (s.wallSeconds > 0.0 ? s.pixels / s.wallSeconds / 1e6 : 0.0)
+              << std::setw(12) << s.bytesRead / 1e6 << std::setw(12)
+              << s.bytesWritten / 1e6 << std::setw(10) << s.peakRssBytes / 1e6
+              << std::setw(12) << s.trackedBytes / 1e6 << "\n";
+  }
+  std::cout << std::defaultfloat << std::setprecision(6);
+}
+
+/*
+* Prints and writes the report when it goes out of scope, e.g. at any return
+* of the analysis, and starts a new one (every job of a batch has its own).
+*/
+class StageReportScope
+{
+public:
+  explicit StageReportScope(const std::string& path = stageReportPath())
+    : m_path(fs::absolute(path).string())
+  {
+  }
+
+  ~StageReportScope()
+  {
+    const auto stages = stageReport().stages();
+    const auto memory = memoryTracker().records();
+    stageReport().clear();
+    memoryTracker().clear();
+    if (stages.empty()) {
+      return;
+    }
+    std::cout << "---------------- STAGES ----------------\n";
+    printStageReport(stages);
+    std::cout << "---------------- MEMORY ----------------\n";
+    printMemoryReport(memory);
+    std::ofstream ofs(m_path);
+    ofs << stageReportToJson(stages, memory);
+    if (ofs) {
+      std::cout << "Stage timings written to " << m_path << "\n";
+    }
+  }
+
+  StageReportScope(const StageReportScope&) = delete;
+  StageReportScope& operator=(const StageReportScope&) = delete;
+
+private:
+  std::string m_path;
+};
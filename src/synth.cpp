@@ -0,0 +1,395 @@
+#include "gdal/gdal_priv.h"
+#include "gdal/ogr_spatialref.h"
+#include "utils.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cxxopts.hpp>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+/*
+*
+* Generator of synthetic dual-pol SAR stacks, gauge data and AOI for tests
+* and scaling runs of floodsar. A meandering valley is flooded up to a level
+* that follows the generated gauge, so the flooded area of every date, and
+* its correlation with the gauge, are known exactly. Output is reproducible
+* for a given seed, independently of the number of threads.
+*
+*/
+
+const double pi = 3.14159265358979323846;
+
+// mean linear backscatter of open water and land
+const double waterVV = 0.005;
+const double waterVH = 0.001;
+const double landVV = 0.12;
+const double landVH = 0.03;
+
+/*
+* Height of the terrain above the river at relative position (u, v) of the
+* image, u, v in [0, 1]: distance from a meandering centerline with some
+* roughness. Pixels lower than the water level are flooded.
+*/
+double
+terrainHeight(double u, double v)
+{
+  const double center = 0.5 + 0.15 * std::sin(2.0 * pi * 2.0 * v);
+  const double roughness = 0.02 * std::sin(2.0 * pi * 13.0 * u) *
+                           std::sin(2.0 * pi * 11.0 * v);
+  return std::abs(u - center) + roughness;
+}
+
+/*
+* Water levels at which approximately the given fractions of the image are
+* flooded, from quantiles of terrain heights on a regular subgrid.
+*/
+std::vector<double>
+getFloodLevels(int xSize, int ySize, const std::vector<double>& fractions)
+{
+  const int samplesPerAxis = 1000;
+  const int stepX = std::max(1, xSize / samplesPerAxis);
+  const int stepY = std::max(1, ySize / samplesPerAxis);
+  std::vector<double> heights;
+  for (int y = 0; y < ySize; y += stepY) {
+    for (int x = 0; x < xSize; x += stepX) {
+      heights.push_back(
+        terrainHeight((x + 0.5) / xSize, (y + 0.5) / ySize));
+    }
+  }
+  std::sort(heights.begin(), heights.end());
+
+  std::vector<double> levels;
+  for (double fraction : fractions) {
+    const size_t index = std::min(
+      heights.size() - 1, static_cast<size_t>(fraction * heights.size()));
+    levels.push_back(fraction <= 0.0 ? heights.front() - 1.0 : heights[index]);
+  }
+  return levels;
+}
+
+// YYYYMMDD of the date days after YYYYMMDD start (proleptic Gregorian)
+std::string
+addDays(const std::string& start, int days)
+{
+  int y = std::stoi(start.substr(0, 4));
+  const unsigned m = std::stoi(start.substr(4, 2));
+  const unsigned d = std::stoi(start.substr(6, 2));
+
+  // days from civil, see http://howardhinnant.github.io/date_algorithms.html
+  y -= m <= 2;
+  long era = (y >= 0 ? y : y - 399) / 400;
+  unsigned yoe = static_cast<unsigned>(y - era * 400);
+  unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  long z = era * 146097 + static_cast<long>(doe) - 719468 + days;
+
+  // and back
+  z += 719468;
+  era = (z >= 0 ? z : z - 146096) / 146097;
+  doe = static_cast<unsigned>(z - era * 146097);
+  yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  const unsigned mp = (5 * doy + 2) / 153;
+  const unsigned outD = doy - (153 * mp + 2) / 5 + 1;
+  const unsigned outM = mp < 10 ? mp + 3 : mp - 9;
+  const long outY = static_cast<long>(yoe) + era * 400 + (outM <= 2);
+
+  std::stringstream ss;
+  ss << std::setfill('0') << std::setw(4) << outY << std::setw(2) << outM
+     << std::setw(2) << outD;
+  return ss.str();
+}
+
+// file name parsed by AsfExtractor, or by StdExtractor if stdNames
+std::string
+getSceneFileName(const std::string& date,
+                 const std::string& polarization,
+                 int index,
+                 bool stdNames)
+{
+  if (stdNames) {
+    return date + "_" + polarization + ".tif";
+  }
+  std::stringstream id;
+  id << std::uppercase << std::hex << std::setfill('0') << std::setw(4)
+     << (index & 0xFFFF);
+  return "S1A_IW_" + date + "T060000_DVP_RTC10_G_gpuned_" + id.str() + "_" +
+         polarization + ".tif";
+}
+
+GDALDataset*
+createFloat32Raster(const std::string& path,
+                    int xSize,
+                    int ySize,
+                    double* geoTransform,
+                    const std::string& projection)
+{
+  auto gtiffDriver = GetGDALDriverManager()->GetDriverByName("GTiff");
+  char** createOptions = nullptr;
+  createOptions = CSLSetNameValue(createOptions, "BIGTIFF", "IF_SAFER");
+  auto raster = gtiffDriver->Create(
+    path.c_str(), xSize, ySize, 1, GDT_Float32, createOptions);
+  CSLDestroy(createOptions);
+  if (raster == nullptr) {
+    std::cout << "Could not create " << path << "\n";
+    return nullptr;
+  }
+  raster->SetGeoTransform(geoTransform);
+  raster->SetProjection(projection.c_str());
+  return raster;
+}
+
+// speckle of a pixel: unit-mean gamma of the given number of looks, 0 is none
+class SpeckleModel
+{
+public:
+  explicit SpeckleModel(double looks)
+    : looks(looks)
+    , gamma(looks > 0.0 ? looks : 1.0, looks > 0.0 ? 1.0 / looks : 1.0)
+  {
+  }
+
+  double operator()(std::mt19937_64& rng)
+  {
+    return looks > 0.0 ? gamma(rng) : 1.0;
+  }
+
+  double looks;
+  std::gamma_distribution<double> gamma;
+};
+
+int
+main(int argc, char** argv)
+{
+  cxxopts::Options options("Floodsar::Synth",
+                           " - generator of synthetic SAR stacks and gauge data");
+  options.add_options()("h,help", "Print this help")(
+    "o,output",
+    "Output directory.",
+    cxxopts::value<std::string>()->default_value("synth"))(
+    "x,width",
+    "Width of images in pixels.",
+    cxxopts::value<int>()->default_value("1000"))(
+    "y,height",
+    "Height of images in pixels.",
+    cxxopts::value<int>()->default_value("1000"))(
+    "n,dates",
+    "Number of dates.",
+    cxxopts::value<int>()->default_value("20"))(
+    "s,start",
+    "Date of the first image, YYYYMMDD.",
+    cxxopts::value<std::string>()->default_value("20200101"))(
+    "i,interval",
+    "Days between images.",
+    cxxopts::value<int>()->default_value("12"))(
+    "p,epsg",
+    "CRS of the images, e.g. EPSG:32610.",
+    cxxopts::value<std::string>()->default_value("EPSG:32610"))(
+    "origin",
+    "Upper left corner of the images in the CRS, x,y.",
+    cxxopts::value<std::vector<double>>()->default_value("500000,4200000"))(
+    "pixel-size",
+    "Pixel size in the units of the CRS.",
+    cxxopts::value<double>()->default_value("10"))(
+    "l,looks",
+    "Number of looks of the gamma speckle, 0 for images without speckle.",
+    cxxopts::value<double>()->default_value("4.4"))(
+    "f,flood",
+    "Minimum and maximum flooded fraction of images, e.g. 0.05,0.4.",
+    cxxopts::value<std::vector<double>>()->default_value("0.05,0.4"))(
+    "g,gauge-noise",
+    "Standard deviation of gauge noise relative to the gauge range, 0 gives correlation 1.",
+    cxxopts::value<double>()->default_value("0.05"))(
+    "t,stdParser",
+    "Name images YYYYMMDD_POL.tif for the standard parser instead of ASF HyP3 names.")(
+    "seed",
+    "Seed of the random generator.",
+    cxxopts::value<unsigned>()->default_value("42"));
+
+  auto userInput = options.parse(argc, argv);
+  if (userInput.count("help")) {
+    std::cout << options.help() << "\n";
+    return 0;
+  }
+
+  GDALAllRegister();
+
+  const int xSize = std::max(1, userInput["width"].as<int>());
+  const int ySize = std::max(1, userInput["height"].as<int>());
+  const int numDates = std::max(2, userInput["dates"].as<int>());
+  const auto start = userInput["start"].as<std::string>();
+  const int interval = std::max(1, userInput["interval"].as<int>());
+  const auto epsg = userInput["epsg"].as<std::string>();
+  const auto origin = userInput["origin"].as<std::vector<double>>();
+  const double pixelSize = userInput["pixel-size"].as<double>();
+  const double looks = std::max(0.0, userInput["looks"].as<double>());
+  const auto flood = userInput["flood"].as<std::vector<double>>();
+  const double gaugeNoise = std::max(0.0, userInput["gauge-noise"].as<double>());
+  const bool stdNames = userInput.count("stdParser") > 0;
+  const unsigned seed = userInput["seed"].as<unsigned>();
+  const fs::path outputDir(userInput["output"].as<std::string>());
+
+  if (start.size() != 8 || origin.size() != 2 || flood.size() != 2 ||
+      pixelSize <= 0.0) {
+    std::cout << "Expecting -s YYYYMMDD, --origin x,y, -f min,max and a "
+                 "positive --pixel-size\n";
+    return 1;
+  }
+  const double minFlood = std::clamp(std::min(flood[0], flood[1]), 0.0, 1.0);
+  const double maxFlood = std::clamp(std::max(flood[0], flood[1]), 0.0, 1.0);
+
+  OGRSpatialReference srs;
+  if (srs.SetFromUserInput(epsg.c_str()) != OGRERR_NONE) {
+    std::cout << "Unknown CRS " << epsg << "\n";
+    return 1;
+  }
+  char* wkt = nullptr;
+  srs.exportToWkt(&wkt);
+  const std::string projection(wkt);
+  CPLFree(wkt);
+
+  double geoTransform[6] = { origin[0], pixelSize, 0.0,
+                             origin[1], 0.0,       -pixelSize };
+
+  fs::create_directories(outputDir / "images");
+
+  // relative water level of dates, in [0, 1]
+  std::mt19937_64 rng(seed);
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  std::normal_distribution<double> normal(0.0, 1.0);
+  std::vector<std::string> dates;
+  std::vector<double> levels, fractions, gauge;
+  for (int date = 0; date < numDates; date++) {
+    dates.push_back(addDays(start, date * interval));
+    levels.push_back(uniform(rng));
+    fractions.push_back(minFlood + (maxFlood - minFlood) * levels.back());
+    // discharge-like values, m3/s
+    gauge.push_back(100.0 + 900.0 * (levels.back() + gaugeNoise * normal(rng)));
+  }
+  const auto floodLevels = getFloodLevels(xSize, ySize, fractions);
+
+  const size_t imageBytes = static_cast<size_t>(xSize) * ySize * sizeof(float);
+  std::cout << "Writing " << 2 * numDates << " images of " << xSize << " x "
+            << ySize << " pixels, " << 2 * numDates * imageBytes / 1e6
+            << " MB to " << outputDir << "\n";
+
+  // blocks of rows of about 64 MB per polarization
+  const int blockRows = static_cast<int>(std::clamp<size_t>(
+    (64u << 20) / (static_cast<size_t>(xSize) * sizeof(float)), 1, ySize));
+  std::vector<float> blockVV(static_cast<size_t>(blockRows) * xSize);
+  std::vector<float> blockVH(blockVV.size());
+  std::vector<unsigned int> floodedPixels(numDates, 0);
+
+  for (int date = 0; date < numDates; date++) {
+    auto vvPath =
+      outputDir / "images" / getSceneFileName(dates[date], "VV", 2 * date, stdNames);
+    auto vhPath = outputDir / "images" /
+                  getSceneFileName(dates[date], "VH", 2 * date + 1, stdNames);
+    auto vvRaster =
+      createFloat32Raster(vvPath.string(), xSize, ySize, geoTransform, projection);
+    auto vhRaster =
+      createFloat32Raster(vhPath.string(), xSize, ySize, geoTransform, projection);
+    if (vvRaster == nullptr || vhRaster == nullptr) {
+      return 1;
+    }
+
+    std::atomic<size_t> flooded{ 0 };
+    for (int firstRow = 0; firstRow < ySize; firstRow += blockRows) {
+      const int rows = std::min(blockRows, ySize - firstRow);
+      parallelFor(rows, [&](size_t row) {
+        const int y = firstRow + static_cast<int>(row);
+        // one generator per row and date keeps output independent of threads
+        std::seed_seq rowSeed{ seed, static_cast<unsigned>(date),
+                               static_cast<unsigned>(y) };
+        std::mt19937_64 rowRng(rowSeed);
+        SpeckleModel speckle(looks);
+        size_t rowFlooded = 0;
+        for (int x = 0; x < xSize; x++) {
+          const bool isWater = terrainHeight((x + 0.5) / xSize,
+                                             (y + 0.5) / ySize) < floodLevels[date];
+          rowFlooded += isWater;
+          const size_t i = row * xSize + x;
+          blockVV[i] = (isWater ? waterVV : landVV) * speckle(rowRng);
+          blockVH[i] = (isWater ? waterVH : landVH) * speckle(rowRng);
+        }
+        flooded += rowFlooded;
+      });
+
+      bool ok = vvRaster->GetRasterBand(1)->RasterIO(GF_Write, 0, firstRow, xSize,
+                                                     rows, blockVV.data(), xSize,
+                                                     rows, GDT_Float32, 0, 0) !=
+                CE_Failure;
+      ok = ok && vhRaster->GetRasterBand(1)->RasterIO(
+                   GF_Write, 0, firstRow, xSize, rows, blockVH.data(), xSize,
+                   rows, GDT_Float32, 0, 0) != CE_Failure;
+      if (!ok) {
+        std::cout << "Could not write images of " << dates[date] << "\n";
+        return 1;
+      }
+    }
+    GDALClose(vvRaster);
+    GDALClose(vhRaster);
+    floodedPixels[date] = static_cast<unsigned int>(flooded);
+    std::cout << dates[date] << ": " << floodedPixels[date] << " flooded pixels\n";
+  }
+
+  // daily gauge records, interpolated between dates of images
+  std::ofstream gaugeFile(outputDir / "gauge.csv");
+  gaugeFile << std::setprecision(10);
+  for (int date = 0; date + 1 < numDates; date++) {
+    for (int day = 0; day < interval; day++) {
+      const double t = static_cast<double>(day) / interval;
+      gaugeFile << addDays(dates[date], day) << ","
+                << gauge[date] * (1.0 - t) + gauge[date + 1] * t << "\n";
+    }
+  }
+  gaugeFile << dates.back() << "," << gauge.back() << "\n";
+
+  // AOI: the whole extent of the images, at a coarse resolution
+  const int aoiFactor = 10;
+  double aoiTransform[6] = { origin[0], pixelSize * aoiFactor, 0.0,
+                             origin[1], 0.0, -pixelSize * aoiFactor };
+  auto gtiffDriver = GetGDALDriverManager()->GetDriverByName("GTiff");
+  const int aoiXSize = (xSize + aoiFactor - 1) / aoiFactor;
+  const int aoiYSize = (ySize + aoiFactor - 1) / aoiFactor;
+  auto aoi = gtiffDriver->Create((outputDir / "aoi.tif").string().c_str(),
+                                 aoiXSize,
+                                 aoiYSize,
+                                 1,
+                                 GDT_Byte,
+                                 nullptr);
+  if (aoi != nullptr) {
+    aoi->SetGeoTransform(aoiTransform);
+    aoi->SetProjection(projection.c_str());
+    aoi->GetRasterBand(1)->Fill(1);
+    GDALClose(aoi);
+  }
+
+  // the truth: flooded areas of dates and their correlation with the gauge
+  const double correlation = calcCorrelationCoeff(floodedPixels, gauge);
+  std::ofstream truthFile(outputDir / "truth.csv");
+  truthFile << std::setprecision(10);
+  for (int date = 0; date < numDates; date++) {
+    truthFile << dates[date] << "," << floodedPixels[date] << "," << gauge[date]
+              << "\n";
+  }
+  std::ofstream correlationFile(outputDir / "correlation.txt");
+  correlationFile << std::setprecision(10) << correlation << "\n";
+
+  std::cout << "Correlation of flooded area with gauge: " << correlation << "\n";
+  std::cout << "Run e.g.: floodsar -a 1D -n 0.001,0.1,0.001 -o "
+            << (outputDir / "aoi.tif").string() << " -d "
+            << (outputDir / "images").string() << " -p " << epsg << " -g "
+            << (outputDir / "gauge.csv").string() << (stdNames ? " -t" : "")
+            << "\n";
+  return 0;
+}
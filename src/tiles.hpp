@@ -0,0 +1,304 @@
+#pragma once
+
+#include "aoi.hpp"
+#include "clustering.hpp"
+#include "gdal/gdal_priv.h"
+#include "labels.hpp"
+#include "rasters.hpp"
+#include <algorithm>
+#include <array>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+/*
+*
+* Tiled processing: the crop grid is split into strips of full rows that fit
+* a memory budget, and every date is processed strip by strip. Per-date
+* counts are summed over strips, labels are streamed to the label store in
+* grid order.
+*
+*/
+
+/*
+* Horizontal strips of the grid. Full rows keep reads contiguous in
+* scanline-organized GeoTIFFs.
+*/
+class StripLayout
+{
+public:
+  /*
+  * @param bytesPerPixel is the working memory needed per grid pixel
+  * @param memoryBudget in bytes
+  */
+  StripLayout(int xSize, int ySize, size_t bytesPerPixel, size_t memoryBudget)
+    : xSize(xSize)
+    , ySize(ySize)
+  {
+    const size_t rowBytes =
+      std::max<size_t>(1, static_cast<size_t>(xSize) * bytesPerPixel);
+    rowsPerStrip = static_cast<int>(std::clamp<size_t>(
+      memoryBudget / rowBytes, 1, std::max(1, ySize)));
+  }
+
+  int numStrips() const { return (ySize + rowsPerStrip - 1) / rowsPerStrip; }
+  int firstRow(int strip) const { return strip * rowsPerStrip; }
+  int rows(int strip) const
+  {
+    return std::min(rowsPerStrip, ySize - firstRow(strip));
+  }
+  size_t firstPixel(int strip) const
+  {
+    return static_cast<size_t>(firstRow(strip)) * xSize;
+  }
+  size_t pixels(int strip) const
+  {
+    return static_cast<size_t>(rows(strip)) * xSize;
+  }
+
+  int xSize;
+  int ySize;
+  int rowsPerStrip;
+};
+
+// the part of an AOI mask that covers grid pixels [firstPixel, firstPixel + count)
+inline AoiMask
+getAoiMaskWindow(const AoiMask& mask, size_t firstPixel, size_t count)
+{
+  AoiMask window;
+  window.gridWords = count;
+  if (mask.isFull()) {
+    return window;
+  }
+  auto first = std::lower_bound(
+    mask.validPixels.begin(), mask.validPixels.end(), firstPixel);
+  auto last = std::lower_bound(first, mask.validPixels.end(), firstPixel + count);
+  for (auto it = first; it != last; it++) {
+    window.validPixels.push_back(*it - firstPixel);
+  }
+  window.masked = true;
+  return window;
+}
+
+// pixel values of a strip inside the area of interest
+inline bool
+readStrip(GDALDataset* raster,
+          const StripLayout& layout,
+          int strip,
+          const AoiMask& stripMask,
+          std::vector<double>& values)
+{
+  values.clear();
+  if (!getPixelValuesFromRasterRows(
+        raster, layout.firstRow(strip), layout.rows(strip), values)) {
+    return false;
+  }
+  applyAoiMask(values, stripMask);
+  return true;
+}
+
+inline std::vector<AoiMask>
+getStripMasks(const StripLayout& layout, const AoiMask& aoiMask)
+{
+  std::vector<AoiMask> masks;
+  for (int strip = 0; strip < layout.numStrips(); strip++) {
+    masks.push_back(getAoiMaskWindow(
+      aoiMask, layout.firstPixel(strip), layout.pixels(strip)));
+  }
+  return masks;
+}
+
+/*
+* Flooded areas of the 1D algorithm for every threshold and date, summed
+* over strips.
+* @return flooded areas indexed [threshold][date]
+*/
+inline std::vector<std::vector<unsigned int>>
+countFloodedAreasTiled(const std::vector<std::string>& rasterPaths,
+                       const std::vector<double>& thresholds,
+                       const AoiMask& aoiMask,
+                       const StripLayout& layout)
+{
+  const auto stripMasks = getStripMasks(layout, aoiMask);
+  std::vector<std::vector<unsigned int>> floodedAreas(
+    thresholds.size(), std::vector<unsigned int>(rasterPaths.size(), 0));
+
+  std::vector<double> values;
+  for (size_t date = 0; date < rasterPaths.size(); date++) {
+    auto dataset = static_cast<GDALDataset*>(
+      GDALOpen(rasterPaths[date].c_str(), GA_ReadOnly));
+    if (dataset == nullptr) {
+      std::cout << "Could not open " << rasterPaths[date] << "\n";
+      continue;
+    }
+    for (int strip = 0; strip < layout.numStrips(); strip++) {
+      readStrip(dataset, layout, strip, stripMasks[strip], values);
+      for (size_t t = 0; t < thresholds.size(); t++) {
+        floodedAreas[t][date] += calcFloodedArea(values, thresholds[t]);
+      }
+    }
+    GDALClose(dataset);
+  }
+  return floodedAreas;
+}
+
+/*
+* Streams thresholding labels of all dates to the label store. A date whose
+* image cannot be read is stored as not flooded, so later dates keep their
+* place in the store.
+*/
+inline void
+writeThresholdingLabelsTiled(const std::vector<std::string>& rasterPaths,
+                             double threshold,
+                             const AoiMask& aoiMask,
+                             const StripLayout& layout,
+                             LabelStoreWriter& writer)
+{
+  const auto stripMasks = getStripMasks(layout, aoiMask);
+  std::vector<double> values;
+  std::vector<unsigned char> labels;
+  for (const auto& rasterPath : rasterPaths) {
+    auto dataset =
+      static_cast<GDALDataset*>(GDALOpen(rasterPath.c_str(), GA_ReadOnly));
+    if (dataset == nullptr) {
+      std::cout << "Could not open " << rasterPath << ", stored as not flooded\n";
+    }
+    for (int strip = 0; strip < layout.numStrips(); strip++) {
+      labels.clear();
+      if (dataset != nullptr) {
+        readStrip(dataset, layout, strip, stripMasks[strip], values);
+        getThresholdingLabels(values, threshold, labels);
+      }
+      // a strip that could not be read is not flooded either
+      labels.resize(stripMasks[strip].validWords(), 0);
+      writer.appendPixels(labels.data(), labels.size());
+    }
+    if (dataset != nullptr) {
+      GDALClose(dataset);
+    }
+  }
+}
+
+/*
+* Random sample of k-means input (clipped, optionally in dB) of all dates,
+* read strip by strip. Pixels are taken with the same probability on every
+* date; once the sample is full, taken pixels replace random ones of it
+* (reservoir sampling), so later dates are not left out.
+* @param fraction of pixels to sample
+* @param maxSamples caps the sample so it fits the memory budget
+*/
+inline void
+sampleKMeansInputTiled(const std::vector<std::string>& vhPaths,
+                       const std::vector<std::string>& vvPaths,
+                       const AoiMask& aoiMask,
+                       const StripLayout& layout,
+                       double fraction,
+                       size_t maxSamples,
+                       const std::vector<double>& maxValueDbl,
+                       bool convToDB,
+                       std::vector<double>& sampleVH,
+                       std::vector<double>& sampleVV,
+                       unsigned int seed = 0)
+{
+  const auto stripMasks = getStripMasks(layout, aoiMask);
+  const double totalPoints =
+    static_cast<double>(aoiMask.validWords()) * vhPaths.size();
+  const double probability =
+    std::min(fraction, totalPoints > 0 ? maxSamples / totalPoints : 1.0);
+  std::mt19937 rng = createRandomEngine(seed);
+  std::bernoulli_distribution take(std::clamp(probability, 0.0, 1.0));
+
+  std::vector<double> vh, vv;
+  size_t taken = 0;
+  for (size_t date = 0; date < vhPaths.size(); date++) {
+    auto vhDataset =
+      static_cast<GDALDataset*>(GDALOpen(vhPaths[date].c_str(), GA_ReadOnly));
+    auto vvDataset =
+      static_cast<GDALDataset*>(GDALOpen(vvPaths[date].c_str(), GA_ReadOnly));
+    if (vhDataset == nullptr || vvDataset == nullptr) {
+      std::cout << "Could not open images of date " << date << "\n";
+    } else {
+      for (int strip = 0; strip < layout.numStrips(); strip++) {
+        readStrip(vhDataset, layout, strip, stripMasks[strip], vh);
+        readStrip(vvDataset, layout, strip, stripMasks[strip], vv);
+        prepareKMeansInput(vh, vv, maxValueDbl, convToDB);
+        for (size_t i = 0; i < vh.size(); i++) {
+          if (!take(rng)) {
+            continue;
+          }
+          taken++;
+          if (sampleVH.size() < maxSamples) {
+            sampleVH.push_back(vh[i]);
+            sampleVV.push_back(vv[i]);
+            continue;
+          }
+          const size_t slot =
+            std::uniform_int_distribution<size_t>(0, taken - 1)(rng);
+          if (slot < maxSamples) {
+            sampleVH[slot] = vh[i];
+            sampleVV[slot] = vv[i];
+          }
+        }
+      }
+    }
+    if (vhDataset != nullptr) GDALClose(vhDataset);
+    if (vvDataset != nullptr) GDALClose(vvDataset);
+  }
+  std::cout << "Clustering sample: " << sampleVH.size()
+            << " / All pixels: " << static_cast<size_t>(totalPoints) << "\n";
+}
+
+/*
+* Labels all pixels of all dates with the nearest centroid, strip by strip.
+* Labels are streamed to the writer. A date whose images cannot be read is
+* stored as label 0, which is no class and never flooded, so later dates
+* keep their place in the store.
+* @return label histograms of dates (see computeLabelHistograms)
+*/
+inline std::vector<std::array<unsigned int, 256>>
+labelKMeansTiled(const std::vector<std::string>& vhPaths,
+                 const std::vector<std::string>& vvPaths,
+                 const AoiMask& aoiMask,
+                 const StripLayout& layout,
+                 const std::vector<double>& maxValueDbl,
+                 bool convToDB,
+                 const std::vector<double>& centroidsVH,
+                 const std::vector<double>& centroidsVV,
+                 LabelStoreWriter& writer)
+{
+  const auto stripMasks = getStripMasks(layout, aoiMask);
+  std::vector<std::array<unsigned int, 256>> histograms(vhPaths.size());
+
+  std::vector<double> vh, vv;
+  std::vector<unsigned char> labels;
+  for (size_t date = 0; date < vhPaths.size(); date++) {
+    histograms[date].fill(0);
+    auto vhDataset =
+      static_cast<GDALDataset*>(GDALOpen(vhPaths[date].c_str(), GA_ReadOnly));
+    auto vvDataset =
+      static_cast<GDALDataset*>(GDALOpen(vvPaths[date].c_str(), GA_ReadOnly));
+    const bool readable = vhDataset != nullptr && vvDataset != nullptr;
+    if (!readable) {
+      std::cout << "Could not open images of date " << date
+                << ", stored as no class\n";
+    }
+    for (int strip = 0; strip < layout.numStrips(); strip++) {
+      labels.assign(stripMasks[strip].validWords(), 0);
+      if (readable) {
+        readStrip(vhDataset, layout, strip, stripMasks[strip], vh);
+        readStrip(vvDataset, layout, strip, stripMasks[strip], vv);
+        prepareKMeansInput(vh, vv, maxValueDbl, convToDB);
+        labelPixels(
+          vh.data(), vv.data(), vh.size(), centroidsVH, centroidsVV, labels.data());
+      }
+      for (auto label : labels) {
+        histograms[date][label]++;
+      }
+      writer.appendPixels(labels.data(), labels.size());
+    }
+    if (vhDataset != nullptr) GDALClose(vhDataset);
+    if (vvDataset != nullptr) GDALClose(vvDataset);
+  }
+  return histograms;
+}
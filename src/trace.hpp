@@ -0,0 +1,264 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+*
+* Timeline of scoped events of all threads in the Chrome trace event format,
+* viewable in chrome://tracing or https://ui.perfetto.dev. Every thread
+* records to its own preallocated ring buffer, so recording takes no lock and
+* allocates nothing; when a buffer is full the oldest events are overwritten.
+* A thread returns its buffer when it exits and the next new thread records
+* to it, so there are only as many buffers as threads ever alive at once.
+* When tracing is off an event costs one relaxed atomic load.
+*
+*/
+
+class TraceEvent
+{
+public:
+  // fixed size, names are truncated
+  char name[48];
+  uint64_t startMicroseconds;
+  uint64_t durationMicroseconds;
+};
+
+class TraceBuffer
+{
+public:
+  TraceBuffer(unsigned int threadId, size_t capacity)
+    : threadId(threadId)
+    , events(capacity)
+  {
+  }
+
+  void record(const char* name, uint64_t start, uint64_t duration)
+  {
+    TraceEvent& event = events[recorded % events.size()];
+    std::strncpy(event.name, name, sizeof(event.name) - 1);
+    event.name[sizeof(event.name) - 1] = '\0';
+    event.startMicroseconds = start;
+    event.durationMicroseconds = duration;
+    recorded++;
+  }
+
+  unsigned int threadId;
+  std::vector<TraceEvent> events;
+  // events ever recorded, the last events.size() of them are kept
+  size_t recorded = 0;
+};
+
+class Tracer
+{
+public:
+  // events kept per thread
+  static constexpr size_t bufferCapacity = 1 << 16;
+
+  void enable() { m_enabled.store(true, std::memory_order_relaxed); }
+  bool isEnabled() const { return m_enabled.load(std::memory_order_relaxed); }
+
+  uint64_t now() const
+  {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - m_epoch)
+      .count();
+  }
+
+  /*
+  * Buffer of the calling thread, taken on its first event: one returned by
+  * a finished thread (its events are kept, the lane of the trace is shared)
+  * or a new one.
+  */
+  TraceBuffer& threadBuffer()
+  {
+    thread_local BufferLease lease(*this);
+    if (lease.buffer == nullptr) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (!m_freeBuffers.empty()) {
+        lease.buffer = m_freeBuffers.back();
+        m_freeBuffers.pop_back();
+      } else {
+        m_buffers.push_back(
+          std::make_unique<TraceBuffer>(m_buffers.size() + 1, bufferCapacity));
+        lease.buffer = m_buffers.back().get();
+      }
+    }
+    return *lease.buffer;
+  }
+
+  /*
+  * Writes events of all threads as a Chrome trace. Threads must not record
+  * while the trace is written.
+  */
+  bool write(const std::string& path)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::ofstream ofs(path);
+    if (!ofs) {
+      std::cout << "Could not write trace to " << path << "\n";
+      return false;
+    }
+    ofs << "{\"traceEvents\":[\n";
+    bool first = true;
+    size_t dropped = 0;
+    for (const auto& buffer : m_buffers) {
+      ofs << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\","
+          << "\"pid\":1,\"tid\":" << buffer->threadId
+          << ",\"args\":{\"name\":\"thread " << buffer->threadId << "\"}}";
+      first = false;
+      const size_t kept = std::min(buffer->recorded, buffer->events.size());
+      dropped += buffer->recorded - kept;
+      for (size_t i = buffer->recorded - kept; i < buffer->recorded; i++) {
+        const auto& event = buffer->events[i % buffer->events.size()];
+        ofs << ",\n{\"name\":\"" << escape(event.name)
+            << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->threadId
+            << ",\"ts\":" << event.startMicroseconds
+            << ",\"dur\":" << event.durationMicroseconds << "}";
+      }
+    }
+    ofs << "\n]}\n";
+    std::cout << "Trace written to " << path;
+    if (dropped) {
+      std::cout << " (" << dropped << " oldest events overwritten)";
+    }
+    std::cout << "\n";
+    return true;
+  }
+
+private:
+  // hands the buffer of a thread back to the tracer when the thread exits
+  class BufferLease
+  {
+  public:
+    explicit BufferLease(Tracer& owner)
+      : owner(owner)
+    {
+    }
+
+    ~BufferLease()
+    {
+      if (buffer != nullptr) {
+        std::lock_guard<std::mutex> lock(owner.m_mutex);
+        owner.m_freeBuffers.push_back(buffer);
+      }
+    }
+
+    Tracer& owner;
+    TraceBuffer* buffer = nullptr;
+  };
+
+  static std::string escape(const char* text)
+  {
+    std::string escaped;
+    for (const char* c = text; *c; c++) {
+      if (*c == '"' || *c == '\\') {
+        escaped.push_back('\\');
+      }
+      escaped.push_back(*c);
+    }
+    return escaped;
+  }
+
+  std::atomic<bool> m_enabled{ false };
+  std::chrono::steady_clock::time_point m_epoch =
+    std::chrono::steady_clock::now();
+  std::mutex m_mutex;
+  std::vector<std::unique_ptr<TraceBuffer>> m_buffers;
+  // buffers of finished threads, reused by new threads
+  std::vector<TraceBuffer*> m_freeBuffers;
+};
+
+inline Tracer&
+tracer()
+{
+  static Tracer instance;
+  return instance;
+}
+
+/*
+* Records an event from construction to destruction on the calling thread.
+* The name is copied when the event ends.
+*/
+class TraceScope
+{
+public:
+  explicit TraceScope(const char* name)
+    : m_name(name)
+    , m_start(tracer().isEnabled() ? tracer().now() : 0)
+    , m_enabled(tracer().isEnabled())
+  {
+  }
+
+  // dynamic names are only built by callers when tracing is on, see traceName
+  explicit TraceScope(const std::string& name)
+    : TraceScope(name.c_str())
+  {
+    if (m_enabled) {
+      m_ownedName = name;
+      m_name = m_ownedName.c_str();
+    }
+  }
+
+  ~TraceScope()
+  {
+    if (m_enabled) {
+      tracer().threadBuffer().record(m_name, m_start, tracer().now() - m_start);
+    }
+  }
+
+  TraceScope(const TraceScope&) = delete;
+  TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+  const char* m_name;
+  uint64_t m_start;
+  bool m_enabled;
+  std::string m_ownedName;
+};
+
+// prefix + suffix when tracing, empty otherwise: no string work when off
+inline std::string
+traceName(const char* prefix, const std::string& suffix)
+{
+  return tracer().isEnabled() ? prefix + suffix : std::string();
+}
+
+/*
+* Enables tracing for its lifetime and writes the trace when it goes out of
+* scope. An empty path leaves tracing off.
+*/
+class TraceSession
+{
+public:
+  explicit TraceSession(const std::string& path)
+    : m_path(path.empty() ? path : std::filesystem::absolute(path).string())
+  {
+    if (!m_path.empty()) {
+      tracer().enable();
+    }
+  }
+
+  ~TraceSession()
+  {
+    if (!m_path.empty()) {
+      tracer().write(m_path);
+    }
+  }
+
+  TraceSession(const TraceSession&) = delete;
+  TraceSession& operator=(const TraceSession&) = delete;
+
+private:
+  std::string m_path;
+};
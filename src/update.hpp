@@ -0,0 +1,422 @@
+#pragma once
+
+#include "HydroDataReader.hpp"
+#include "aoi.hpp"
+#include "analysis.hpp"
+#include "bitmasks.hpp"
+#include "clustering.hpp"
+#include "gdal/gdal_priv.h"
+#include "labels.hpp"
+#include "manifest.hpp"
+#include "polarization.hpp"
+#include "rasters.hpp"
+#include "speckle.hpp"
+#include "stages.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+/*
+*
+* Incremental update (floodsar --update): scenes of the cache that are not
+* yet in the dates manifest of the last calibration are labelled with the
+* persisted calibration - the best threshold of each polarization (1D), or
+* the centroids, flood classes and input options of the best k (2D) - and
+* appended to the label store and the dates manifest. Nothing is clustered
+* again; mapper --update then writes maps of the new dates only.
+*
+*/
+
+inline std::string
+driftReportPath()
+{
+  return workPath(".floodsar-cache/drift.txt");
+}
+
+/*
+* Scenes of the cache dated after the last date of the dates manifest, with
+* a scene in every polarization. Elevation is the gauge value of the day,
+* NaN if there is none (new passes usually arrive before the gauge data).
+* Dates are appended to the stores, which are kept in date order: an older
+* scene missing from the manifest (e.g. one without gauge data at the
+* calibration) needs a full re-calibration and is only reported.
+*/
+inline std::vector<MatchedScene>
+findNewScenes(const SceneManifest& sceneManifest,
+              const SceneManifest& datesManifest,
+              const std::map<Date, double>& observations,
+              const std::vector<Polarization>& polarizations)
+{
+  const auto knownDates = datesManifest.dates();
+  const std::set<Date> known(knownDates.begin(), knownDates.end());
+  const Date lastDate = knownDates.empty() ? Date() : knownDates.back();
+  std::set<Date> older;
+  std::map<Date, double> pending;
+  for (const auto& entry : sceneManifest.entries) {
+    if (known.count(entry.date)) {
+      continue;
+    }
+    if (entry.date <= lastDate) {
+      older.insert(entry.date);
+      continue;
+    }
+    auto observation = observations.find(entry.date);
+    pending[entry.date] = observation != observations.end()
+                            ? observation->second
+                            : std::numeric_limits<double>::quiet_NaN();
+  }
+  if (!older.empty()) {
+    std::cout << older.size() << " dates of the cache before " << lastDate
+              << " are not calibrated, run floodsar without --update to "
+                 "include them\n";
+  }
+  return matchScenesWithGauge(sceneManifest, pending, polarizations);
+}
+
+/*
+* Whether a scene lies on the grid: same size and the same georeferencing,
+* coefficients equal up to a thousandth of a pixel.
+*/
+inline bool
+isOnGrid(const SceneEntry& scene, const GridInfo& grid)
+{
+  if (scene.xSize != grid.xSize || scene.ySize != grid.ySize) {
+    return false;
+  }
+  const double tolerance =
+    1e-3 * std::max(std::abs(grid.geoTransform[1]), std::abs(grid.geoTransform[5]));
+  for (int i = 0; i < 6; i++) {
+    if (std::abs(scene.geoTransform[i] - grid.geoTransform[i]) > tolerance) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// pixels of a new scene inside the area, empty if it is not on the grid
+inline std::vector<double>
+readNewScene(const SceneEntry& scene,
+             const GridInfo& grid,
+             const AoiMask& aoiMask,
+             ScopedStage& stage)
+{
+  std::vector<double> values;
+  if (!isOnGrid(scene, grid)) {
+    std::cout << "Skipping " << scene.cacheKey << ": " << scene.xSize << "x"
+              << scene.ySize << " at " << scene.geoTransform[0] << ", "
+              << scene.geoTransform[3] << " is not the grid of the calibration ("
+              << grid.xSize << "x" << grid.ySize << " at " << grid.geoTransform[0]
+              << ", " << grid.geoTransform[3] << ")\n";
+    return values;
+  }
+  auto dataset =
+    static_cast<GDALDataset*>(GDALOpen(scene.cacheKey.c_str(), GA_ReadOnly));
+  if (dataset == nullptr) {
+    std::cout << "Could not open " << scene.cacheKey << "\n";
+    return values;
+  }
+  getPixelValuesFromRaster(dataset, values);
+  GDALClose(dataset);
+  stage.addPixels(values.size());
+  stage.addBytesRead(getFileSize(scene.cacheKey));
+  applyAoiMask(values, aoiMask);
+  return values;
+}
+
+/*
+* Drift check: flooded areas of the dates already in the flood mask cube are
+* fitted linearly to the gauge. A new date whose flooded area is more than maxSigma
+* residual standard deviations off the line suggests the calibration no
+* longer holds (e.g. seasonal vegetation, another orbit) and a full
+* re-calibration is warranted. Dates without a gauge value are not checked.
+* Areas are popcounts of the cube, the labels are not read again.
+* @param calibrationDates dates at the start of the cube the line is fitted to
+* @return number of dates off the line
+*/
+inline size_t
+checkDrift(const std::string& cubePath,
+           const std::vector<Date>& dates,
+           const std::map<Date, double>& observations,
+           size_t calibrationDates,
+           double maxSigma,
+           std::ofstream& report)
+{
+  const FloodMaskCube cube(cubePath);
+  const auto floodedAreas = cube.floodedAreas();
+  const std::vector<double> areas(floodedAreas.begin(), floodedAreas.end());
+
+  // least squares line area = a + b * gauge
+  double n = 0, sumX = 0, sumY = 0, sumXY = 0, sumXX = 0;
+  for (size_t i = 0; i < calibrationDates && i < areas.size(); i++) {
+    auto observation = observations.find(dates[i]);
+    if (observation == observations.end()) {
+      continue;
+    }
+    const double x = observation->second;
+    n++;
+    sumX += x;
+    sumY += areas[i];
+    sumXY += x * areas[i];
+    sumXX += x * x;
+  }
+  const double denominator = n * sumXX - sumX * sumX;
+  if (n < 3 || denominator == 0.0) {
+    std::cout << "Drift check: too few calibration dates with gauge data\n";
+    return 0;
+  }
+  const double slope = (n * sumXY - sumX * sumY) / denominator;
+  const double intercept = (sumY - slope * sumX) / n;
+  double squares = 0.0;
+  for (size_t i = 0; i < calibrationDates && i < areas.size(); i++) {
+    auto observation = observations.find(dates[i]);
+    if (observation != observations.end()) {
+      const double residual = areas[i] - intercept - slope * observation->second;
+      squares += residual * residual;
+    }
+  }
+  const double sigma = std::sqrt(squares / (n - 2));
+
+  size_t drifted = 0;
+  for (size_t i = calibrationDates; i < areas.size() && i < dates.size(); i++) {
+    auto observation = observations.find(dates[i]);
+    if (observation == observations.end()) {
+      std::cout << "Drift check " << dates[i] << ": no gauge data\n";
+      continue;
+    }
+    const double expected = intercept + slope * observation->second;
+    const double deviation =
+      sigma > 0.0 ? std::abs(areas[i] - expected) / sigma : 0.0;
+    std::cout << "Drift check " << dates[i] << ": flooded area " << areas[i]
+              << ", expected " << expected << " from the gauge ("
+              << deviation << " sigma)\n";
+    if (deviation > maxSigma) {
+      report << cubePath << " " << dates[i] << " " << deviation << "\n";
+      drifted++;
+    }
+  }
+  return drifted;
+}
+
+// appends labels of new scenes of one polarization with the best threshold
+inline size_t
+updateThresholdLabels(const std::string& polarization,
+                      const SceneManifest& sceneManifest,
+                      const std::map<Date, double>& observations,
+                      double driftSigma,
+                      std::ofstream& driftReport)
+{
+  SceneManifest datesManifest;
+  std::ifstream thresholdStream(bestThresholdPath(polarization));
+  double threshold;
+  if (!readSceneManifest(matchedScenesPath(polarization), datesManifest) ||
+      !(thresholdStream >> threshold)) {
+    std::cout << "No " << polarization
+              << " calibration in the cache, run floodsar without --update "
+                 "first\n";
+    return 0;
+  }
+  if (!useCalibrationSpeckleFilter(thresholdSpecklePath(polarization))) {
+    return 0;
+  }
+  const GridInfo grid = datesManifest.grid();
+  const AoiMask aoiMask =
+    loadAoiMask(static_cast<size_t>(grid.xSize) * grid.ySize);
+  const auto newScenes = findNewScenes(
+    sceneManifest, datesManifest, observations, { stringToPol(polarization) });
+  std::cout << polarization << ": " << newScenes.size()
+            << " new dates, threshold " << threshold << "\n";
+  if (newScenes.empty()) {
+    return 0;
+  }
+
+  const size_t calibrationDates = datesManifest.entries.size();
+  {
+    ScopedStage stage("label");
+    LabelStoreWriter writer(
+      thresholdLabelsPath(polarization), aoiMask.validWords(), true);
+    if (!writer.isOpen()) {
+      return 0;
+    }
+    for (const auto& match : newScenes) {
+      const auto values = readNewScene(*match.scenes[0], grid, aoiMask, stage);
+      if (values.size() != aoiMask.validWords()) {
+        continue;
+      }
+      std::vector<unsigned char> labels;
+      getThresholdingLabels(values, threshold, labels);
+      writer.append(labels.data());
+      datesManifest.entries.push_back(*match.scenes[0]);
+    }
+    writer.close();
+  }
+  writeSceneManifest(matchedScenesPath(polarization), datesManifest);
+  writeFloodMaskCube(thresholdMaskCubePath(polarization),
+                     thresholdLabelsPath(polarization),
+                     createFloodLookup({ 1 }),
+                     datesManifest.dates(),
+                     grid.xSize,
+                     grid.ySize,
+                     aoiMask);
+
+  if (driftSigma > 0) {
+    checkDrift(thresholdMaskCubePath(polarization),
+               datesManifest.dates(),
+               observations,
+               calibrationDates,
+               driftSigma,
+               driftReport);
+  }
+  return datesManifest.entries.size() - calibrationDates;
+}
+
+// appends labels of new VH and VV pairs with the centroids of the best k
+inline size_t
+updateKMeansLabels(const SceneManifest& sceneManifest,
+                   const std::map<Date, double>& observations,
+                   double driftSigma,
+                   std::ofstream& driftReport)
+{
+  SceneManifest datesManifest;
+  std::ifstream bestClassStream(bestClassPath());
+  int numAllClasses = 0;
+  int numFloodClasses = 0;
+  std::vector<double> maxValueDbl;
+  bool convToDB = false;
+  if (!readSceneManifest(matchedScenesPath(), datesManifest) ||
+      !(bestClassStream >> numAllClasses >> numFloodClasses) ||
+      !readKMeansInputOptions(maxValueDbl, convToDB)) {
+    std::cout << "No 2D calibration in the cache, run floodsar without "
+                 "--update first\n";
+    return 0;
+  }
+  if (!useCalibrationSpeckleFilter(kmeansSpecklePath())) {
+    return 0;
+  }
+
+  std::vector<double> centroidsVH;
+  std::vector<double> centroidsVV;
+  std::ifstream clustersStream(kmeansClustersPath(numAllClasses));
+  double centerVH, centerVV;
+  while (clustersStream >> centerVH >> centerVV) {
+    centroidsVH.push_back(centerVH);
+    centroidsVV.push_back(centerVV);
+  }
+  std::vector<unsigned int> floodClasses;
+  std::ifstream floodClassesStream(kmeansClustersPath(numAllClasses) + "_" +
+                                   std::to_string(numFloodClasses) +
+                                   "_floodclasses.txt");
+  unsigned int floodClass;
+  while (floodClassesStream >> floodClass) {
+    floodClasses.push_back(floodClass);
+  }
+  if (centroidsVH.size() != static_cast<size_t>(numAllClasses) ||
+      floodClasses.empty()) {
+    std::cout << "Centroids or flood classes of k = " << numAllClasses
+              << " missing from the cache\n";
+    return 0;
+  }
+
+  const GridInfo grid = datesManifest.grid();
+  const AoiMask aoiMask =
+    loadAoiMask(static_cast<size_t>(grid.xSize) * grid.ySize);
+  const auto newScenes =
+    findNewScenes(sceneManifest,
+                  datesManifest,
+                  observations,
+                  { Polarization::VH, Polarization::VV });
+  std::cout << "VH+VV: " << newScenes.size() << " new dates, k = "
+            << numAllClasses << ", flood classes " << numFloodClasses << "\n";
+  if (newScenes.empty()) {
+    return 0;
+  }
+
+  const size_t calibrationDates = datesManifest.entries.size();
+  {
+    ScopedStage stage("label");
+    LabelStoreWriter writer(
+      kmeansLabelsPath(numAllClasses), aoiMask.validWords(), true);
+    if (!writer.isOpen()) {
+      return 0;
+    }
+    for (const auto& match : newScenes) {
+      auto vh = readNewScene(*match.scenes[0], grid, aoiMask, stage);
+      auto vv = readNewScene(*match.scenes[1], grid, aoiMask, stage);
+      if (vh.size() != aoiMask.validWords() || vv.size() != vh.size()) {
+        continue;
+      }
+      prepareKMeansInput(vh, vv, maxValueDbl, convToDB);
+      std::vector<unsigned char> labels(vh.size());
+      labelPixels(
+        vh.data(), vv.data(), vh.size(), centroidsVH, centroidsVV, labels.data());
+      writer.append(labels.data());
+      // the dates manifest of 2D holds the VV scenes
+      datesManifest.entries.push_back(*match.scenes[1]);
+    }
+    writer.close();
+  }
+  writeSceneManifest(matchedScenesPath(), datesManifest);
+  writeFloodMaskCube(kmeansMaskCubePath(),
+                     kmeansLabelsPath(numAllClasses),
+                     createFloodLookup(floodClasses),
+                     datesManifest.dates(),
+                     grid.xSize,
+                     grid.ySize,
+                     aoiMask);
+
+  if (driftSigma > 0) {
+    checkDrift(kmeansMaskCubePath(),
+               datesManifest.dates(),
+               observations,
+               calibrationDates,
+               driftSigma,
+               driftReport);
+  }
+  return datesManifest.entries.size() - calibrationDates;
+}
+
+/*
+* Labels scenes added to the cache since the last calibration.
+* @param driftSigma enables the drift check, 0 = off
+*/
+inline int
+runUpdate(const AnalysisConfig& config, double driftSigma)
+{
+  const StageReportScope stageReportScope;
+  const SceneManifest sceneManifest = loadOrBuildSceneManifest();
+  std::map<Date, double> observations;
+  HydroDataReader hydroReader;
+  hydroReader.readFile(observations, config.hydroDataCsvFile);
+
+  std::ofstream driftReport;
+  if (driftSigma > 0) {
+    driftReport.open(driftReportPath());
+  }
+  size_t added = 0;
+  if (config.isSinglePolVersion) {
+    for (const std::string polarization : { "VH", "VV" }) {
+      added += updateThresholdLabels(
+        polarization, sceneManifest, observations, driftSigma, driftReport);
+    }
+  } else {
+    added = updateKMeansLabels(sceneManifest, observations, driftSigma, driftReport);
+  }
+  std::cout << "Update: " << added << " dates labelled\n";
+
+  if (driftSigma > 0) {
+    driftReport.close();
+    if (getFileSize(driftReportPath()) > 0) {
+      std::cout << "DRIFT: flooded areas of new dates do not follow the "
+                   "gauge like the calibration did, a full re-calibration is "
+                   "recommended (see "
+                << driftReportPath() << ")\n";
+    }
+  }
+  return 0;
+}
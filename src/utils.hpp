@@ -1,11 +1,24 @@
 #pragma once
 
 #include "types.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
 #include <chrono>
 #include <cmath>
+#include <cstdio>
+#include <ctime>
+#include <filesystem>
+#include <functional>
+#include <iomanip>
 #include <iostream>
+#include <map>
+#include <sstream>
+#include <thread>
 #include <vector>
 
+namespace fs = std::filesystem;
+
 struct ClassifiedCentroid
 {
   double vh;
@@ -40,12 +53,22 @@ struct compareBySum
   }
 };
 
-std::string
+// local time with milliseconds, e.g. 2024-05-17 14:03:27.512
+inline std::string
 getCurrentTimeString()
 {
-  auto t = std::chrono::system_clock::now();
-  // TODO implement
-  return "_";
+  const auto now = std::chrono::system_clock::now();
+  const std::time_t t = std::chrono::system_clock::to_time_t(now);
+  const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    now.time_since_epoch())
+                    .count() %
+                  1000;
+  std::tm local{};
+  localtime_r(&t, &local);
+  std::stringstream ss;
+  ss << std::put_time(&local, "%Y-%m-%d %H:%M:%S") << "." << std::setfill('0')
+     << std::setw(3) << ms;
+  return ss.str();
 }
 
 #define LOG(msg, x...)                                                         \
@@ -54,24 +77,29 @@ getCurrentTimeString()
     fflush(stdout);                                                            \
   } while (0)
 
-// I am not convinced it should really be returned by value ugh
-std::vector<double>
+// start, start + step, ... up to end. Every value is computed from its index,
+// accumulating the step would drift at fine steps.
+inline std::vector<double>
 createSequence(double start, double end, double step)
 {
   std::vector<double> outputVector;
+  if (step <= 0.0 || end < start) {
+    outputVector.push_back(start);
+    return outputVector;
+  }
 
-  double i = start;
-
-  while (i <= end) {
-    outputVector.push_back(i);
-    i += step;
+  // tolerance: end itself belongs to the sequence despite rounding
+  const size_t count =
+    static_cast<size_t>(std::floor((end - start) / step + 1e-9)) + 1;
+  for (size_t i = 0; i < count; i++) {
+    outputVector.push_back(start + i * step);
   }
 
   return outputVector;
 }
 
 // calculate Pearson correlation of two equally sized vectors
-double
+inline double
 calcCorrelationCoeff(std::vector<unsigned int>& floodedAreaVals,
                      std::vector<double>& riverGaugeVals)
 {
@@ -106,7 +134,7 @@ calcCorrelationCoeff(std::vector<unsigned int>& floodedAreaVals,
 }
 
 //Converts hydrological date format to standard date format yyyymmdd
-Date
+inline Date
 hydrologicalToNormalDate(std::string_view year,
                          std::string_view month,
                          std::string_view day)
@@ -158,7 +186,7 @@ hydrologicalToNormalDate(std::string_view year,
 }
 
 //utility function that prints obsElevationMaps to console
-void
+inline void
 printMap(const std::map<std::string, double>& m)
 {
   for (const auto& [key, value] : m) {
@@ -167,16 +195,101 @@ printMap(const std::map<std::string, double>& m)
   std::cout << '\n';
 }
 
-//creates neccasary local files 
-void
-createCacheDirectoryIfNotExists()
+/*
+* Directory holding the .floodsar-cache and mapped folders the analysis
+* works on; empty for the current directory. Batch jobs set their own
+* directory for the duration of their analysis (see WorkDirectoryScope), the
+* current directory of the process never changes.
+*/
+inline std::string&
+workDirectory()
+{
+  static std::string directory;
+  return directory;
+}
+
+// path of a cache or output file inside the work directory
+inline std::string
+workPath(const std::string& path)
+{
+  return workDirectory().empty() ? path : (fs::path(workDirectory()) / path).string();
+}
+
+// sets the work directory, restores the previous one when leaving the scope
+class WorkDirectoryScope
+{
+public:
+  explicit WorkDirectoryScope(const std::string& directory)
+    : m_previous(workDirectory())
+  {
+    workDirectory() = directory;
+  }
+  ~WorkDirectoryScope() { workDirectory() = m_previous; }
+  WorkDirectoryScope(const WorkDirectoryScope&) = delete;
+  WorkDirectoryScope& operator=(const WorkDirectoryScope&) = delete;
+
+private:
+  std::string m_previous;
+};
+
+//creates neccasary local files, in the given directory
+inline void
+createCacheDirectoryIfNotExists(const fs::path& base = ".")
+{
+  fs::create_directories(base / ".floodsar-cache");
+  fs::create_directory(base / ".floodsar-cache/cropped");
+  fs::create_directory(base / ".floodsar-cache/vrt");
+  fs::create_directory(base / ".floodsar-cache/reprojected");
+  fs::create_directory(base / ".floodsar-cache/kmeans_inputs");
+  fs::create_directory(base / ".floodsar-cache/kmeans_outputs");
+  fs::create_directory(base / ".floodsar-cache/1d_output");
+}
+
+// "_EPSG_32630" for "EPSG:32630", usable in file names; empty for empty code
+inline std::string
+toFileNameToken(const std::string& code)
+{
+  if (code.empty()) {
+    return "";
+  }
+  std::string token = "_" + code;
+  std::replace_if(
+    token.begin(), token.end(), [](char c) { return !std::isalnum(static_cast<unsigned char>(c)) && c != '_'; }, '_');
+  return token;
+}
+
+/*
+* Runs task(i) for every i in [0, count) on a fixed pool of threads.
+* Tasks are handed out one by one, so uneven task durations balance out.
+* @param maxThreads limits the pool, 0 means hardware concurrency
+*/
+inline void
+parallelFor(size_t count,
+            const std::function<void(size_t)>& task,
+            unsigned int maxThreads = 0)
 {
-  fs::create_directory(".floodsar-cache");
-  fs::create_directory(".floodsar-cache/cropped");
-  fs::create_directory(".floodsar-cache/vrt");
-  fs::create_directory(".floodsar-cache/reprojected");
-  fs::create_directory(".floodsar-cache/proj4");
-  fs::create_directory(".floodsar-cache/kmeans_inputs");
-  fs::create_directory(".floodsar-cache/kmeans_outputs");
-  fs::create_directory(".floodsar-cache/1d_output");
-}
\ No newline at end of file
+  unsigned int numThreads = maxThreads;
+  if (numThreads == 0) {
+    numThreads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  if (numThreads > count) {
+    numThreads = count;
+  }
+
+  std::atomic<size_t> next{ 0 };
+  auto worker = [&]() {
+    for (size_t i = next++; i < count; i = next++) {
+      task(i);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned int t = 1; t < numThreads; t++) {
+    threads.push_back(std::thread(worker));
+  }
+  worker();
+
+  for (auto& th : threads) {
+    th.join();
+  }
+}
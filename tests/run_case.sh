@@ -0,0 +1,208 @@
+#!/usr/bin/env bash
+#
+# End-to-end regression case of floodsar, see tests/CMakeLists.txt.
+# Generates a synthetic stack with floodsar_synth, runs floodsar and mapper on
+# it and compares the best configuration, correlations and checksums of the
+# maps with a golden file. Flooded areas of the flood mask cube and the
+# correlation are also checked against the truth floodsar_synth generated,
+# which holds on any platform. Wall time and peak memory of floodsar are
+# checked against limits. With FLOODSAR_BLESS=1 the golden file is written
+# instead; a case without a golden file checks the truth only.
+#
+# Exit codes: 0 pass, 1 fail, 77 skipped (no GDAL tools).
+#
+set -euo pipefail
+
+skip=77
+binDir=""
+workDir=""
+golden=""
+algo="1D"
+size=256
+dates=12
+maxSeconds=0
+maxRssMb=0
+compareOnly=0
+# Detected areas are a linear function of the true ones plus speckle noise:
+# a threshold or class choice takes the same share of water and of land on
+# every date, and the correlation floodsar maximizes does not see that
+# share. So areas are compared by their correlation with the true areas,
+# not one by one. Speckle of 4.4 looks misclassifies about 0.2% of pixels at
+# the best threshold of the synthetic backscatter.
+minAreaCorrelation=0.99
+# correlation with the gauge may be off the one of the true areas by this much
+correlationTolerance=0.05
+
+while [ $# -gt 0 ]; do
+  case "$1" in
+    --bin-dir) binDir=$2; shift 2 ;;
+    --work-dir) workDir=$2; shift 2 ;;
+    --golden) golden=$2; shift 2 ;;
+    --algo) algo=$2; shift 2 ;;
+    --size) size=$2; shift 2 ;;
+    --dates) dates=$2; shift 2 ;;
+    --max-seconds) maxSeconds=$2; shift 2 ;;
+    --max-rss-mb) maxRssMb=$2; shift 2 ;;
+    # variants of a case share its golden file but never bless it
+    --compare-only) compareOnly=1; shift ;;
+    --) shift; break ;;
+    *) echo "run_case.sh: unknown argument $1"; exit 2 ;;
+  esac
+done
+extraArgs=("$@")
+
+bless=0
+if [ "${FLOODSAR_BLESS:-0}" = "1" ] && [ "$compareOnly" = "0" ]; then
+  bless=1
+fi
+
+# floodsar calls gdalwarp and gdalbuildvrt, checksums come from gdalinfo
+for tool in gdalinfo gdalwarp gdalbuildvrt; do
+  if ! command -v "$tool" > /dev/null; then
+    echo "SKIP: $tool not found"
+    exit $skip
+  fi
+done
+rm -rf "$workDir"
+mkdir -p "$workDir"
+cd "$workDir"
+
+"$binDir/floodsar_synth" -o synth -x "$size" -y "$size" -n "$dates" --seed 7 \
+  > synth.log
+
+if [ "$algo" = "1D" ]; then
+  algoArgs=(-a 1D -n 0.001,0.1,0.001)
+else
+  # fixed seed: k-means sampling and initialization are reproducible
+  algoArgs=(-a 2D -n 2,5 -l -k 50 -f 0.5 --seed 11)
+fi
+
+start=$(date +%s.%N)
+if ! "$binDir/floodsar" "${algoArgs[@]}" -o synth/aoi.tif -d synth/images \
+  -p EPSG:32610 -g synth/gauge.csv ${extraArgs[@]+"${extraArgs[@]}"} > floodsar.log 2>&1; then
+  cat floodsar.log
+  echo "FAIL: floodsar exited with an error"
+  exit 1
+fi
+end=$(date +%s.%N)
+seconds=$(awk -v s="$start" -v e="$end" 'BEGIN { printf "%.2f", e - s }')
+peakRssMb=$(sed -n 's/^  "peak_rss_bytes": \([0-9]*\)$/\1/p' \
+  .floodsar-cache/stages.json | awk '{ printf "%.1f", $1 / 1e6 }')
+
+{
+  if [ "$algo" = "1D" ]; then
+    # results of VH, then VV
+    awk '/best threshold:/ { pol = (n++ == 0) ? "VH" : "VV";
+      print "threshold_" pol "=" $3; print "correlation_" pol "=" $8 }' \
+      floodsar.log
+    "$binDir/mapper" -b VV > mapper.log 2>&1
+    "$binDir/mapper" -b VH >> mapper.log 2>&1
+  else
+    read -r classes floodClasses < .floodsar-cache/kmeans_outputs/best.txt
+    echo "classes=$classes"
+    echo "flood_classes=$floodClasses"
+    sed -n 's/^RESULTS: Best config is: coeff\/all classes\/flood classes \([^ ]*\) .*/correlation=\1/p' \
+      floodsar.log
+    "$binDir/mapper" -a > mapper.log 2>&1
+  fi
+  # checksums of the first band of all maps, overviews excluded
+  for map in $(find mapped -name '*.tif' | sort); do
+    echo "$map $(gdalinfo -checksum "$map" | sed -n 's/^ *Checksum=//p' | head -1)"
+  done | md5sum | awk '{ print "maps_checksum=" $1 }'
+} > results.txt
+
+echo "wall_seconds=$seconds peak_rss_mb=$peakRssMb"
+cat results.txt
+
+status=0
+# the truth: flooded pixels of every date and their correlation with the gauge
+if [ "$algo" = "1D" ]; then
+  areaQueries=("-b VH" "-b VV")
+else
+  areaQueries=("-a")
+fi
+for query in "${areaQueries[@]}"; do
+  # shellcheck disable=SC2086
+  if ! "$binDir/mapper" $query --areas > areas.csv 2>&1; then
+    cat areas.csv
+    echo "FAIL: mapper $query --areas exited with an error"
+    status=1
+    continue
+  fi
+  if ! awk -F, -v minimum="$minAreaCorrelation" -v query="$query" '
+    NR == FNR { truth[$1] = $2; next }
+    $1 in truth && !($1 in seen) {
+      seen[$1] = 1
+      n++; x = truth[$1]; y = $2
+      sx += x; sy += y; sxx += x * x; syy += y * y; sxy += x * y
+    }
+    END {
+      for (date in truth) {
+        if (!(date in seen)) { print "AREA " query " " date ": not in the mask cube"; failed = 1 }
+      }
+      vx = n * sxx - sx * sx; vy = n * syy - sy * sy
+      r = (vx > 0 && vy > 0) ? (n * sxy - sx * sy) / sqrt(vx * vy) : 0
+      print "area_correlation " query "=" r
+      if (r < minimum) { print "AREA " query ": correlation with the true areas " r ", minimum " minimum; failed = 1 }
+      exit failed
+    }' synth/truth.csv areas.csv; then
+    status=1
+  fi
+done
+if ! awk -F= -v truth="$(cat synth/correlation.txt)" -v tolerance="$correlationTolerance" '
+  $1 ~ /^correlation/ {
+    found = 1
+    diff = $2 - truth; if (diff < 0) diff = -diff
+    if (diff > tolerance) { print "CORRELATION " $1 ": truth " truth ", got " $2; failed = 1 }
+  }
+  END { if (!found) print "CORRELATION: none reported"; exit failed || !found }' results.txt; then
+  status=1
+fi
+
+if [ "$bless" = "1" ]; then
+  if [ "$status" != "0" ]; then
+    echo "FAIL: results are off the truth, $golden not blessed"
+    exit 1
+  fi
+  mkdir -p "$(dirname "$golden")"
+  {
+    echo "# golden values of $(basename "$golden" .golden), written by FLOODSAR_BLESS=1"
+    cat results.txt
+  } > "$golden"
+  echo "Blessed $golden"
+  exit 0
+fi
+
+if [ ! -f "$golden" ]; then
+  echo "NOTE: no golden file $golden, only the synthetic truth is checked;" \
+    "create it with FLOODSAR_BLESS=1"
+# numbers match up to a relative 1e-6, everything else exactly
+elif ! awk -F= '
+  NR == FNR { if ($0 !~ /^#/ && NF == 2) expected[$1] = $2; next }
+  { actual[$1] = $2 }
+  END {
+    failed = 0
+    for (key in expected) {
+      a = actual[key]; e = expected[key]
+      numeric = (a ~ /^-?[0-9.]+(e-?[0-9]+)?$/ && e ~ /^-?[0-9.]+(e-?[0-9]+)?$/)
+      diff = a - e; if (diff < 0) diff = -diff
+      scale = e < 0 ? -e : e; if (scale < 1) scale = 1
+      if (!(key in actual) || (numeric && diff > 1e-6 * scale) || (!numeric && a != e)) {
+        print "MISMATCH " key ": expected " e ", got " a
+        failed = 1
+      }
+    }
+    exit failed
+  }' "$golden" results.txt; then
+  status=1
+fi
+
+if awk -v s="$seconds" -v m="$maxSeconds" 'BEGIN { exit !(m > 0 && s > m) }'; then
+  echo "SLOW: floodsar took $seconds s, limit $maxSeconds s"
+  status=1
+fi
+if awk -v r="$peakRssMb" -v m="$maxRssMb" 'BEGIN { exit !(m > 0 && r > m) }'; then
+  echo "MEMORY: floodsar peak RSS $peakRssMb MB, limit $maxRssMb MB"
+  status=1
+fi
+exit $status